@@ -0,0 +1,16 @@
+#!/bin/bash
+# 提前编译基准测试: 把bench中的脚本编译成可执行程序,对比解释执行和提前编译后的耗时
+# 运行: bash bench/aot.sh [脚本...], 默认为下面列出的bench脚本
+CCC=${CCC:-./ccc}
+SCRIPTS=${@:-bench/fib.ccc bench/method_call.ccc bench/numeric_loop.ccc bench/for_range.ccc bench/const_fold.ccc}
+DIR=$(mktemp -d)
+TIMEFORMAT=%R
+
+for f in $SCRIPTS; do
+    name=$(basename $f .ccc)
+    make -s aot SCRIPT=$f AOT_OUT=$DIR/$name || exit 1
+    interp=$( { time $CCC $f > /dev/null; } 2>&1 )
+    aot=$( { time $DIR/$name > /dev/null; } 2>&1 )
+    echo "$name: interpreted ${interp}s, aot ${aot}s"
+done
+rm -rf $DIR
@@ -0,0 +1,29 @@
+#!/bin/bash
+# 编译期基准测试: 生成含大量模块变量、类和方法签名的大模块,统计编译并运行它的耗时
+# 运行: bash bench/compile_big.sh [类的数量,默认2000]
+# 每个类带一个模块级函数和5个互不相同的方法签名,模块变量和方法名都随类的数量线性增长
+CCC=${CCC:-./ccc}
+N=${1:-2000}
+DIR=$(mktemp -d)
+SRC=$DIR/compile_big.ccc
+
+i=0
+while [ $i -lt $N ]; do
+    echo "var V$i = $i"
+    echo "class K$i {"
+    echo "    var f"
+    echo "    new(a) { f = a }"
+    echo "    get$i { f }"
+    echo "    add$i(x) { return f + x }"
+    echo "    mix$i(x, y) { return add$i(x) * y + V$i }"
+    echo "    static make$i(a) { return K$i.new(a) }"
+    echo "}"
+    echo "fun f$i(a) { return K$i.make$i(a).mix$i(a, V$i) }"
+    i=$((i + 1))
+done > $SRC
+echo "System.print(f0(1) + f$((N - 1))(2))" >> $SRC
+
+echo "module: $N classes, $(wc -l < $SRC) lines"
+# 源码是新生成的,不会命中.cccb字节码缓存
+time $CCC $SRC
+rm -rf $DIR
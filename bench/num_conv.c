@@ -0,0 +1,109 @@
+// 数字与字符串互转的吞吐量: numConv与libc的sprintf/strtod对比,分随机double和随机整数两组
+// 运行: cc -O2 -I include bench/num_conv.c include/numConv.c -o num_conv && ./num_conv
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "numConv.h"
+
+#define COUNT 1000000
+
+static uint64_t seed = 88172645463325252ULL;
+
+static uint64_t nextRandom(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double seconds) {
+    printf("%-28s %8.1f ns/op %8.2f M/s\n", name, seconds * 1e9 / COUNT, COUNT / seconds / 1e6);
+}
+
+static void run(const char* kind, double* nums) {
+    static char texts[COUNT][NUM_CHARS_MAX];
+    char buf[NUM_CHARS_MAX];
+    char name[64];
+    uint64_t sink = 0;
+    uint32_t idx;
+
+    double start = now();
+    idx = 0;
+    while (idx < COUNT) {
+        sink += sprintf(buf, "%.14g", nums[idx]);
+        idx++;
+    }
+    snprintf(name, sizeof(name), "%s sprintf %%.14g", kind);
+    report(name, now() - start);
+
+    start = now();
+    idx = 0;
+    while (idx < COUNT) {
+        sink += sprintf(buf, "%.17g", nums[idx]);
+        idx++;
+    }
+    snprintf(name, sizeof(name), "%s sprintf %%.17g", kind);
+    report(name, now() - start);
+
+    start = now();
+    idx = 0;
+    while (idx < COUNT) {
+        sink += num2Chars(nums[idx], texts[idx]);
+        idx++;
+    }
+    snprintf(name, sizeof(name), "%s num2Chars", kind);
+    report(name, now() - start);
+
+    double sum = 0;
+    start = now();
+    idx = 0;
+    while (idx < COUNT) {
+        sum += strtod(texts[idx], NULL);
+        idx++;
+    }
+    snprintf(name, sizeof(name), "%s strtod", kind);
+    report(name, now() - start);
+
+    start = now();
+    idx = 0;
+    while (idx < COUNT) {
+        sum += chars2Num(texts[idx], NULL);
+        idx++;
+    }
+    snprintf(name, sizeof(name), "%s chars2Num", kind);
+    report(name, now() - start);
+
+    // 防止编译器删去循环
+    printf("(%llu %g)\n", (unsigned long long)sink, sum);
+}
+
+int main(void) {
+    static double nums[COUNT];
+    uint32_t idx = 0;
+    while (idx < COUNT) {
+        // 随机位模式的有限double
+        uint64_t bits = nextRandom();
+        memcpy(&nums[idx], &bits, sizeof(double));
+        if (nums[idx] != nums[idx] || nums[idx] - nums[idx] != 0) {
+            continue;
+        }
+        idx++;
+    }
+    run("double", nums);
+
+    idx = 0;
+    while (idx < COUNT) {
+        nums[idx] = (double)(int64_t)(nextRandom() % 2000000000) - 1000000000;
+        idx++;
+    }
+    run("integer", nums);
+    return 0;
+}
@@ -5,6 +5,36 @@
 #include "utils.h"
 #include "vm.h"
 #include "core.h"
+#include "jit.h"
+
+// 命令行中的回收参数,在环境变量之后应用,故优先于环境变量
+static const char* heapGrowthFactorArg = NULL;
+static const char* minHeapSizeArg = NULL;
+// --jit或--jit-threshold指定的jit编译阈值,0表示未指定
+static uint32_t jitThresholdArg = 0;
+
+static VM* newConfiguredVM(void) {
+    VM* vm = newVM();
+    if (heapGrowthFactorArg != NULL) {
+        configSetHeapGrowthFactor(&vm->config, heapGrowthFactorArg);
+    }
+    if (minHeapSizeArg != NULL) {
+        configSetMinHeapSize(&vm->config, minHeapSizeArg);
+    }
+    if (jitThresholdArg != 0) {
+        vm->config.jitThreshold = jitThresholdArg;
+    }
+    return vm;
+}
+
+// 解析"--name=value"形式的选项,是则返回value,否则返回NULL
+static const char* optionValue(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+        return arg + len + 1;
+    }
+    return NULL;
+}
 
 static void runFile(const char* path) {
     const char* lastSlash = strrchr(path, '/');
@@ -14,13 +44,25 @@ static void runFile(const char* path) {
         root[lastSlash - path + 1] = '\0';
         rootDir = root;
     }
-    VM* vm = newVM(); 
+    VM* vm = newConfiguredVM();
     const char* sourceCode = readFile(path);
-    executeModule(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode);
+    executeModule(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode, path);
+}
+
+// 编译path处的脚本,为其生成c代码写入outputPath
+static void compileFileToC(const char* path, const char* outputPath) {
+#if AOT
+    VM* vm = newConfiguredVM();
+    const char* sourceCode = readFile(path);
+    compileModuleToC(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode, outputPath);
+#else
+    fprintf(stderr, "aot is disabled in this build, %s is not compiled to %s\n", path, outputPath);
+    exit(1);
+#endif
 }
 
 static void runCli(void) {
-    VM* vm = newVM();
+    VM* vm = newConfiguredVM();
     char sourceLine[MAX_LINE_LEN];
     char source[MAX_SOURCE_CODE_LEN];
     char endStr = '\n';
@@ -43,7 +85,7 @@ static void runCli(void) {
         if (strlen(source) >= MAX_SOURCE_CODE_LEN) {
             IO_ERROR("source code len exceeded %d", MAX_SOURCE_CODE_LEN);
         } else if (endStr != '\\') {
-            executeModule(vm, OBJ_TO_VALUE(newObjString(vm, "cli", 3)), source);
+            executeModule(vm, OBJ_TO_VALUE(newObjString(vm, "cli", 3)), source, NULL);
         } else {
             source[strlen(source)-2] = ' ';
         }
@@ -53,8 +95,54 @@ static void runCli(void) {
 }
 
 int main(int argc, const char** argv) {
+    // 先取出文件参数之前的回收参数,config只用来校验参数值,清零后再使用
+    Configuration config = {0};
+    int argIdx = 1;
+    while (argIdx < argc && strncmp(argv[argIdx], "--", 2) == 0) {
+        const char* value;
+        if ((value = optionValue(argv[argIdx], "--heap-growth-factor")) != NULL) {
+            if (!configSetHeapGrowthFactor(&config, value)) {
+                fprintf(stderr, "invalid heap growth factor: %s\n", value);
+                return 1;
+            }
+            heapGrowthFactorArg = value;
+        } else if ((value = optionValue(argv[argIdx], "--min-heap-size")) != NULL) {
+            if (!configSetMinHeapSize(&config, value)) {
+                fprintf(stderr, "invalid min heap size: %s\n", value);
+                return 1;
+            }
+            minHeapSizeArg = value;
+        } else if (strcmp(argv[argIdx], "--jit") == 0) {
+            jitThresholdArg = JIT_HOT_THRESHOLD;
+        } else if ((value = optionValue(argv[argIdx], "--jit-threshold")) != NULL) {
+            if (!configSetJitThreshold(&config, value) || config.jitThreshold == 0) {
+                fprintf(stderr, "invalid jit threshold: %s\n", value);
+                return 1;
+            }
+            jitThresholdArg = config.jitThreshold;
+        } else {
+            break;
+        }
+        argIdx++;
+    }
+#if !JIT
+    if (jitThresholdArg != 0) {
+        fprintf(stderr, "jit is not supported on this platform, ignored\n");
+        jitThresholdArg = 0;
+    }
+#endif
+    argc -= argIdx - 1;
+    argv += argIdx - 1;
+
     if (argc == 1) {
         runCli();
+    } else if (argc == 3 && strcmp(argv[1], "--dump-core-snapshot") == 0) {
+        // 构建时使用: 编译核心模块并导出快照
+        coreSnapshotPath = (char*)argv[2];
+        freeVM(newVM());
+    } else if (argc == 4 && strcmp(argv[1], "--aot") == 0) {
+        // 提前编译: 生成c代码,与libccc.a链接成可执行程序
+        compileFileToC(argv[3], argv[2]);
     } else {
         runFile(argv[1]);
     }
@@ -0,0 +1,831 @@
+#include "bytecode.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compiler.h"
+#include "peephole.h"
+#include "vm.h"
+#include "core.h"
+#include "class.h"
+#include "obj_string.h"
+#include "gc.h"
+#ifdef DEBUG
+    #include "debug.h"
+#endif
+
+// 缓存文件布局(整数均为本机字节序):
+//   magic "CCCB", 版本号, 编译选项, 指令数量
+//   源文件的修改时间, 大小和fnv-1a哈希值
+//   编译前模块变量数量及这些变量名的哈希值
+//   方法名表: 指令中的方法索引在文件中是此表的下标,载入时重新映射到vm->allMethodNames
+//   编译时新增的模块变量名
+//   模块函数,其中内层函数以常量的形式递归存储
+//   之前所有字节的fnv-1a哈希值,用于发现损坏的缓存
+
+#define BYTECODE_FLAG_DEBUG 1
+#define NO_NAME UINT32_MAX
+
+typedef enum {
+    BC_CONST_NULL,
+    BC_CONST_NUM,
+    BC_CONST_STRING,
+    BC_CONST_FN
+} ConstantTag; // 常量的类型标记
+
+typedef struct {
+    int64_t mtime;
+    uint64_t size;
+    uint32_t hashCode;
+} SourceStamp; // 源文件的标识,用于判断缓存是否过期
+
+typedef struct {
+    uint8_t* datas;
+    uint32_t count;
+    uint32_t capacity;
+} BytecodeWriter; // 序列化时的输出缓冲区
+
+typedef struct {
+    VM* vm;
+    ObjModule* module;
+    const uint8_t* cur;
+    const uint8_t* end;
+    uint32_t* methodSymbols; // 文件中方法名表的下标到vm->allMethodNames索引的映射
+    uint32_t methodNum;
+    uint32_t moduleVarNum; // 载入完成后模块变量的总数
+} BytecodeLoader;
+
+// 获取源码对应的缓存文件路径,源文件不以.ccc结尾时返回NULL
+static char* getCachePath(const char* sourcePath) {
+    uint32_t length = strlen(sourcePath);
+    if (length < 4 || strcmp(sourcePath + length - 4, ".ccc") != 0) {
+        return NULL;
+    }
+    char* path = (char*)malloc(length + 2);
+    memcpy(path, sourcePath, length);
+    path[length] = 'b';
+    path[length + 1] = '\0';
+    return path;
+}
+
+// 获取源码的标识,sourcePath为NULL时源码没有对应的文件,修改时间记为0
+static bool getSourceStamp(const char* sourcePath, const char* sourceCode, SourceStamp* stamp) {
+    uint32_t length = strlen(sourceCode);
+    stamp->mtime = 0;
+    stamp->size = length;
+    if (sourcePath != NULL) {
+        struct stat fileStat;
+        if (stat(sourcePath, &fileStat) != 0) {
+            return false;
+        }
+        stamp->mtime = (int64_t)fileStat.st_mtime;
+        stamp->size = (uint64_t)fileStat.st_size;
+    }
+    stamp->hashCode = hashString((char*)sourceCode, length);
+    return true;
+}
+
+// 模块继承自核心模块的变量名的哈希值,核心脚本改变后缓存中的模块变量索引便失效
+static uint32_t hashModuleVarNames(ObjModule* objModule, uint32_t count) {
+    uint32_t hashCode = 2166136261, idx = 0;
+    while (idx < count) {
+        String* name = &objModule->moduleVarName.datas[idx];
+        hashCode ^= hashString(name->str, name->length);
+        hashCode *= 16777619;
+        idx++;
+    }
+    return hashCode;
+}
+
+// 操作数以2字节的方法索引开头的指令
+static bool isMethodOpCode(OpCode opCode) {
+    return (opCode >= OPCODE_CALL0 && opCode <= OPCODE_NOT_EQUAL) ||
+        opCode == OPCODE_INSTANCE_METHOD || opCode == OPCODE_STATIC_METHOD;
+}
+
+static uint32_t readShortAt(Byte* instrStream, uint32_t ip) {
+    return (instrStream[ip] << 8) | instrStream[ip + 1];
+}
+
+static void writeShortAt(Byte* instrStream, uint32_t ip, uint32_t value) {
+    instrStream[ip] = (value >> 8) & 0xff;
+    instrStream[ip + 1] = value & 0xff;
+}
+
+/////////////////////////////////////// 写缓存 ///////////////////////////////////////
+
+static void writeBytes(BytecodeWriter* writer, const void* src, uint32_t length) {
+    if (writer->count + length > writer->capacity) {
+        uint32_t capacity = writer->capacity == 0 ? 1024 : writer->capacity;
+        while (capacity < writer->count + length) {
+            capacity *= 2;
+        }
+        writer->datas = (uint8_t*)realloc(writer->datas, capacity);
+        if (writer->datas == NULL) {
+            MEM_ERROR("allocate bytecode buffer failed!");
+        }
+        writer->capacity = capacity;
+    }
+    memcpy(writer->datas + writer->count, src, length);
+    writer->count += length;
+}
+
+static void writeByte(BytecodeWriter* writer, uint8_t value) {
+    writeBytes(writer, &value, 1);
+}
+
+static void writeU32(BytecodeWriter* writer, uint32_t value) {
+    writeBytes(writer, &value, sizeof(uint32_t));
+}
+
+static void writeName(BytecodeWriter* writer, const char* name, uint32_t length) {
+    writeU32(writer, length);
+    writeBytes(writer, name, length);
+}
+
+// 收集fn及其内层函数用到的方法名,为其在文件的方法名表中分配下标
+static void collectMethodSymbols(ObjFn* fn, int* globalToLocal, uint32_t* localToGlobal, uint32_t* methodNum) {
+    Byte* instrStream = fn->instrStream.datas;
+    uint32_t ip = 0;
+    while (ip < fn->instrStream.count) {
+        OpCode opCode = unfuseOpCode((OpCode)instrStream[ip]);
+        if (opCode == OPCODE_END) {
+            ip++;
+            continue;
+        }
+        if (isMethodOpCode(opCode)) {
+            uint32_t symbol = readShortAt(instrStream, ip + 1);
+            if (globalToLocal[symbol] == -1) {
+                globalToLocal[symbol] = *methodNum;
+                localToGlobal[(*methodNum)++] = symbol;
+            }
+        }
+        ip += 1 + getBytesOfOperands(instrStream, fn->constants.datas, ip);
+    }
+    uint32_t idx = 0;
+    while (idx < fn->constants.count) {
+        Value constant = fn->constants.datas[idx];
+        if (VALUE_IS_CERTAIN_OBJ(constant, OT_FUNCTION)) {
+            collectMethodSymbols(VALUE_TO_OBJFN(constant), globalToLocal, localToGlobal, methodNum);
+        }
+        idx++;
+    }
+}
+
+// 写入函数,常量中出现无法序列化的值时返回false
+static bool writeFn(BytecodeWriter* writer, ObjFn* fn, int* globalToLocal) {
+    writeU32(writer, fn->maxStackSlotUsedNum);
+    writeU32(writer, fn->upvalueNum);
+    writeU32(writer, fn->argNum);
+    writeU32(writer, fn->inlineCacheNum);
+
+    // 常量先于指令写入,载入时校验OPCODE_CREATE_CLOSURE需要内层函数的upvalueNum
+    writeU32(writer, fn->constants.count);
+    uint32_t idx = 0;
+    while (idx < fn->constants.count) {
+        Value constant = fn->constants.datas[idx];
+        if (VALUE_IS_NULL(constant)) {
+            // super调用的基类占位符,运行时由patchOperand回填
+            writeByte(writer, BC_CONST_NULL);
+        } else if (VALUE_IS_NUM(constant)) {
+            double num = VALUE_TO_NUM(constant);
+            writeByte(writer, BC_CONST_NUM);
+            writeBytes(writer, &num, sizeof(double));
+        } else if (VALUE_IS_OBJSTR(constant)) {
+            ObjString* objString = VALUE_TO_OBJSTR(constant);
+            writeByte(writer, BC_CONST_STRING);
+            writeName(writer, objString->value.start, objString->value.length);
+        } else if (VALUE_IS_CERTAIN_OBJ(constant, OT_FUNCTION)) {
+            writeByte(writer, BC_CONST_FN);
+            if (!writeFn(writer, VALUE_TO_OBJFN(constant), globalToLocal)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        idx++;
+    }
+
+    // 指令中的方法索引改写为文件中方法名表的下标,超级指令还原为原来的指令对,载入后重新合并
+    uint32_t length = fn->instrStream.count;
+    Byte* instrStream = (Byte*)malloc(length);
+    memcpy(instrStream, fn->instrStream.datas, length);
+    uint32_t ip = 0;
+    while (ip < length) {
+        OpCode opCode = unfuseOpCode((OpCode)instrStream[ip]);
+        instrStream[ip] = opCode;
+        if (opCode == OPCODE_END) {
+            ip++;
+            continue;
+        }
+        if (isMethodOpCode(opCode)) {
+            writeShortAt(instrStream, ip + 1, globalToLocal[readShortAt(instrStream, ip + 1)]);
+        }
+        ip += 1 + getBytesOfOperands(instrStream, fn->constants.datas, ip);
+    }
+    writeU32(writer, length);
+    writeBytes(writer, instrStream, length);
+    free(instrStream);
+
+#ifdef DEBUG
+    if (fn->debug->fnName == NULL) {
+        writeU32(writer, NO_NAME);
+    } else {
+        writeName(writer, fn->debug->fnName, strlen(fn->debug->fnName));
+    }
+    writeU32(writer, fn->debug->lineNo.count);
+    writeBytes(writer, fn->debug->lineNo.datas, sizeof(int) * fn->debug->lineNo.count);
+#endif
+    return true;
+}
+
+// 序列化模块函数fn, moduleVarNumBefore是编译前模块变量的数量,其后的都是编译时新增的模块变量
+static bool serializeModule(VM* vm, ObjModule* objModule, ObjFn* fn, uint32_t moduleVarNumBefore,
+    SourceStamp* stamp, BytecodeWriter* writer) {
+    uint32_t symbolNum = vm->allMethodNames.count;
+    int* globalToLocal = (int*)malloc(sizeof(int) * (symbolNum + 1));
+    uint32_t* localToGlobal = (uint32_t*)malloc(sizeof(uint32_t) * (symbolNum + 1));
+    memset(globalToLocal, -1, sizeof(int) * (symbolNum + 1));
+    uint32_t methodNum = 0;
+    collectMethodSymbols(fn, globalToLocal, localToGlobal, &methodNum);
+
+    uint32_t flags = 0;
+#ifdef DEBUG
+    flags |= BYTECODE_FLAG_DEBUG;
+#endif
+    writeBytes(writer, BYTECODE_MAGIC, 4);
+    writeU32(writer, BYTECODE_VERSION);
+    writeU32(writer, flags);
+    writeU32(writer, OPCODE_END);
+    writeBytes(writer, &stamp->mtime, sizeof(int64_t));
+    writeBytes(writer, &stamp->size, sizeof(uint64_t));
+    writeU32(writer, stamp->hashCode);
+    writeU32(writer, moduleVarNumBefore);
+    writeU32(writer, hashModuleVarNames(objModule, moduleVarNumBefore));
+
+    writeU32(writer, methodNum);
+    uint32_t idx = 0;
+    while (idx < methodNum) {
+        String* name = &vm->allMethodNames.datas[localToGlobal[idx]];
+        writeName(writer, name->str, name->length);
+        idx++;
+    }
+
+    writeU32(writer, objModule->moduleVarName.count - moduleVarNumBefore);
+    idx = moduleVarNumBefore;
+    while (idx < objModule->moduleVarName.count) {
+        String* name = &objModule->moduleVarName.datas[idx];
+        writeName(writer, name->str, name->length);
+        idx++;
+    }
+
+    bool ok = writeFn(writer, fn, globalToLocal);
+    free(globalToLocal);
+    free(localToGlobal);
+    if (ok) {
+        writeU32(writer, hashString((char*)writer->datas, writer->count));
+    }
+    return ok;
+}
+
+// 把刚编译完成的模块函数fn写入缓存文件,写入失败时静默放弃
+void saveBytecodeCache(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourcePath, const char* sourceCode) {
+    SourceStamp stamp;
+    if (!getSourceStamp(sourcePath, sourceCode, &stamp)) {
+        return;
+    }
+    char* cachePath = getCachePath(sourcePath);
+    if (cachePath == NULL) {
+        return;
+    }
+    BytecodeWriter writer = {NULL, 0, 0};
+    if (!serializeModule(vm, objModule, fn, moduleVarNumBefore, &stamp, &writer)) {
+        free(writer.datas);
+        free(cachePath);
+        return;
+    }
+
+    // 先写入临时文件再改名,使并发启动的进程不会读到写了一半的缓存
+    char* tmpPath = (char*)malloc(strlen(cachePath) + 32);
+    sprintf(tmpPath, "%s.%ld.tmp", cachePath, (long)getpid());
+    FILE* file = fopen(tmpPath, "wb");
+    if (file != NULL) {
+        bool ok = fwrite(writer.datas, 1, writer.count, file) == writer.count;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmpPath, cachePath) != 0) {
+            remove(tmpPath);
+        }
+    }
+    free(tmpPath);
+    free(cachePath);
+    free(writer.datas);
+}
+
+// 把模块函数fn序列化为可由loadBytecodeSnapshot载入的字节码,字节数存入size,
+// 返回的内存由调用方释放,无法序列化时返回NULL
+uint8_t* serializeBytecodeSnapshot(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourceCode, uint32_t* size) {
+    SourceStamp stamp;
+    getSourceStamp(NULL, sourceCode, &stamp);
+    BytecodeWriter writer = {NULL, 0, 0};
+    if (!serializeModule(vm, objModule, fn, moduleVarNumBefore, &stamp, &writer)) {
+        free(writer.datas);
+        return NULL;
+    }
+    *size = writer.count;
+    return writer.datas;
+}
+
+// 把核心模块编译后的函数fn以C数组的形式导出到path,构建时由此生成core.snapshot.inc
+void dumpBytecodeSnapshot(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourceCode, const char* path) {
+    uint32_t size;
+    uint8_t* snapshot = serializeBytecodeSnapshot(vm, objModule, fn, moduleVarNumBefore, sourceCode, &size);
+    if (snapshot == NULL) {
+        IO_ERROR("core module can't be serialized!");
+    }
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        IO_ERROR("Could't open file %s", path);
+    }
+    fprintf(file, "// 由 ccc --dump-core-snapshot 根据core.script.inc生成,请勿手动修改\n");
+    fprintf(file, "static const uint8_t coreSnapshot[%u] = {", size);
+    uint32_t idx = 0;
+    while (idx < size) {
+        fprintf(file, idx % 16 == 0 ? "\n    0x%02x," : " 0x%02x,", snapshot[idx]);
+        idx++;
+    }
+    fprintf(file, "\n};\n");
+    if (fclose(file) != 0) {
+        IO_ERROR("Could't write file %s", path);
+    }
+    free(snapshot);
+}
+
+/////////////////////////////////////// 读缓存 ///////////////////////////////////////
+
+static bool readBytes(BytecodeLoader* loader, void* dest, uint32_t length) {
+    if ((uint64_t)(loader->end - loader->cur) < length) {
+        return false;
+    }
+    memcpy(dest, loader->cur, length);
+    loader->cur += length;
+    return true;
+}
+
+static bool readU32(BytecodeLoader* loader, uint32_t* value) {
+    return readBytes(loader, value, sizeof(uint32_t));
+}
+
+// 读取名字,返回的name直接指向文件内容
+static bool readName(BytecodeLoader* loader, const char** name, uint32_t* length) {
+    if (!readU32(loader, length) || (uint64_t)(loader->end - loader->cur) < *length) {
+        return false;
+    }
+    *name = (const char*)loader->cur;
+    loader->cur += *length;
+    return true;
+}
+
+// 把value添加为fn的常量
+static void addLoadedConstant(VM* vm, ObjFn* fn, Value value) {
+    if (VALUE_IS_OBJ(value)) {
+        pushTmpRoot(vm, VALUE_TO_OBJ(value));
+    }
+    ValueBufferAdd(vm, &fn->constants, value);
+    GC_WRITE_BARRIER(vm, fn, value);
+    if (VALUE_IS_OBJ(value)) {
+        popTmpRoot(vm);
+    }
+}
+
+// 校验跳转指令的目标,target须落在指令流内某条指令的开头
+static bool checkJumpTarget(const Byte* isInstrStart, uint32_t length, int64_t target) {
+    return target >= 0 && target < length && isInstrStart[target];
+}
+
+// 校验指令流中的跳转目标,局部变量槽位和upvalue索引
+static bool checkLoadedOperands(ObjFn* fn, const Byte* isInstrStart) {
+    Byte* instrStream = fn->instrStream.datas;
+    uint32_t length = fn->instrStream.count;
+    // 调用时在参数(含接收者)之上再预留maxStackSlotUsedNum个栈槽位
+    uint32_t slotNum = fn->maxStackSlotUsedNum + fn->argNum + 1;
+    uint32_t ip = 0;
+    while (ip < length) {
+        OpCode opCode = (OpCode)instrStream[ip];
+        if (opCode == OPCODE_END) {
+            ip++;
+            continue;
+        }
+        uint32_t operandBytes = getBytesOfOperands(instrStream, fn->constants.datas, ip);
+        // 跳转偏移量相对于操作数之后的指令
+        int64_t next = ip + 1 + operandBytes;
+        switch (opCode) {
+            case OPCODE_LOAD_LOCAL_VAR:
+            case OPCODE_STORE_LOCAL_VAR:
+                if (instrStream[ip + 1] >= slotNum) {
+                    return false;
+                }
+                break;
+            case OPCODE_LOAD_UPVALUE:
+            case OPCODE_STORE_UPVALUE:
+                if (instrStream[ip + 1] >= fn->upvalueNum) {
+                    return false;
+                }
+                break;
+            case OPCODE_JUMP:
+            case OPCODE_JUMP_IF_FALSE:
+            case OPCODE_AND:
+            case OPCODE_OR: {
+                uint32_t offset = readShortAt(instrStream, ip + 1);
+                if (offset == 0 || offset > INT16_MAX ||
+                    !checkJumpTarget(isInstrStart, length, next + offset)) {
+                    return false;
+                }
+                break;
+            }
+            case OPCODE_LOOP: {
+                uint32_t offset = readShortAt(instrStream, ip + 1);
+                if (offset == 0 || offset > INT16_MAX ||
+                    !checkJumpTarget(isInstrStart, length, next - offset)) {
+                    return false;
+                }
+                break;
+            }
+            case OPCODE_FOR_RANGE:
+                // seq和iter占用相邻的两个槽位
+                if (instrStream[ip + 1] + 1u >= slotNum ||
+                    !checkJumpTarget(isInstrStart, length, next + readShortAt(instrStream, ip + 2)) ||
+                    !checkJumpTarget(isInstrStart, length, next + readShortAt(instrStream, ip + 4))) {
+                    return false;
+                }
+                break;
+            case OPCODE_CREATE_CLOSURE: {
+                // 每个upvalue占2字节: 是否为外层函数的局部变量, 局部变量槽位或外层函数的upvalue索引
+                ObjFn* innerFn = VALUE_TO_OBJFN(fn->constants.datas[readShortAt(instrStream, ip + 1)]);
+                uint32_t idx = 0;
+                while (idx < innerFn->upvalueNum) {
+                    Byte isEnclosingLocalVar = instrStream[ip + 3 + idx * 2];
+                    Byte index = instrStream[ip + 4 + idx * 2];
+                    if (index >= (isEnclosingLocalVar ? slotNum : fn->upvalueNum)) {
+                        return false;
+                    }
+                    idx++;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        ip = next;
+    }
+    return true;
+}
+
+// 校验指令流并把方法索引映射回vm->allMethodNames
+static bool patchLoadedInstructions(BytecodeLoader* loader, ObjFn* fn) {
+    Byte* instrStream = fn->instrStream.datas;
+    uint32_t length = fn->instrStream.count;
+    if (length == 0 || instrStream[length - 1] != OPCODE_END) {
+        return false;
+    }
+    // 记录每条指令的开头,供校验跳转目标
+    Byte* isInstrStart = (Byte*)calloc(length, 1);
+    if (isInstrStart == NULL) {
+        MEM_ERROR("allocate bytecode buffer failed!");
+    }
+    bool ok = false;
+    uint32_t ip = 0;
+    while (ip < length) {
+        OpCode opCode = (OpCode)instrStream[ip];
+        isInstrStart[ip] = 1;
+        // 缓存中不会出现超级指令
+        if (opCode > OPCODE_END || unfuseOpCode(opCode) != opCode) {
+            goto done;
+        }
+        if (opCode == OPCODE_END) {
+            ip++;
+            continue;
+        }
+        if (opCode == OPCODE_CREATE_CLOSURE) {
+            if (ip + 2 >= length) {
+                goto done;
+            }
+            uint32_t fnIndex = readShortAt(instrStream, ip + 1);
+            if (fnIndex >= fn->constants.count ||
+                !VALUE_IS_CERTAIN_OBJ(fn->constants.datas[fnIndex], OT_FUNCTION)) {
+                goto done;
+            }
+        }
+        uint32_t operandBytes = getBytesOfOperands(instrStream, fn->constants.datas, ip);
+        // 操作数之后至少还有结尾的OPCODE_END
+        if (ip + operandBytes + 1 >= length) {
+            goto done;
+        }
+        if (isMethodOpCode(opCode)) {
+            uint32_t symbol = readShortAt(instrStream, ip + 1);
+            if (symbol >= loader->methodNum) {
+                goto done;
+            }
+            writeShortAt(instrStream, ip + 1, loader->methodSymbols[symbol]);
+        }
+        // 调用指令的最后2字节是内联缓存索引
+        if (opCode >= OPCODE_CALL0 && opCode <= OPCODE_NOT_EQUAL &&
+            readShortAt(instrStream, ip + operandBytes - 1) >= fn->inlineCacheNum) {
+            goto done;
+        }
+        if (opCode >= OPCODE_SUPER0 && opCode <= OPCODE_SUPER16 &&
+            readShortAt(instrStream, ip + 3) >= fn->constants.count) {
+            goto done;
+        }
+        if (opCode == OPCODE_LOAD_CONSTANT &&
+            readShortAt(instrStream, ip + 1) >= fn->constants.count) {
+            goto done;
+        }
+        if ((opCode == OPCODE_LOAD_MODULE_VAR || opCode == OPCODE_STORE_MODULE_VAR) &&
+            readShortAt(instrStream, ip + 1) >= loader->moduleVarNum) {
+            goto done;
+        }
+        ip += 1 + operandBytes;
+    }
+    ok = checkLoadedOperands(fn, isInstrStart);
+
+done:
+    free(isInstrStart);
+    return ok;
+}
+
+// 读取fn的内容,fn须已经对gc可达
+static bool readFnBody(BytecodeLoader* loader, ObjFn* fn) {
+    VM* vm = loader->vm;
+    uint32_t argNum, constantNum;
+    if (!readU32(loader, &fn->maxStackSlotUsedNum) || !readU32(loader, &fn->upvalueNum) ||
+        !readU32(loader, &argNum) || !readU32(loader, &fn->inlineCacheNum) ||
+        !readU32(loader, &constantNum)) {
+        return false;
+    }
+    if (fn->upvalueNum > MAX_UPVALUE_NUM || argNum > MAX_ARG_NUM || fn->inlineCacheNum > UINT16_MAX + 1) {
+        return false;
+    }
+    fn->argNum = argNum;
+
+    uint32_t idx = 0;
+    while (idx < constantNum) {
+        uint8_t tag;
+        if (!readBytes(loader, &tag, 1)) {
+            return false;
+        }
+        switch (tag) {
+            case BC_CONST_NULL:
+                addLoadedConstant(vm, fn, VT_TO_VALUE(VT_NULL));
+                break;
+            case BC_CONST_NUM: {
+                double num;
+                if (!readBytes(loader, &num, sizeof(double))) {
+                    return false;
+                }
+                addLoadedConstant(vm, fn, NUM_TO_VALUE(num));
+                break;
+            }
+            case BC_CONST_STRING: {
+                const char* str;
+                uint32_t length;
+                if (!readName(loader, &str, &length)) {
+                    return false;
+                }
+                addLoadedConstant(vm, fn, OBJ_TO_VALUE(newObjString(vm, str, length)));
+                break;
+            }
+            case BC_CONST_FN: {
+                // 内层函数先挂到外层函数的常量表中再读取其内容
+                ObjFn* innerFn = newObjFn(vm, loader->module, 0);
+                addLoadedConstant(vm, fn, OBJ_TO_VALUE(innerFn));
+                if (!readFnBody(loader, innerFn)) {
+                    return false;
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+        idx++;
+    }
+
+    uint32_t length;
+    if (!readU32(loader, &length) || length == 0 || (uint64_t)(loader->end - loader->cur) < length) {
+        return false;
+    }
+    // 栈的每个槽位都由参数或某条指令压入,据此限制运行时预留的栈空间
+    if (fn->maxStackSlotUsedNum > argNum + 1 + (uint64_t)length) {
+        return false;
+    }
+    fn->instrStream.datas = ALLOCATE_ARRAY(vm, Byte, length);
+    fn->instrStream.capacity = fn->instrStream.count = length;
+    readBytes(loader, fn->instrStream.datas, length);
+    if (!patchLoadedInstructions(loader, fn)) {
+        return false;
+    }
+    fuseSuperInstructions(fn);
+
+    if (fn->inlineCacheNum > 0) {
+        fn->inlineCaches = ALLOCATE_ARRAY(vm, InlineCache, fn->inlineCacheNum);
+        idx = 0;
+        while (idx < fn->inlineCacheNum) {
+            fn->inlineCaches[idx].epoch = 0;
+            fn->inlineCaches[idx].count = 0;
+            idx++;
+        }
+    }
+
+#ifdef DEBUG
+    uint32_t nameLength;
+    if (!readU32(loader, &nameLength)) {
+        return false;
+    }
+    if (nameLength != NO_NAME) {
+        if ((uint64_t)(loader->end - loader->cur) < nameLength) {
+            return false;
+        }
+        bindDebugFnName(vm, fn->debug, (const char*)loader->cur, nameLength);
+        loader->cur += nameLength;
+    }
+    uint32_t lineNum;
+    if (!readU32(loader, &lineNum) || (uint64_t)(loader->end - loader->cur) / sizeof(int) < lineNum) {
+        return false;
+    }
+    if (lineNum > 0) {
+        fn->debug->lineNo.datas = ALLOCATE_ARRAY(vm, int, lineNum);
+        fn->debug->lineNo.capacity = fn->debug->lineNo.count = lineNum;
+        readBytes(loader, fn->debug->lineNo.datas, sizeof(int) * lineNum);
+    }
+#endif
+    return true;
+}
+
+// 读取整个缓存文件,不存在或读取失败时返回NULL
+static uint8_t* readCacheFile(const char* cachePath, uint32_t* size) {
+    FILE* file = fopen(cachePath, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    struct stat fileStat;
+    if (fstat(fileno(file), &fileStat) != 0 || fileStat.st_size <= 0 || fileStat.st_size > UINT32_MAX) {
+        fclose(file);
+        return NULL;
+    }
+    *size = fileStat.st_size;
+    uint8_t* content = (uint8_t*)malloc(*size);
+    if (content == NULL || fread(content, 1, *size, file) != *size) {
+        free(content);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    return content;
+}
+
+// 从内存中的字节码载入模块函数,stamp是当前源码的标识
+// 字节码已过期或内容有误时返回NULL,由调用方重新编译
+static ObjFn* loadBytecode(VM* vm, ObjModule* objModule, const uint8_t* content, uint32_t size, SourceStamp* stamp) {
+    BytecodeLoader loader;
+    loader.vm = vm;
+    loader.module = objModule;
+    loader.cur = content;
+    loader.end = content + size;
+    loader.methodSymbols = NULL;
+    loader.methodNum = 0;
+
+    ObjFn* fn = NULL;
+    // 末尾4字节是之前所有字节的哈希值
+    uint32_t checksum;
+    if (size < sizeof(uint32_t)) {
+        return NULL;
+    }
+    loader.end -= sizeof(uint32_t);
+    memcpy(&checksum, loader.end, sizeof(uint32_t));
+    if (hashString((char*)content, size - sizeof(uint32_t)) != checksum) {
+        return NULL;
+    }
+
+    char magic[4];
+    uint32_t version, flags, opCodeNum, hashCode, moduleVarNumBefore, coreVarsHash, moduleVarNameNum;
+    int64_t mtime;
+    uint64_t sourceSize;
+    uint32_t expectFlags = 0;
+#ifdef DEBUG
+    expectFlags |= BYTECODE_FLAG_DEBUG;
+#endif
+    if (!readBytes(&loader, magic, 4) || memcmp(magic, BYTECODE_MAGIC, 4) != 0 ||
+        !readU32(&loader, &version) || version != BYTECODE_VERSION ||
+        !readU32(&loader, &flags) || flags != expectFlags ||
+        !readU32(&loader, &opCodeNum) || opCodeNum != OPCODE_END ||
+        !readBytes(&loader, &mtime, sizeof(int64_t)) ||
+        !readBytes(&loader, &sourceSize, sizeof(uint64_t)) ||
+        !readU32(&loader, &hashCode) ||
+        !readU32(&loader, &moduleVarNumBefore) ||
+        !readU32(&loader, &coreVarsHash)) {
+        goto done;
+    }
+
+    if (stamp->mtime != mtime || stamp->size != sourceSize || stamp->hashCode != hashCode) {
+        goto done;
+    }
+    // 模块变量的索引直接编码在指令中,须与编译时的模块变量一致
+    if (objModule->moduleVarValue.count != moduleVarNumBefore ||
+        hashModuleVarNames(objModule, moduleVarNumBefore) != coreVarsHash) {
+        goto done;
+    }
+
+    if (!readU32(&loader, &loader.methodNum) || loader.methodNum > (uint64_t)(loader.end - loader.cur)) {
+        goto done;
+    }
+    loader.methodSymbols = (uint32_t*)malloc(sizeof(uint32_t) * (loader.methodNum + 1));
+    uint32_t idx = 0;
+    while (idx < loader.methodNum) {
+        const char* name;
+        uint32_t length;
+        if (!readName(&loader, &name, &length) || length == 0) {
+            goto done;
+        }
+        int symbol = ensureSymbolExist(vm, &vm->allMethodNames, name, length);
+        if (symbol > UINT16_MAX) {
+            goto done;
+        }
+        loader.methodSymbols[idx++] = symbol;
+    }
+
+    // 模块变量名在函数读取成功后才定义,避免缓存有误时污染模块
+    if (!readU32(&loader, &moduleVarNameNum) || moduleVarNameNum > (uint64_t)(loader.end - loader.cur)) {
+        goto done;
+    }
+    const uint8_t* moduleVarNames = loader.cur;
+    idx = 0;
+    while (idx < moduleVarNameNum) {
+        const char* name = NULL;
+        uint32_t length = 0;
+        if (!readName(&loader, &name, &length) || length == 0 || length > MAX_ID_LEN) {
+            goto done;
+        }
+        idx++;
+    }
+    loader.moduleVarNum = moduleVarNumBefore + moduleVarNameNum;
+
+    fn = newObjFn(vm, objModule, 0);
+    pushTmpRoot(vm, (ObjHeader*)fn);
+    if (!readFnBody(&loader, fn) || loader.cur != loader.end) {
+        popTmpRoot(vm);
+        fn = NULL;
+        goto done;
+    }
+
+    loader.cur = moduleVarNames;
+    idx = 0;
+    while (idx < moduleVarNameNum) {
+        const char* name = NULL;
+        uint32_t length = 0;
+        // 前面已校验过变量名,这里仍检查返回值,以防两次读取不一致
+        if (!readName(&loader, &name, &length)) {
+            popTmpRoot(vm);
+            fn = NULL;
+            goto done;
+        }
+        if (defineModuleVar(vm, objModule, name, length, VT_TO_VALUE(VT_NULL)) != (int)(moduleVarNumBefore + idx)) {
+            // 变量名重复,缓存内容有误
+            popTmpRoot(vm);
+            fn = NULL;
+            goto done;
+        }
+        idx++;
+    }
+    popTmpRoot(vm);
+
+done:
+    free(loader.methodSymbols);
+    return fn;
+}
+
+// 从sourcePath对应的缓存文件载入模块函数,缓存不存在或已过期时返回NULL
+ObjFn* loadBytecodeCache(VM* vm, ObjModule* objModule, const char* sourcePath, const char* sourceCode) {
+    SourceStamp stamp;
+    char* cachePath = getCachePath(sourcePath);
+    if (cachePath == NULL || !getSourceStamp(sourcePath, sourceCode, &stamp)) {
+        free(cachePath);
+        return NULL;
+    }
+    uint32_t size;
+    uint8_t* content = readCacheFile(cachePath, &size);
+    free(cachePath);
+    if (content == NULL) {
+        return NULL;
+    }
+    ObjFn* fn = loadBytecode(vm, objModule, content, size, &stamp);
+    free(content);
+    return fn;
+}
+
+// 从编译进程序的快照载入核心模块函数,快照与sourceCode不一致时返回NULL
+ObjFn* loadBytecodeSnapshot(VM* vm, ObjModule* objModule, const uint8_t* snapshot, uint32_t size, const char* sourceCode) {
+    SourceStamp stamp;
+    getSourceStamp(NULL, sourceCode, &stamp);
+    return loadBytecode(vm, objModule, snapshot, size, &stamp);
+}
@@ -0,0 +1,30 @@
+#ifndef _COMPILER_BYTECODE_H
+#define _COMPILER_BYTECODE_H
+#include "obj_fn.h"
+
+// 编译时指定-DBYTECODE_CACHE=0可关闭字节码缓存
+// 开启时源码模块xxx.ccc编译后的结果缓存在同目录的xxx.cccb中,
+// 源码未修改时直接载入缓存,跳过词法分析和编译
+#ifndef BYTECODE_CACHE
+    #define BYTECODE_CACHE 1
+#endif
+
+// 编译时指定-DCORE_SNAPSHOT=0可关闭核心模块快照
+// 开启时构建过程先生成core.snapshot.inc,newVM直接从中载入核心模块,不再编译core.script.inc
+#ifndef CORE_SNAPSHOT
+    #define CORE_SNAPSHOT 1
+#endif
+
+#define BYTECODE_MAGIC "CCCB"
+// 缓存格式或指令集变化时须增大此版本号,使旧的缓存失效
+#define BYTECODE_VERSION 3
+
+ObjFn* loadBytecodeCache(VM* vm, ObjModule* objModule, const char* sourcePath, const char* sourceCode);
+void saveBytecodeCache(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourcePath, const char* sourceCode);
+ObjFn* loadBytecodeSnapshot(VM* vm, ObjModule* objModule, const uint8_t* snapshot, uint32_t size, const char* sourceCode);
+uint8_t* serializeBytecodeSnapshot(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourceCode, uint32_t* size);
+void dumpBytecodeSnapshot(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourceCode, const char* path);
+#endif
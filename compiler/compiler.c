@@ -1,8 +1,10 @@
 #include "compiler.h"
+#include "peephole.h"
 #include "parser.h"
 #include "core.h"
 #include "utils.h"
 #include <string.h>
+#include <math.h>
 #include "gc.h"
 
 #if DEBUG
@@ -39,6 +41,18 @@ struct compileUnit {
 
     // 当前parser
     Parser* curParser;
+
+    // 最近编译的常量表达式(字面量或折叠的结果)的起始地址,-1表示没有
+    int constExprStart;
+
+    // 编译该常量表达式之前常量表的长度,折叠时据此丢弃操作数的常量
+    uint32_t constExprConstNum;
+
+    // 当前中缀运算符左操作数的起始地址
+    uint32_t leftOperandStart;
+
+    // 数字和字符串常量到其在常量表中索引的映射,用于合并相同的常量
+    ObjMap* constIndex;
 }; // 编译单元
 
 typedef enum {
@@ -113,10 +127,49 @@ static void infixOperator(CompileUnit* cu, bool canAssign UNUSED);
 static void unaryOperator(CompileUnit* cu, bool canAssign UNUSED);
 static void compileStatment(CompileUnit* cu);
 
-// 添加常量并返回其索引
+// 数字和字符串常量可与相同的常量共用常量表中的一项.
+// 字符串都已驻留,内容相同即是同一对象. -0与0相等却不可互换,NaN与自身不等,都不合并
+static bool isSharableConstant(Value constant) {
+    if (VALUE_IS_NUM(constant)) {
+        double num = VALUE_TO_NUM(constant);
+        return num == num && !(num == 0 && signbit(num));
+    }
+    return VALUE_IS_OBJSTR(constant);
+}
+
+// 添加常量并返回其索引,已有相同的数字或字符串常量时返回已有的索引
 static uint32_t addConstant(CompileUnit* cu, Value constant) {
-    ValueBufferAdd(cu->curParser->vm, &cu->fn->constants, constant);
-    return cu->fn->constants.count - 1;
+    VM* vm = cu->curParser->vm;
+    bool isSharable = isSharableConstant(constant);
+    if (isSharable && cu->constIndex != NULL) {
+        Value index = mapGet(cu->constIndex, constant);
+        // 常量折叠会截短常量表,映射中的索引可能已指向别的常量,需确认仍然有效
+        if (!VALUE_IS_UNDEFINED(index)) {
+            uint32_t idx = (uint32_t)VALUE_TO_NUM(index);
+            if (idx < cu->fn->constants.count && isSharableConstant(cu->fn->constants.datas[idx]) &&
+                valueIsEqual(cu->fn->constants.datas[idx], constant)) {
+                return idx;
+            }
+        }
+    }
+    // 扩容常量表时可能触发gc,constant此时只被c的局部变量引用
+    if (VALUE_IS_OBJ(constant)) {
+        pushTmpRoot(vm, VALUE_TO_OBJ(constant));
+    }
+    ValueBufferAdd(vm, &cu->fn->constants, constant);
+    GC_WRITE_BARRIER(vm, cu->fn, constant);
+    if (VALUE_IS_OBJ(constant)) {
+        popTmpRoot(vm);
+    }
+    uint32_t idx = cu->fn->constants.count - 1;
+    if (isSharable) {
+        // constant已在常量表中,创建映射时触发gc也不会被回收
+        if (cu->constIndex == NULL) {
+            cu->constIndex = newObjMap(vm);
+        }
+        mapSet(vm, cu->constIndex, constant, NUM_TO_VALUE(idx));
+    }
+    return idx;
 }
 
 // 把Signature 转换为字符串,返回字符串长度
@@ -224,8 +277,12 @@ static void initCompileUnit(Parser* parser, CompileUnit* cu, CompileUnit* enclos
     parser->curCompileUnit = cu;
     cu->curParser = parser;
     cu->enclosingUnit = enclosingUnit;
+    // 创建fn时可能触发gc,grayCompileUnit会访问cu->fn
+    cu->fn = NULL;
     cu->curLoop = NULL;
     cu->enclosingClassBK = NULL;
+    cu->constExprStart = -1;
+    cu->constIndex = NULL;
     // 若没有外层,说明当前属于模块作用域
     if (enclosingUnit == NULL) {
         // 编译代码是从上到下,从外层的作用域开始,模块作用域设为-1
@@ -240,7 +297,7 @@ static void initCompileUnit(Parser* parser, CompileUnit* cu, CompileUnit* enclos
         } else { // 普通函数
             // 空出第0个位置保持统一
             cu->localVars[0].name = NULL;
-            cu->localVars[0].length = 4;
+            cu->localVars[0].length = 0;
         }
         
         // 第0个局部变量的作用域为模块级别
@@ -301,6 +358,14 @@ static void writeOpCodeShortOperand(CompileUnit* cu, OpCode opCode, int operand)
 
 
 
+// 为方法调用点分配一个内联缓存,写入2字节的缓存索引
+static void writeInlineCacheOperand(CompileUnit* cu) {
+    if (cu->fn->inlineCacheNum > UINT16_MAX) {
+        COMPILE_ERROR(cu->curParser, "the max number of call site in a function is %d!", UINT16_MAX + 1);
+    }
+    writeShortOperand(cu, cu->fn->inlineCacheNum++);
+}
+
 // 通过签名方法编译方法调用, 包括callX和superX指令
 static void emitCallBySignature(CompileUnit* cu, Signature* sign, OpCode opCode) {
     char signBuffer[MAX_SIGN_LEN];
@@ -314,12 +379,14 @@ static void emitCallBySignature(CompileUnit* cu, Signature* sign, OpCode opCode)
     if (opCode == OPCODE_SUPER0) {
         writeShortOperand(cu, addConstant(cu, VT_TO_VALUE(VT_NULL)));
     }
+    writeInlineCacheOperand(cu);
 }
 
 // 生成方法调用的指令,仅限callx指令
 static void emitCall(CompileUnit* cu, int numArgs, const char* name, int length) {
     int symbolIndex = ensureSymbolExist(cu->curParser->vm, &cu->curParser->vm->allMethodNames, name, length);
     writeOpCodeShortOperand(cu, OPCODE_CALL0+numArgs, symbolIndex);
+    writeInlineCacheOperand(cu);
 }
 
 // 生成加载常量的指令
@@ -328,10 +395,174 @@ static void emitLoadConstant(CompileUnit* cu, Value value) {
     writeOpCodeShortOperand(cu, OPCODE_LOAD_CONSTANT, index);
 }
 
+// 生成加载常量表达式value的指令,并记录下来供常量折叠使用
+static void emitConstExpr(CompileUnit* cu, Value value) {
+    uint32_t start = cu->fn->instrStream.count;
+    uint32_t constNum = cu->fn->constants.count;
+    if (VALUE_IS_TRUE(value)) {
+        writeOpCode(cu, OPCODE_PUSH_TRUE);
+    } else if (VALUE_IS_FALSE(value)) {
+        writeOpCode(cu, OPCODE_PUSH_FALSE);
+    } else if (VALUE_IS_NULL(value)) {
+        writeOpCode(cu, OPCODE_PUSH_NULL);
+    } else {
+        emitLoadConstant(cu, value);
+    }
+    cu->constExprStart = start;
+    cu->constExprConstNum = constNum;
+}
+
+// 从start到指令流末尾恰好是最近记录的常量表达式时,把其值存入value并返回true
+static bool getConstExpr(CompileUnit* cu, uint32_t start, Value* value) {
+    if (!CONSTANT_FOLDING || cu->constExprStart != (int)start) {
+        return false;
+    }
+    Byte* instr = cu->fn->instrStream.datas + start;
+    uint32_t length = cu->fn->instrStream.count - start;
+    switch (instr[0]) {
+        case OPCODE_PUSH_TRUE:
+            *value = VT_TO_VALUE(VT_TRUE);
+            return length == 1;
+        case OPCODE_PUSH_FALSE:
+            *value = VT_TO_VALUE(VT_FALSE);
+            return length == 1;
+        case OPCODE_PUSH_NULL:
+            *value = VT_TO_VALUE(VT_NULL);
+            return length == 1;
+        case OPCODE_LOAD_CONSTANT:
+            *value = cu->fn->constants.datas[(instr[1] << 8) | instr[2]];
+            return length == 3;
+        default:
+            return false;
+    }
+}
+
+// 丢弃从start开始的指令
+static void truncateInstr(CompileUnit* cu, uint32_t start) {
+    cu->fn->instrStream.count = start;
+    #if DEBUG
+        cu->fn->debug->lineNo.count = start;
+    #endif
+    cu->constExprStart = -1;
+}
+
+// 用常量result替换从start开始的operandNum个常量操作数及其运算,
+// constNum是编译第一个操作数之前常量表的长度,之后加入的常量不再被引用
+static void replaceWithConstExpr(CompileUnit* cu, uint32_t start, uint32_t constNum, uint32_t operandNum, Value result) {
+    truncateInstr(cu, start);
+    cu->fn->constants.count = constNum;
+    cu->stackSlotNum -= operandNum;
+    emitConstExpr(cu, result);
+}
+
+// num转换为uint32_t是否有定义,位运算的操作数先做此转换
+static bool isUint32Convertible(double num) {
+    return num > -1 && num < 4294967296.0;
+}
+
+// 在编译期计算常量left和right的二元运算,
+// 能得到与运行时相同的结果时存入result并返回true,运行时会出错等情况返回false
+static bool foldInfixOperator(VM* vm, TokenType type, Value left, Value right, Value* result) {
+    if (VALUE_IS_NUM(left) && VALUE_IS_NUM(right)) {
+        double leftNum = VALUE_TO_NUM(left);
+        double rightNum = VALUE_TO_NUM(right);
+        switch (type) {
+            case TOKEN_ADD: *result = NUM_TO_VALUE(leftNum + rightNum); return true;
+            case TOKEN_SUB: *result = NUM_TO_VALUE(leftNum - rightNum); return true;
+            case TOKEN_MUL: *result = NUM_TO_VALUE(leftNum * rightNum); return true;
+            case TOKEN_DIV: *result = NUM_TO_VALUE(leftNum / rightNum); return true;
+            case TOKEN_MOD: *result = NUM_TO_VALUE(fmod(leftNum, rightNum)); return true;
+            case TOKEN_GREATE: *result = BOOL_TO_VALUE(leftNum > rightNum); return true;
+            case TOKEN_GREATE_EQUAL: *result = BOOL_TO_VALUE(leftNum >= rightNum); return true;
+            case TOKEN_LESS: *result = BOOL_TO_VALUE(leftNum < rightNum); return true;
+            case TOKEN_LESS_EQUAL: *result = BOOL_TO_VALUE(leftNum <= rightNum); return true;
+            case TOKEN_EQUAL: *result = BOOL_TO_VALUE(leftNum == rightNum); return true;
+            case TOKEN_NOT_EQUAL: *result = BOOL_TO_VALUE(leftNum != rightNum); return true;
+            case TOKEN_BIT_AND:
+            case TOKEN_BIT_OR:
+            case TOKEN_BIT_SHIFT_RIGHT:
+            case TOKEN_BIT_SHIFT_LEFT: {
+                // 超出uint32_t范围的转换及移位数不小于32的结果依赖平台,留给运行时
+                if (!isUint32Convertible(leftNum) || !isUint32Convertible(rightNum)) {
+                    return false;
+                }
+                uint32_t leftOperand = leftNum;
+                uint32_t rightOperand = rightNum;
+                if (type == TOKEN_BIT_AND) {
+                    *result = NUM_TO_VALUE(leftOperand & rightOperand);
+                } else if (type == TOKEN_BIT_OR) {
+                    *result = NUM_TO_VALUE(leftOperand | rightOperand);
+                } else if (rightOperand >= 32) {
+                    return false;
+                } else if (type == TOKEN_BIT_SHIFT_RIGHT) {
+                    *result = NUM_TO_VALUE(leftOperand >> rightOperand);
+                } else {
+                    *result = NUM_TO_VALUE(leftOperand << rightOperand);
+                }
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+    // 数字与其它类型运算时运行时报错
+    if (VALUE_IS_NUM(left)) {
+        return false;
+    }
+    switch (type) {
+        // 其它类型都使用Object的==和!=
+        case TOKEN_EQUAL: *result = BOOL_TO_VALUE(valueIsEqual(left, right)); return true;
+        case TOKEN_NOT_EQUAL: *result = BOOL_TO_VALUE(!valueIsEqual(left, right)); return true;
+        case TOKEN_ADD: {
+            if (!VALUE_IS_OBJSTR(left) || !VALUE_IS_OBJSTR(right)) {
+                return false;
+            }
+            ObjString* leftString = VALUE_TO_OBJSTR(left);
+            ObjString* rightString = VALUE_TO_OBJSTR(right);
+            StringBuilder builder;
+            stringBuilderInit(vm, &builder, leftString->value.length + rightString->value.length);
+            stringBuilderAppend(vm, &builder, leftString->value.start, leftString->value.length);
+            stringBuilderAppend(vm, &builder, rightString->value.start, rightString->value.length);
+            *result = OBJ_TO_VALUE(stringBuilderFinish(vm, &builder));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// 在编译期计算常量operand的前缀运算,与foldInfixOperator类似
+static bool foldUnaryOperator(TokenType type, Value operand, Value* result) {
+    switch (type) {
+        case TOKEN_SUB:
+            if (!VALUE_IS_NUM(operand)) {
+                return false;
+            }
+            *result = NUM_TO_VALUE(-VALUE_TO_NUM(operand));
+            return true;
+        case TOKEN_BIT_NOT:
+            if (!VALUE_IS_NUM(operand) || !isUint32Convertible(VALUE_TO_NUM(operand))) {
+                return false;
+            }
+            *result = NUM_TO_VALUE(~(uint32_t)VALUE_TO_NUM(operand));
+            return true;
+        case TOKEN_LOGIC_NOT:
+            // 只有Bool和Null重写了Object的!,其余类型的结果都是false
+            if (VALUE_IS_TRUE(operand) || VALUE_IS_FALSE(operand)) {
+                *result = BOOL_TO_VALUE(!VALUE_TO_BOOL(operand));
+            } else {
+                *result = BOOL_TO_VALUE(VALUE_IS_NULL(operand));
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
 // 数字和字符串.nud() 编译字面量
 static void literal(CompileUnit* cu, bool canAssign UNUSED) {
     // literal 是常量,字符串和数字的nud方法,用来返回字面值
-    emitLoadConstant(cu, cu->curParser->preToken.value);
+    emitConstExpr(cu, cu->curParser->preToken.value);
 }
 
 // 添加局部变量到cu
@@ -447,6 +678,10 @@ int defineModuleVar(VM* vm, ObjModule* objModule, const char* name, uint32_t len
         }
     }
 
+    // 添加变量时可能触发gc,value此时只被c的局部变量引用
+    if (VALUE_IS_OBJ(value)) {
+        pushTmpRoot(vm, VALUE_TO_OBJ(value));
+    }
     // 从模块变量中查找变量，如不存在则添加
     int symbolIndex = getIndexFromSymbolTable(&objModule->moduleVarName, name, length);
     if (symbolIndex == -1) {
@@ -459,6 +694,10 @@ int defineModuleVar(VM* vm, ObjModule* objModule, const char* name, uint32_t len
     } else {
         symbolIndex = -1; // 已定义则返回-1,用于判断重定义
     }
+    GC_WRITE_BARRIER(vm, objModule, value);
+    if (VALUE_IS_OBJ(value)) {
+        popTmpRoot(vm);
+    }
     return symbolIndex;
 }
 
@@ -536,6 +775,7 @@ static Variable getVarFromLocalOrUpvalue(CompileUnit* cu, const char* name, uint
 // 声明模块变量,与defineModuleVar的区别是不做重定义检查,默认为声明
 static int declareModuleVar(VM* vm, ObjModule* objModule, const char* name, uint32_t length, Value value) {
     ValueBufferAdd(vm, &objModule->moduleVarValue, value);
+    GC_WRITE_BARRIER(vm, objModule, value);
     return addSymbol(vm, &objModule->moduleVarName, name, length);
 }
 
@@ -694,6 +934,17 @@ static ObjFn* endCompileUnit(CompileUnit* cu, const char* debugName, uint32_t de
 static ObjFn* endCompileUnit(CompileUnit* cu) {
 #endif
     writeOpCode(cu, OPCODE_END);
+    fuseSuperInstructions(cu->fn);
+    // 指令流已确定,为各调用点分配内联缓存
+    if (cu->fn->inlineCacheNum > 0) {
+        cu->fn->inlineCaches = ALLOCATE_ARRAY(cu->curParser->vm, InlineCache, cu->fn->inlineCacheNum);
+        uint32_t idx = 0;
+        while (idx < cu->fn->inlineCacheNum) {
+            cu->fn->inlineCaches[idx].epoch = 0;
+            cu->fn->inlineCaches[idx].count = 0;
+            idx++;
+        }
+    }
     if (cu->enclosingUnit != NULL) {
         // 把当前编译单元作为常量添加到父编译单元的常量表
         uint32_t index = addConstant(cu->enclosingUnit, OBJ_TO_VALUE(cu->fn));
@@ -867,14 +1118,21 @@ static void id(CompileUnit* cu, bool canAssign) {
     // 处理顺序:函数调用->局部调用和upvalue->实例域->静态域->类getter方法调用->模块变量
 
     // 处理函数调用, id此时为函数名
-    if (cu->enclosingUnit == NULL && matchToken(cu->curParser, TOKEN_LEFT_PAREN)) {
-        char id[MAX_ID_LEN] = {'\0'};
+    // 模块作用域外(如函数体内递归调用)只要已定义同名函数也按函数调用处理,
+    // 但类的方法中同名方法优先,仍按后面的方法调用处理
+    char fnId[MAX_ID_LEN] = {'\0'};
+    int fnIndex = -1;
+    if (PEEK_TOKEN(cu->curParser) == TOKEN_LEFT_PAREN && (cu->enclosingUnit == NULL || classBK == NULL)) {
         // 函数名加上Fn前缀,作为模块变量名
-        memmove(id, "Fn ", 3);
-        memmove(id+3, name.start, name.length);
+        memmove(fnId, "Fn ", 3);
+        memmove(fnId+3, name.start, name.length);
+        fnIndex = getIndexFromSymbolTable(&cu->curParser->curModule->moduleVarName, fnId, strlen(fnId));
+    }
+    if ((cu->enclosingUnit == NULL || fnIndex != -1) && matchToken(cu->curParser, TOKEN_LEFT_PAREN)) {
+        char* id = fnId;
         Variable var;
         var.scopeType = VAR_SCOPE_MODULE;
-        var.index = getIndexFromSymbolTable(&cu->curParser->curModule->moduleVarName, id, strlen(id));
+        var.index = fnIndex;
         if (var.index == -1) {
             memmove(id, name.start, name.length);
             id[name.length] = '\0';
@@ -981,26 +1239,41 @@ static void emitLoadModuleVar(CompileUnit* cu, const char* name) {
     writeOpCodeShortOperand(cu, OPCODE_LOAD_MODULE_VAR, index);
 }
 
+// 生成OPCODE_INTERPOLATE,把栈顶partNum个字符串拼接为一个
+static void emitInterpolate(CompileUnit* cu, uint32_t partNum) {
+    writeOpCodeByteOperand(cu, OPCODE_INTERPOLATE, partNum);
+    // 弹出partNum个片段后压入结果
+    cu->stackSlotNum -= partNum - 1;
+}
+
+// 记录新压入的片段,片段数达到操作数上限时先把已有片段拼接为一个
+static uint32_t addInterpolationPart(CompileUnit* cu, uint32_t partNum) {
+    partNum++;
+    if (partNum == UINT8_MAX) {
+        emitInterpolate(cu, partNum);
+        partNum = 1;
+    }
+    return partNum;
+}
+
 // 内嵌表达式.nud()
 static void stringInterpolation(CompileUnit* cu, bool canAssign UNUSED) {
-    // a % (b+c) d %(e) f 会被编译为["a ", b+c, " d ", e, "f "].join()
+    // a % (b+c) d %(e) f 会被编译为依次压入"a ", (b+c).toString, " d ", e.toString, "f ",
+    // 再由OPCODE_INTERPOLATE 5一次算出总长度并拼接
     // 其中a和d是token_interpolation, b,c,e都是token_id, f是token_string
-    // 创建一个list实例拆分字符串,将拆分出的个部分作为元素添加到list
-    emitLoadModuleVar(cu, "List");
-    emitCall(cu, 0, "new()", 5);
+    uint32_t partNum = 0;
 
     // 每次处理字符串中的一个内嵌表达式,包括两部分,以a%(b+c)为例:
-    // 1. 加载TOKEN_INTERPOLATION对应的字符串,如a,将其加载到list
-    // 2. 解析内嵌表达式,如b+c,将结果添加到list
+    // 1. 加载TOKEN_INTERPOLATION对应的字符串,如a
+    // 2. 解析内嵌表达式,如b+c,并将结果转为字符串
     do {
         // 1. 处理TOKEN_INTERPOLATION中对应的字符串,如a
         literal(cu, false);
-        // 将字符串添加到list
-        emitCall(cu, 1, "addCore_(_)", 11); // 以_结尾的方法名是内部使用
+        partNum = addInterpolationPart(cu, partNum);
         // 2. 解析b+c
         expression(cu, BP_LOWEST);
-        // 将结果添加到list
-        emitCall(cu, 1, "addCore_(_)", 11);
+        emitCall(cu, 0, "toString", 8);
+        partNum = addInterpolationPart(cu, partNum);
 
     } while(matchToken(cu->curParser, TOKEN_INTERPOLATION)); // 处理下一个内嵌表达式,如a%(b+c) d %(e) f中的d %(e)
 
@@ -1008,16 +1281,13 @@ static void stringInterpolation(CompileUnit* cu, bool canAssign UNUSED) {
     consumeCurToken(cu->curParser, TOKEN_STRING, "expect string at the end of interpolatation");
     // 加载最后的字符串
     literal(cu, false);
-    // 将字符串添加到list
-    emitCall(cu, 1, "addCore_(_)", 11);
-    // 最后将以上list中的元素join为一个字符串
-    emitCall(cu, 0, "join()", 6);
+    partNum = addInterpolationPart(cu, partNum);
+    emitInterpolate(cu, partNum);
 }
 
 // 编译bool, true和false的nud方法
 static void boolean(CompileUnit* cu, bool canAssign UNUSED) {
-    OpCode opCode = cu->curParser->preToken.type == TOKEN_TRUE ? OPCODE_PUSH_TRUE : OPCODE_PUSH_FALSE;
-    writeOpCode(cu, opCode);
+    emitConstExpr(cu, BOOL_TO_VALUE(cu->curParser->preToken.type == TOKEN_TRUE));
 }
 
 
@@ -1042,7 +1312,7 @@ static void patchPlaceholder(CompileUnit* cu, uint32_t absIndex) {
 
 // "null".nud()
 static void null(CompileUnit* cu, bool canAssign UNUSED) {
-    writeOpCode(cu, OPCODE_PUSH_NULL);
+    emitConstExpr(cu, VT_TO_VALUE(VT_NULL));
 }
 // "this".nud()
 static void this(CompileUnit* cu, bool canAssign UNUSED) {
@@ -1247,31 +1517,84 @@ static void expression(CompileUnit* cu, BindPower rbp) {
     ASSERT(nud != NULL, "nud is NULL!");
     getNextToken(cu->curParser);
     bool canAssign = rbp < BP_ASSIGN;
+    uint32_t leftStart = cu->fn->instrStream.count;
     nud(cu, canAssign);
     while (rbp < Rules[cu->curParser->curToken.type].lbp) {
         DenotationFn led = Rules[cu->curParser->curToken.type].led;
         getNextToken(cu->curParser);
+        // 中缀运算符据此判断左操作数是否为常量
+        cu->leftOperandStart = leftStart;
         led(cu, canAssign);
     }
 }
 
 // 中缀运算符.led方法
+// 获得算术和比较运算符对应的专用操作码,其它运算符返回OPCODE_END
+static OpCode getNumOperatorOpCode(TokenType tokenType) {
+    switch (tokenType) {
+        case TOKEN_ADD: return OPCODE_ADD;
+        case TOKEN_SUB: return OPCODE_SUB;
+        case TOKEN_MUL: return OPCODE_MUL;
+        case TOKEN_DIV: return OPCODE_DIV;
+        case TOKEN_MOD: return OPCODE_MOD;
+        case TOKEN_GREATE: return OPCODE_GREATER;
+        case TOKEN_GREATE_EQUAL: return OPCODE_GREATER_EQUAL;
+        case TOKEN_LESS: return OPCODE_LESS;
+        case TOKEN_LESS_EQUAL: return OPCODE_LESS_EQUAL;
+        case TOKEN_EQUAL: return OPCODE_EQUAL;
+        case TOKEN_NOT_EQUAL: return OPCODE_NOT_EQUAL;
+        default: return OPCODE_END;
+    }
+}
+
 static void infixOperator(CompileUnit* cu, bool canAssign UNUSED) {
-    SymbolBindRule* rule = &Rules[cu->curParser->preToken.type];
+    TokenType type = cu->curParser->preToken.type;
+    SymbolBindRule* rule = &Rules[type];
+    OpCode opCode = getNumOperatorOpCode(type);
+    // 编译右操作数会覆盖常量表达式的记录,先取出左操作数
+    uint32_t leftStart = cu->leftOperandStart;
+    Value left, right, result;
+    bool isLeftConst = getConstExpr(cu, leftStart, &left);
+    uint32_t leftConstNum = cu->constExprConstNum;
     // 左右操作数绑定权值一样
     BindPower rbp = rule->lbp;
+    uint32_t rightStart = cu->fn->instrStream.count;
     expression(cu, rbp); // 解析右操作数
 
+    // 左右操作数都是常量时在编译期求值
+    if (isLeftConst && getConstExpr(cu, rightStart, &right) &&
+        foldInfixOperator(cu->curParser->vm, type, left, right, &result)) {
+        replaceWithConstExpr(cu, leftStart, leftConstNum, 2, result);
+        return;
+    }
+
     // 生成一个参数的签名
     Signature sign = {SIGN_METHOD, rule->id, strlen(rule->id), 1};
-    emitCallBySignature(cu, &sign, OPCODE_CALL0);
+    if (opCode == OPCODE_END) {
+        emitCallBySignature(cu, &sign, OPCODE_CALL0);
+        return;
+    }
+    // 算术和比较运算符生成专用操作码,操作数同CALL1一样是方法的索引和内联缓存索引,
+    // 运行时两个操作数都是数字则直接计算,否则按该索引进行方法调用
+    char signBuffer[MAX_SIGN_LEN];
+    uint32_t length = sign2String(&sign, signBuffer);
+    int symbolIndex = ensureSymbolExist(cu->curParser->vm, &cu->curParser->vm->allMethodNames, signBuffer, length);
+    writeOpCodeShortOperand(cu, opCode, symbolIndex);
+    writeInlineCacheOperand(cu);
 }
 
 // 前缀运算符.nud方法,如-, !等
 static void unaryOperator(CompileUnit* cu, bool canAssign UNUSED) {
-    SymbolBindRule* rule = &Rules[cu->curParser->preToken.type];
+    TokenType type = cu->curParser->preToken.type;
+    SymbolBindRule* rule = &Rules[type];
+    uint32_t operandStart = cu->fn->instrStream.count;
     // BP_UNARY 作为rbp去调用express解析右操作数
     expression(cu, BP_UNARY);
+    Value operand, result;
+    if (getConstExpr(cu, operandStart, &operand) && foldUnaryOperator(type, operand, &result)) {
+        replaceWithConstExpr(cu, operandStart, cu->constExprConstNum, 1, result);
+        return;
+    }
     // 生成调用前缀运算符的指令
     // 0 个参数,前缀运算符都是1个字符,长度是1
     emitCall(cu, 0, rule->id, 1);
@@ -1314,6 +1637,8 @@ static void compileVarDefinition(CompileUnit* cu, bool isStatic) {
                 if (matchToken(cu->curParser, TOKEN_ASSIGN)) {
                     expression(cu, BP_LOWEST);
                     emitStoreVariable(cu, var);
+                    // 初始值已存入静态域,弹出栈顶的临时值
+                    writeOpCode(cu, OPCODE_POP);
                 }
             } else {
                 COMPILE_ERROR(cu->curParser, "static field '%s' redefinition!", strchr(staticFieldId, ' ')+1);
@@ -1350,10 +1675,42 @@ static void compileVarDefinition(CompileUnit* cu, bool isStatic) {
     defineVariable(cu, index);
 }
 
+// 丢弃恒定的条件,返回其真假
+static bool discardConstCondition(CompileUnit* cu, uint32_t condStart, Value condition) {
+    uint32_t constNum = cu->constExprConstNum;
+    truncateInstr(cu, condStart);
+    cu->fn->constants.count = constNum;
+    cu->stackSlotNum--;
+    return !VALUE_IS_FALSE(condition) && !VALUE_IS_NULL(condition);
+}
+
+// 编译一条语句,isReachable为false时该语句不会执行,编译后丢弃其指令
+static void compilePrunableStatment(CompileUnit* cu, bool isReachable) {
+    uint32_t start = cu->fn->instrStream.count;
+    uint32_t constNum = cu->fn->constants.count;
+    // 仍需完整编译,以检查语法错误
+    compileStatment(cu);
+    if (!isReachable) {
+        truncateInstr(cu, start);
+        cu->fn->constants.count = constNum;
+    }
+}
+
 static void compileIfStatment(CompileUnit* cu) {
     consumeCurToken(cu->curParser, TOKEN_LEFT_PAREN, "missing '(' after if!");
+    uint32_t condStart = cu->fn->instrStream.count;
     expression(cu, BP_LOWEST);
     consumeCurToken(cu->curParser, TOKEN_RIGHT_PAREN, "missing ')' before '}' in if!");
+    Value condition;
+    if (getConstExpr(cu, condStart, &condition)) {
+        // 条件恒定时不生成跳转,只保留会执行的分支
+        bool isTrue = discardConstCondition(cu, condStart, condition);
+        compilePrunableStatment(cu, isTrue);
+        if (matchToken(cu->curParser, TOKEN_ELSE)) {
+            compilePrunableStatment(cu, !isTrue);
+        }
+        return;
+    }
     uint32_t falseBranchStart = emitInstrWithPlaceholder(cu, OPCODE_JUMP_IF_FALSE);
     // 编译then分支
     // 代码前后的{}由compileStatment读取
@@ -1390,7 +1747,11 @@ uint32_t getBytesOfOperands(Byte* instrStream, Value* constants, int ip) {
     case OPCODE_PUSH_FALSE:
     case OPCODE_PUSH_TRUE:
     case OPCODE_POP:
+    case OPCODE_POP_LOOP:
         return 0;
+    case OPCODE_INTERPOLATE:
+        // 1字节的片段数
+        return 1;
     case OPCODE_CREATE_CLASS:
     case OPCODE_LOAD_THIS_FIELD:
     case OPCODE_STORE_THIS_FIELD:
@@ -1400,7 +1761,26 @@ uint32_t getBytesOfOperands(Byte* instrStream, Value* constants, int ip) {
     case OPCODE_STORE_LOCAL_VAR:
     case OPCODE_LOAD_UPVALUE:
     case OPCODE_STORE_UPVALUE:
+    case OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR:
+    case OPCODE_LOAD_LOCAL_VAR_CONSTANT:
+    case OPCODE_STORE_LOCAL_VAR_POP:
+    case OPCODE_STORE_THIS_FIELD_POP:
+        // 超级指令的操作数只计第一条指令的,第二条指令仍按普通指令遍历
         return 1;
+    case OPCODE_LOAD_CONSTANT:
+    case OPCODE_LOAD_MODULE_VAR:
+    case OPCODE_STORE_MODULE_VAR:
+    case OPCODE_LOOP:
+    case OPCODE_JUMP:
+    case OPCODE_JUMP_IF_FALSE:
+    case OPCODE_AND:
+    case OPCODE_OR:
+    case OPCODE_INSTANCE_METHOD:
+    case OPCODE_STATIC_METHOD:
+        return 2;
+    case OPCODE_FOR_RANGE:
+        // 1字节的seq槽位和两个2字节的跳转偏移量
+        return 5;
     case OPCODE_CALL0:
     case OPCODE_CALL1:
     case OPCODE_CALL2:
@@ -1418,17 +1798,25 @@ uint32_t getBytesOfOperands(Byte* instrStream, Value* constants, int ip) {
     case OPCODE_CALL14:
     case OPCODE_CALL15:
     case OPCODE_CALL16:
-    case OPCODE_LOAD_CONSTANT:
-    case OPCODE_LOAD_MODULE_VAR:
-    case OPCODE_STORE_MODULE_VAR:
-    case OPCODE_LOOP:
-    case OPCODE_JUMP:
-    case OPCODE_JUMP_IF_FALSE:
-    case OPCODE_AND:
-    case OPCODE_OR:
-    case OPCODE_INSTANCE_METHOD:
-    case OPCODE_STATIC_METHOD:
-        return 2;
+    case OPCODE_ADD:
+    case OPCODE_SUB:
+    case OPCODE_MUL:
+    case OPCODE_DIV:
+    case OPCODE_MOD:
+    case OPCODE_GREATER:
+    case OPCODE_GREATER_EQUAL:
+    case OPCODE_LESS:
+    case OPCODE_LESS_EQUAL:
+    case OPCODE_EQUAL:
+    case OPCODE_NOT_EQUAL:
+    case OPCODE_GREATER_JUMP_IF_FALSE:
+    case OPCODE_GREATER_EQUAL_JUMP_IF_FALSE:
+    case OPCODE_LESS_JUMP_IF_FALSE:
+    case OPCODE_LESS_EQUAL_JUMP_IF_FALSE:
+    case OPCODE_EQUAL_JUMP_IF_FALSE:
+    case OPCODE_NOT_EQUAL_JUMP_IF_FALSE:
+        // 2字节的方法索引和2字节的内联缓存索引
+        return 4;
     case OPCODE_SUPER0:
     case OPCODE_SUPER1:
     case OPCODE_SUPER2:
@@ -1447,8 +1835,9 @@ uint32_t getBytesOfOperands(Byte* instrStream, Value* constants, int ip) {
     case OPCODE_SUPER15:
     case OPCODE_SUPER16:
         // OPCODE_SUPERX的操作数分别由writeOpCodeShortOperand
-        // 和writeShortOperand写入的,共1个操作码和4个字节的操作数
-        return 4;
+        // 和writeShortOperand写入的,依次是方法索引,基类常量索引和内联缓存索引
+        // 共1个操作码和6个字节的操作数
+        return 6;
     case OPCODE_CREATE_CLOSURE: {
         // 获得操作码OPCODE_CLOSURE操作数,2字节
         // 该操作数是待创建闭包的函数在常量表中的索引
@@ -1477,8 +1866,10 @@ static void leaveLoopPatch(CompileUnit* cu) {
     int loopBackOffset = cu->fn->instrStream.count - cu->curLoop->condStartIndex + 2;
     // 生成向回跳转的CODE_LOOP指令,即使ip -= loopBackOffset
     writeOpCodeShortOperand(cu, OPCODE_LOOP, loopBackOffset);
-    // 回填循环体的结束地址
-    patchPlaceholder(cu, cu->curLoop->exitIndex);
+    // 回填循环体的结束地址,条件恒为真的循环没有条件跳转
+    if (cu->curLoop->exitIndex != -1) {
+        patchPlaceholder(cu, cu->curLoop->exitIndex);
+    }
     // 下面在循环体中回填break的占位符OPCODE_END
     // 循环体开始地址
     uint32_t idx = cu->curLoop->bodyStartIndex;
@@ -1508,11 +1899,9 @@ static void enterScope(CompileUnit* cu) {
 
 // 退出作用域
 static void leaveScope(CompileUnit* cu) {
-    if (cu->enclosingUnit != NULL) {
-        uint32_t discardNum = discardLocalVar(cu, cu->scopeDepth);
-        cu->localVarNum -= discardNum;
-        cu->stackSlotNum -= discardNum;
-    }
+    uint32_t discardNum = discardLocalVar(cu, cu->scopeDepth);
+    cu->localVarNum -= discardNum;
+    cu->stackSlotNum -= discardNum;
     // 回到上一层作用域
     cu->scopeDepth--;
 }
@@ -1529,10 +1918,26 @@ static void compileWhileStatement(CompileUnit* cu) {
     // 设置循环体起始地址
     enterLoopSetting(cu, &loop);
     consumeCurToken(cu->curParser, TOKEN_LEFT_PAREN, "expect '(' befor condition!");
+    uint32_t condStart = cu->fn->instrStream.count;
     expression(cu, BP_LOWEST);
     consumeCurToken(cu->curParser, TOKEN_RIGHT_PAREN, "expect ')' after condition!");
-    // 先把条件失败时跳转的目标地址占位
-    loop.exitIndex = emitInstrWithPlaceholder(cu, OPCODE_JUMP_IF_FALSE);
+    Value condition;
+    if (getConstExpr(cu, condStart, &condition)) {
+        if (!discardConstCondition(cu, condStart, condition)) {
+            // 条件恒为假,循环体不会执行,编译后丢弃
+            uint32_t constNum = cu->fn->constants.count;
+            compileLoopBody(cu);
+            truncateInstr(cu, condStart);
+            cu->fn->constants.count = constNum;
+            cu->curLoop = loop.enclosingLoop;
+            return;
+        }
+        // 条件恒为真,只能由break退出
+        loop.exitIndex = -1;
+    } else {
+        // 先把条件失败时跳转的目标地址占位
+        loop.exitIndex = emitInstrWithPlaceholder(cu, OPCODE_JUMP_IF_FALSE);
+    }
     compileLoopBody(cu);
     // 设置循环体结束等等
     leaveLoopPatch(cu);
@@ -1550,6 +1955,8 @@ static void compileForStatment(CompileUnit* cu) {
     //      var i = seq.iteratorValue(iter)
     //      system.Print(i)
     // }
+    // 循环头部另有OPCODE_FOR_RANGE: seq是range时直接在iter中计数,
+    // 跳过iterate和iteratorValue两次方法调用,迭代过程不再分派方法也不申请内存
     
     // 为局部变量seq和iter创建作用域
     enterScope(cu);
@@ -1569,6 +1976,11 @@ static void compileForStatment(CompileUnit* cu) {
     uint32_t iterSlot = addLocalVar(cu, "iter ", 5);
     Loop loop;
     enterLoopSetting(cu, &loop);
+    // 操作数为seq的槽位(iter紧随其后),到条件判断和到循环体的偏移量,后两者待回填
+    writeOpCodeByteOperand(cu, OPCODE_FOR_RANGE, seqSlot);
+    writeShortOperand(cu, 0xffff);
+    writeShortOperand(cu, 0xffff);
+    uint32_t forRangeEnd = cu->fn->instrStream.count;
     // 为调用seq.iterate(iter)做准备
     // 1. 先压如序列对象seq
     writeOpCodeByteOperand(cu, OPCODE_LOAD_LOCAL_VAR, seqSlot);
@@ -1587,6 +1999,15 @@ static void compileForStatment(CompileUnit* cu) {
     writeOpCodeByteOperand(cu, OPCODE_LOAD_LOCAL_VAR, iterSlot);
     emitCall(cu, 1, "iteratorValue(_)", 16);
 
+    // 回填OPCODE_FOR_RANGE的偏移量: range迭代结束时跳到JUMP_IF_FALSE由其退出循环,否则直接进入循环体
+    Byte* instrStream = cu->fn->instrStream.datas;
+    uint32_t condOffset = (loop.exitIndex - 1) - forRangeEnd;
+    uint32_t bodyOffset = cu->fn->instrStream.count - forRangeEnd;
+    instrStream[forRangeEnd - 4] = (condOffset >> 8) & 0xff;
+    instrStream[forRangeEnd - 3] = condOffset & 0xff;
+    instrStream[forRangeEnd - 2] = (bodyOffset >> 8) & 0xff;
+    instrStream[forRangeEnd - 1] = bodyOffset & 0xff;
+
     // 为循环变量i创建作用域
     enterScope(cu);
     addLocalVar(cu, loopVarName, loopVarLen);
@@ -1685,10 +2106,14 @@ static void defineMethod(CompileUnit* cu, Variable classVar, bool isStatic, int
 static void emitCreateInstance(CompileUnit* cu, Signature* sign, uint32_t constructIndex) {
     CompileUnit methodCU;
     initCompileUnit(cu->curParser, &methodCU, cu, true);
+    // 参数已由调用方压栈,计入栈的使用量
+    methodCU.fn->argNum = sign->argNum;
+    methodCU.stackSlotNum += sign->argNum;
     // 1. 生成OPCODE_CONSTRUCE指令,该指令生成新实例存储到stack[0]中
     writeOpCode(&methodCU, OPCODE_CONSTRUCT);
     // 2. 生成OPCODE_CALLx指令,该指令调用新实例的构造函数
     writeOpCodeShortOperand(&methodCU, (OpCode)(OPCODE_CALL0+sign->argNum), constructIndex);
+    writeInlineCacheOperand(&methodCU);
     // 生成return指令,将栈顶中的实例返回
     writeOpCode(&methodCU, OPCODE_RETURN);
 
@@ -1719,6 +2144,7 @@ static void compileMethod(CompileUnit* cu, Variable classVar, bool isStatic) {
     CompileUnit methodCU;
     initCompileUnit(cu->curParser, &methodCU, cu, true);
     methodSign(&methodCU, &sign);
+    methodCU.fn->argNum = sign.argNum;
     consumeCurToken(cu->curParser, TOKEN_LEFT_BRACE, "expect '{' at the beginning of method body");
     if (cu->enclosingClassBK->inStatic && sign.type == SIGN_CONSTRUCT) {
         COMPILE_ERROR(cu->curParser, "constructor is not allowed to be static!");
@@ -1790,7 +2216,7 @@ static void compileClassDefinition(CompileUnit* cu) {
     ClassBookKeep classBK;
     classBK.name = className;
     classBK.inStatic = false;
-    StringBufferInit(&classBK.fields);
+    symbolTableInit(&classBK.fields);
     IntBufferInit(&classBK.instantMethods);
     IntBufferInit(&classBK.staticMethods);
     cu->enclosingClassBK = &classBK;
@@ -1955,15 +2381,16 @@ ObjFn* compileModule(VM* vm, ObjModule* objModule, const char* moduleCode) {
         }
         idx++;
     }
-    // 编译完成后置空
-    vm->curParser->curCompileUnit = NULL;
-    vm->curParser = vm->curParser->parent;
-
+    // endCompileUnit中仍会申请内存,须在解除parser之前调用,使gc能标记到moduleCU.fn
 #if DEBUG
-    return endCompileUnit(&moduleCU, "(script)", 8);
+    ObjFn* fn = endCompileUnit(&moduleCU, "(script)", 8);
 #else
-    return endCompileUnit(&moduleCU);
+    ObjFn* fn = endCompileUnit(&moduleCU);
 #endif
+    // 编译完成后置空
+    vm->curParser->curCompileUnit = NULL;
+    vm->curParser = vm->curParser->parent;
+    return fn;
 }
 
 // 标识compileUnit使用的所有堆分配的对象(及其所有父对象)可达,以使它们不被GC收集
@@ -1977,6 +2404,9 @@ void grayCompileUnit(VM* vm, CompileUnit* cu) {
    ASSERT(vm->curParser != NULL, "only called while compiling!");
    do {
       grayObject(vm, (ObjHeader*)cu->fn);
+      if (cu->constIndex != NULL) {
+         grayObject(vm, (ObjHeader*)cu->constIndex);
+      }
       cu = cu->enclosingUnit;
    } while (cu != NULL);
 }
\ No newline at end of file
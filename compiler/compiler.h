@@ -13,6 +13,13 @@
 #define MAX_SIGN_LEN MAX_METHOD_NAME_LEN + MAX_ARG_NUM * 2 + 1
 
 #define MAX_FIELD_NUM 128
+
+// 编译时指定-DCONSTANT_FOLDING=0关闭常量折叠,
+// 开启时操作数都是常量的运算在编译期求值, 条件恒定的if和while只保留会执行的分支
+#ifndef CONSTANT_FOLDING
+    #define CONSTANT_FOLDING 1
+#endif
+
 typedef struct {
     // 如果此upvalue是直接外层函数的局部变量就置为true，否则为false
     bool isEnclosingLocalVar;
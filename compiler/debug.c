@@ -26,7 +26,7 @@
 
     // 打印对象
     static void dumpObject(ObjHeader* obj) {
-        switch (obj->type) {
+        switch (OBJ_TYPE(obj)) {
             case OT_CLASS:
                 printf("[class %s %p]", ((Class*)obj)->name->value.start, obj);
                 break;
@@ -61,14 +61,14 @@
                 printf("[upvalue %p]", obj);
                 break;
             default:
-                printf("[unknown object %d]", obj->type);
+                printf("[unknown object %d]", OBJ_TYPE(obj));
                 break;
         }
     }
 
     // 打印value
     void dumpValue(Value value) {
-        switch (value.type) {
+        switch (VALUE_TYPE(value)) {
             case VT_FALSE:printf("false");break;
             case VT_NULL:printf("null");break;
             case VT_NUM:printf("%.14g", VALUE_TO_NUM(value));break;
@@ -78,6 +78,13 @@
         }
     }
 
+    // 操作码名称表,由opcode.inc生成
+    static const char* opCodeNames[] = {
+        #define OPCODE_SLOTS(opcode, effect) #opcode,
+        #include "opcode.inc"
+        #undef OPCODE_SLOTS
+    };
+
     // 打印一条指令
     static int dumpOneInstruction(VM* vm, ObjFn* fn, int i, int* lastLine) {
         int start = i;
@@ -131,6 +138,14 @@
 
             case OPCODE_POP: printf("POP\n");break;
 
+            // 超级指令只打印第一条指令的操作数,第二条指令在下一行照常打印
+            case OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR:
+            case OPCODE_LOAD_LOCAL_VAR_CONSTANT:
+            case OPCODE_STORE_LOCAL_VAR_POP:
+            case OPCODE_STORE_THIS_FIELD_POP:
+                BYTE_INSTRUCTION(opCodeNames[opCode]);
+            case OPCODE_POP_LOOP: printf("POP_LOOP\n");break;
+
             case OPCODE_CALL0:
             case OPCODE_CALL1:
             case OPCODE_CALL2:
@@ -150,7 +165,8 @@
             case OPCODE_CALL16: {
                 int numArgs = byteCode[i-1] - OPCODE_CALL0;
                 int symbol = READ_SHORT();
-                printf("CALL%-11d %5d '%s'\n", numArgs, symbol, vm->allMethodNames.datas[symbol].str);
+                int cache = READ_SHORT();
+                printf("CALL%-11d %5d '%s' cache:%d\n", numArgs, symbol, vm->allMethodNames.datas[symbol].str, cache);
                 break;
             }
             case OPCODE_SUPER0:
@@ -173,7 +189,30 @@
                 int numArgs = byteCode[i-1] - OPCODE_SUPER0;
                 int symbol = READ_SHORT();
                 int superclass = READ_SHORT();
-                printf("SUPER%-10d %5d '%s' %5d\n", numArgs, symbol, vm->allMethodNames.datas[symbol].str, superclass);
+                int cache = READ_SHORT();
+                printf("SUPER%-10d %5d '%s' %5d cache:%d\n", numArgs, symbol, vm->allMethodNames.datas[symbol].str, superclass, cache);
+                break;
+            }
+            case OPCODE_ADD:
+            case OPCODE_SUB:
+            case OPCODE_MUL:
+            case OPCODE_DIV:
+            case OPCODE_MOD:
+            case OPCODE_GREATER:
+            case OPCODE_GREATER_EQUAL:
+            case OPCODE_LESS:
+            case OPCODE_LESS_EQUAL:
+            case OPCODE_EQUAL:
+            case OPCODE_NOT_EQUAL:
+            case OPCODE_GREATER_JUMP_IF_FALSE:
+            case OPCODE_GREATER_EQUAL_JUMP_IF_FALSE:
+            case OPCODE_LESS_JUMP_IF_FALSE:
+            case OPCODE_LESS_EQUAL_JUMP_IF_FALSE:
+            case OPCODE_EQUAL_JUMP_IF_FALSE:
+            case OPCODE_NOT_EQUAL_JUMP_IF_FALSE: {
+                int symbol = READ_SHORT();
+                int cache = READ_SHORT();
+                printf("%-16s %5d '%s' cache:%d\n", opCodeNames[opCode], symbol, vm->allMethodNames.datas[symbol].str, cache);
                 break;
             }
             case OPCODE_JUMP: {
@@ -186,6 +225,18 @@
                 printf("%-16s offset:%-5d abs:%d\n", "LOOP", offset, i-offset);
                 break;
             }
+            case OPCODE_FOR_RANGE: {
+                int slot = READ_BYTE();
+                int condOffset = READ_SHORT();
+                int bodyOffset = READ_SHORT();
+                printf("%-16s %5d cond:%d body:%d\n", "FOR_RANGE", slot, i+condOffset, i+bodyOffset);
+                break;
+            }
+            case OPCODE_INTERPOLATE: {
+                int partNum = READ_BYTE();
+                printf("%-16s %5d\n", "INTERPOLATE", partNum);
+                break;
+            }
             case OPCODE_JUMP_IF_FALSE: {
                 int offset = READ_SHORT();
                 printf("%-16s offset:%-5d abs:%d\n", "JUMP_IF_FALSE", offset, i+offset);
@@ -0,0 +1,74 @@
+#include "peephole.h"
+#include "compiler.h"
+
+// 超级指令表,依据bench和sample中动态执行的相邻指令对的频次选取
+// 合并时只把第一条指令的操作码改写为超级指令,第二条指令原样保留在指令流中,
+// 因此指令长度和跳转偏移都不变,跳转到第二条指令处也照常执行.
+// 超级指令的操作数与第一条指令相同,执行时一并完成第二条指令并跳过其操作码
+typedef struct {
+    OpCode first;
+    OpCode second;
+    OpCode fused;
+} SuperInstruction;
+
+static const SuperInstruction superInstructions[] = {
+    {OPCODE_LOAD_LOCAL_VAR, OPCODE_LOAD_LOCAL_VAR, OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR},
+    {OPCODE_LOAD_LOCAL_VAR, OPCODE_LOAD_CONSTANT, OPCODE_LOAD_LOCAL_VAR_CONSTANT},
+    {OPCODE_STORE_LOCAL_VAR, OPCODE_POP, OPCODE_STORE_LOCAL_VAR_POP},
+    {OPCODE_STORE_THIS_FIELD, OPCODE_POP, OPCODE_STORE_THIS_FIELD_POP},
+    {OPCODE_POP, OPCODE_LOOP, OPCODE_POP_LOOP},
+    {OPCODE_GREATER, OPCODE_JUMP_IF_FALSE, OPCODE_GREATER_JUMP_IF_FALSE},
+    {OPCODE_GREATER_EQUAL, OPCODE_JUMP_IF_FALSE, OPCODE_GREATER_EQUAL_JUMP_IF_FALSE},
+    {OPCODE_LESS, OPCODE_JUMP_IF_FALSE, OPCODE_LESS_JUMP_IF_FALSE},
+    {OPCODE_LESS_EQUAL, OPCODE_JUMP_IF_FALSE, OPCODE_LESS_EQUAL_JUMP_IF_FALSE},
+    {OPCODE_EQUAL, OPCODE_JUMP_IF_FALSE, OPCODE_EQUAL_JUMP_IF_FALSE},
+    {OPCODE_NOT_EQUAL, OPCODE_JUMP_IF_FALSE, OPCODE_NOT_EQUAL_JUMP_IF_FALSE}
+};
+
+#define SUPER_INSTRUCTION_NUM (sizeof(superInstructions) / sizeof(superInstructions[0]))
+
+#if SUPERINSTRUCTIONS
+// 返回first和second合并成的超级指令,不能合并时返回OPCODE_END
+static OpCode findSuperInstruction(OpCode first, OpCode second) {
+    uint32_t idx = 0;
+    while (idx < SUPER_INSTRUCTION_NUM) {
+        if (superInstructions[idx].first == first && superInstructions[idx].second == second) {
+            return superInstructions[idx].fused;
+        }
+        idx++;
+    }
+    return OPCODE_END;
+}
+#endif
+
+// 把fn指令流中可合并的相邻指令对改写为超级指令
+// 须在指令流最终确定后调用,即endCompileUnit写入OPCODE_END之后或从字节码缓存载入之后
+void fuseSuperInstructions(ObjFn* fn) {
+#if SUPERINSTRUCTIONS
+    Byte* instrStream = fn->instrStream.datas;
+    uint32_t ip = 0;
+    while (instrStream[ip] != OPCODE_END) {
+        uint32_t next = ip + 1 + getBytesOfOperands(instrStream, fn->constants.datas, ip);
+        OpCode fused = findSuperInstruction((OpCode)instrStream[ip], (OpCode)instrStream[next]);
+        if (fused != OPCODE_END) {
+            instrStream[ip] = fused;
+        }
+        ip = next;
+    }
+#else
+    (void)fn;
+#endif
+}
+
+// 返回超级指令的第一条指令,其它指令原样返回
+// 写入字节码缓存前据此还原指令流,载入后再重新合并
+OpCode unfuseOpCode(OpCode opCode) {
+    uint32_t idx = 0;
+    while (idx < SUPER_INSTRUCTION_NUM) {
+        if (superInstructions[idx].fused == opCode) {
+            return superInstructions[idx].first;
+        }
+        idx++;
+    }
+    return opCode;
+}
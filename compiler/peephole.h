@@ -0,0 +1,13 @@
+#ifndef _COMPILER_PEEPHOLE_H
+#define _COMPILER_PEEPHOLE_H
+#include "vm.h"
+
+// 编译时指定-DSUPERINSTRUCTIONS=0可关闭超级指令,便于对比
+// 开启时函数编译完成或从字节码缓存载入后,常见的相邻指令对被合并为一条超级指令
+#ifndef SUPERINSTRUCTIONS
+    #define SUPERINSTRUCTIONS 1
+#endif
+
+void fuseSuperInstructions(ObjFn* fn);
+OpCode unfuseOpCode(OpCode opCode);
+#endif
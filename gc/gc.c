@@ -3,20 +3,108 @@
 #include "obj_list.h"
 #include "obj_range.h"
 #include "utils.h"
+#include <string.h>
+#include <time.h>
+#if GC_MARK_THREADS > 1
+    #include <pthread.h>
+    #include <sched.h>
+    #include "gray_deque.h"
+#endif
 #if DEBUG
     #include "debug.h"
-    #include <time.h>
 #endif
 
+#if GC_MARK_THREADS > 1
+typedef struct parallelMark ParallelMark;
+
+// 并行标记中的一个标记线程
+typedef struct {
+    VM* vm;
+    ParallelMark* parallelMark;
+    GrayDeque deque; // 本线程的灰色对象
+    uint32_t idx;
+    uint64_t markedBytes; // 本线程标黑的对象大小,标记结束后累加到vm->markedBytes
+    // 本线程按类型累计的存活对象大小和数量,标记结束后累加到vm中
+    uint64_t markedBytesByType[OBJ_TYPE_NUM];
+    uint64_t markedObjectsByType[OBJ_TYPE_NUM];
+} MarkWorker;
+
+struct parallelMark {
+    MarkWorker workers[GC_MARK_THREADS];
+    uint32_t workerNum;
+    uint32_t idleNum; // 找不到灰色对象的线程数,等于workerNum时标记结束
+};
+
+// 当前线程对应的标记线程,不在并行标记中时为NULL
+static __thread MarkWorker* curWorker = NULL;
+
+// 标黑对象时累计其大小,并行标记时先累计到各线程自己的计数中
+#define MARKED_BYTES(vm) (*(curWorker != NULL ? &curWorker->markedBytes : &(vm)->markedBytes))
+#define MARKED_BYTES_BY_TYPE(vm) (curWorker != NULL ? curWorker->markedBytesByType : (vm)->markedBytesByType)
+#define MARKED_OBJECTS_BY_TYPE(vm) (curWorker != NULL ? curWorker->markedObjectsByType : (vm)->markedObjectsByType)
+#else
+#define MARKED_BYTES(vm) ((vm)->markedBytes)
+#define MARKED_BYTES_BY_TYPE(vm) ((vm)->markedBytesByType)
+#define MARKED_OBJECTS_BY_TYPE(vm) ((vm)->markedObjectsByType)
+#endif
+#define ADD_MARKED_BYTES(vm, bytes) (MARKED_BYTES(vm) += (bytes))
+
+// 把obj压入gray中
+// 此处直接使用realloc而不是memManager,避免在回收过程中再触发回收
+static void pushGray(Gray* gray, ObjHeader* obj) {
+    if (gray->count >= gray->capacity) {
+        gray->capacity = gray->capacity == 0 ? 32 : gray->capacity * 2;
+        gray->grayObjects = (ObjHeader**)realloc(gray->grayObjects, gray->capacity * sizeof(ObjHeader*));
+        if (gray->grayObjects == NULL) {
+            MEM_ERROR("allocate gray stack failed!");
+        }
+    }
+    gray->grayObjects[gray->count++] = obj;
+}
+
 void grayObject(VM* vm, ObjHeader* obj) {
-    if (obj == NULL || obj->isDark) return;
-    obj->isDark = true;
-    if (vm->grays.count >= vm->grays.capacity) {
-        vm->grays.capacity = vm->grays.count * 2;
-        vm->grays.grayObjects = (ObjHeader**)realloc(vm->grays.grayObjects, vm->grays.capacity * sizeof(ObjHeader*));
+#if GC_MARK_THREADS > 1
+    if (curWorker != NULL) {
+        // 多个线程可能同时标记同一对象,只有置位标记位的线程将其压入自己的队列
+        if (obj == NULL) return;
+        bool wasDark = OBJ_HAS_FLAG(obj, OBJ_FLAG_IN_SLAB) ?
+            SLAB_TEST_AND_SET_MARK(obj) : OBJ_TEST_AND_SET_FLAG(obj, OBJ_FLAG_DARK);
+        if (!wasDark) {
+            grayDequePush(&curWorker->deque, obj);
+        }
+        return;
+    }
+#endif
+    if (obj == NULL || OBJ_IS_DARK(obj)) return;
+#if GC_GENERATIONAL
+    // 新生代回收时老年代对象视为存活,不再深入
+    if (vm->isMinorGC && OBJ_HAS_FLAG(obj, OBJ_FLAG_OLD)) return;
+#endif
+    if (OBJ_HAS_FLAG(obj, OBJ_FLAG_IN_SLAB)) {
+        SLAB_SET_MARK(obj);
+    } else {
+        OBJ_SET_FLAG(obj, OBJ_FLAG_DARK);
+    }
+    pushGray(&vm->grays, obj);
+}
+
+#if GC_GENERATIONAL
+// 把老年代对象obj记入记忆集,下次新生代回收时作为根扫描
+void rememberObject(VM* vm, ObjHeader* obj) {
+    OBJ_SET_FLAG(obj, OBJ_FLAG_REMEMBERED);
+    pushGray(&vm->rememberedSet, obj);
+}
+
+// 清空记忆集
+static void clearRememberedSet(VM* vm) {
+    uint32_t idx = 0;
+    while (idx < vm->rememberedSet.count) {
+        OBJ_CLEAR_FLAG(vm->rememberedSet.grayObjects[idx], OBJ_FLAG_REMEMBERED);
+        idx++;
     }
-    vm->grays.grayObjects[vm->grays.count++] = obj;
+    vm->rememberedSet.count = 0;
 }
+#endif
 
 // 标灰
 void grayValue(VM* vm, Value value) {
@@ -43,17 +131,18 @@ static void blackClass(VM* vm, Class* class) {
     grayObject(vm, (ObjHeader*)class->superClass);
     // 标灰方法
     uint32_t idx = 0;
-    while (idx < class->methods.count) {
-        if (class->methods.datas[idx].type == MT_SCRIPT) {
-            grayObject(vm, (ObjHeader*)class->methods.datas[idx].obj);
+    while (idx < class->methods.capacity) {
+        MethodEntry* entry = &class->methods.entries[idx];
+        if (entry->index != EMPTY_METHOD_INDEX && entry->method.type == MT_SCRIPT) {
+            grayObject(vm, (ObjHeader*)entry->method.obj);
         }
         idx++;
     }
     // 标灰类名
     grayObject(vm, (ObjHeader*)class->name);
     // 累计类大小
-    vm->allocatedBytes += sizeof(Class);
-    vm->allocatedBytes += sizeof(Method) * class->methods.capacity;
+    ADD_MARKED_BYTES(vm, sizeof(Class));
+    ADD_MARKED_BYTES(vm, sizeof(MethodEntry) * class->methods.capacity);
 }
 
 // 标灰闭包
@@ -67,12 +156,12 @@ static void blackClosure(VM* vm, ObjClosure* objClosure) {
         idx++;
     }
     // 累计闭包大小
-    vm->allocatedBytes += sizeof(ObjClosure);
-    vm->allocatedBytes += sizeof(ObjUpvalue*) * objClosure->fn->upvalueNum;
+    ADD_MARKED_BYTES(vm, sizeof(ObjClosure));
+    ADD_MARKED_BYTES(vm, sizeof(ObjUpvalue*) * objClosure->fn->upvalueNum);
 }
 
-// 标黑objThread
-static void blackThread(VM* vm, ObjThread* objThread) {
+// 标灰objThread引用的对象
+static void grayThreadReferences(VM* vm, ObjThread* objThread) {
     // 标灰frame
     uint32_t idx = 0;
     while (idx < objThread->usedFrameNum) {
@@ -94,21 +183,35 @@ static void blackThread(VM* vm, ObjThread* objThread) {
     // 标灰caller
     grayObject(vm, (ObjHeader*)objThread->caller);
     grayValue(vm, objThread->errorObj);
+}
+
+// 标黑objThread
+static void blackThread(VM* vm, ObjThread* objThread) {
+    grayThreadReferences(vm, objThread);
+    // 线程在标黑后仍可能继续执行,记录下来在标记结束时重新扫描
+    // 并行标记时程序已暂停,无需重新扫描
+#if GC_MARK_THREADS > 1
+    if (curWorker == NULL) {
+        pushGray(&vm->grayAgainThreads, (ObjHeader*)objThread);
+    }
+#else
+    pushGray(&vm->grayAgainThreads, (ObjHeader*)objThread);
+#endif
     // 累计线程大小
-    vm->allocatedBytes += sizeof(ObjThread);
-    vm->allocatedBytes += objThread->frameCapacity *sizeof(Frame);
-    vm->allocatedBytes += objThread->stackCapacity * sizeof(Value);
+    ADD_MARKED_BYTES(vm, sizeof(ObjThread));
+    ADD_MARKED_BYTES(vm, objThread->frameCapacity *sizeof(Frame));
+    ADD_MARKED_BYTES(vm, objThread->stackCapacity * sizeof(Value));
 }
 // 标黑fn
 static void blackFn(VM* vm, ObjFn* fn) {
     // 标灰常量
     grayBuffer(vm, &fn->constants);
     // 累计Objfn的空间
-    vm->allocatedBytes += sizeof(ObjFn);
-    vm->allocatedBytes += sizeof(uint8_t) * fn->instrStream.capacity;
-    vm->allocatedBytes += sizeof(Value) * fn->constants.capacity;
+    ADD_MARKED_BYTES(vm, sizeof(ObjFn));
+    ADD_MARKED_BYTES(vm, sizeof(uint8_t) * fn->instrStream.capacity);
+    ADD_MARKED_BYTES(vm, sizeof(Value) * fn->constants.capacity);
 #if DEBUG
-    vm->allocatedBytes += sizeof(Int) * fn->instrStream.capacity;
+    ADD_MARKED_BYTES(vm, sizeof(Int) * fn->instrStream.capacity);
 #endif
 }
 
@@ -122,30 +225,30 @@ static void blackInstance(VM* vm, ObjInstance* objInstance) {
         grayValue(vm, objInstance->fields[idx]);
         idx++;
     }
-    vm->allocatedBytes += sizeof(ObjInstance);
-    vm->allocatedBytes += sizeof(Value) * objInstance->objHeader.class->fieldNum;
+    ADD_MARKED_BYTES(vm, sizeof(ObjInstance));
+    ADD_MARKED_BYTES(vm, sizeof(Value) * objInstance->objHeader.class->fieldNum);
 }
 
 // 标黑objList
 static void blackList(VM* vm, ObjList* objList) {
     grayBuffer(vm, &objList->elements);
-    vm->allocatedBytes += sizeof(ObjList);
-    vm->allocatedBytes += sizeof(Value) * objList->elements.capacity;
+    ADD_MARKED_BYTES(vm, sizeof(ObjList));
+    ADD_MARKED_BYTES(vm, sizeof(Value) * objList->elements.capacity);
 }
 
 // 标黑objMap
 static void blackMap(VM* vm, ObjMap* objMap) {
     uint32_t idx = 0;
     while (idx < objMap->capacity) {
-        Entry* entry = &objMap->entries[idx];
-        if (!VALUE_IS_UNDEFINED(entry->key)) {
+        if (MAP_SLOT_IS_FULL(objMap, idx)) {
+            Entry* entry = &objMap->entries[idx];
             grayValue(vm, entry->key);
             grayValue(vm, entry->value);
         }
         idx++;
     }
-    vm->allocatedBytes += sizeof(ObjMap);
-    vm->allocatedBytes += sizeof(Entry) * objMap->capacity;
+    ADD_MARKED_BYTES(vm, sizeof(ObjMap));
+    ADD_MARKED_BYTES(vm, (sizeof(Entry) + sizeof(uint8_t)) * objMap->capacity);
 }
 
 // 标黑objModule
@@ -158,22 +261,23 @@ static void blackModule(VM* vm, ObjModule* objModule) {
     // 标记模块名
     grayObject(vm, (ObjHeader*)objModule->name);
     
-    vm->allocatedBytes += sizeof(ObjModule);
-    vm->allocatedBytes += sizeof(String) * objModule->moduleVarName.capacity;
-    vm->allocatedBytes += sizeof(Value) * objModule->moduleVarValue.capacity;
+    ADD_MARKED_BYTES(vm, sizeof(ObjModule));
+    ADD_MARKED_BYTES(vm, sizeof(String) * objModule->moduleVarName.capacity);
+    ADD_MARKED_BYTES(vm, sizeof(int) * objModule->moduleVarName.slotCapacity);
+    ADD_MARKED_BYTES(vm, sizeof(Value) * objModule->moduleVarValue.capacity);
 }
 
 static void blackRange(VM* vm) {
-    vm->allocatedBytes += sizeof(ObjRange);
+    ADD_MARKED_BYTES(vm, sizeof(ObjRange));
 }
 
 static void blackString(VM* vm, ObjString* objString) {
-    vm->allocatedBytes += sizeof(ObjString) + objString->value.length + 1;
+    ADD_MARKED_BYTES(vm, sizeof(ObjString) + objString->value.length + 1);
 }
 
 static void blackUpvalue(VM* vm, ObjUpvalue* objUpvalue) {
     grayValue(vm, objUpvalue->closedUpvalue);
-    vm->allocatedBytes += sizeof(ObjUpvalue);
+    ADD_MARKED_BYTES(vm, sizeof(ObjUpvalue));
 }
 
 static void blackObject(VM* vm, ObjHeader* obj) {
@@ -182,7 +286,9 @@ static void blackObject(VM* vm, ObjHeader* obj) {
     dumpValue(OBJ_TO_VALUE(obj));
     printf(" @ %p\n", obj);
 #endif
-    switch (obj->type) {
+    ObjType type = OBJ_TYPE(obj);
+    uint64_t markedBytes = MARKED_BYTES(vm);
+    switch (type) {
         case OT_CLASS:
             blackClass(vm, (Class*)obj);
             break;
@@ -217,6 +323,11 @@ static void blackObject(VM* vm, ObjHeader* obj) {
             blackUpvalue(vm, (ObjUpvalue*)obj);
             break;
     }
+    // 完整回收时按类型统计存活对象
+    if (!vm->isMinorGC) {
+        MARKED_BYTES_BY_TYPE(vm)[type] += MARKED_BYTES(vm) - markedBytes;
+        MARKED_OBJECTS_BY_TYPE(vm)[type]++;
+    }
 }
 
 // 标黑已经标灰的对象
@@ -227,6 +338,145 @@ static void blackObjectInGray(VM* vm) {
     }
 }
 
+#if GC_MARK_THREADS > 1
+// 从其它线程的队列中窃取一个灰色对象
+static ObjHeader* stealGray(MarkWorker* worker) {
+    ParallelMark* parallelMark = worker->parallelMark;
+    uint32_t workerNum = __atomic_load_n(&parallelMark->workerNum, __ATOMIC_ACQUIRE);
+    uint32_t idx = 1;
+    while (idx < workerNum) {
+        MarkWorker* victim = &parallelMark->workers[(worker->idx + idx) % workerNum];
+        ObjHeader* obj = grayDequeSteal(&victim->deque);
+        if (obj != NULL) {
+            return obj;
+        }
+        idx++;
+    }
+    return NULL;
+}
+
+// 是否还有线程的队列中有灰色对象
+static bool hasGray(ParallelMark* parallelMark) {
+    uint32_t workerNum = __atomic_load_n(&parallelMark->workerNum, __ATOMIC_ACQUIRE);
+    uint32_t idx = 0;
+    while (idx < workerNum) {
+        if (!grayDequeIsEmpty(&parallelMark->workers[idx].deque)) {
+            return true;
+        }
+        idx++;
+    }
+    return false;
+}
+
+// 标记线程的主循环:先处理自己队列中的对象,空了就去窃取,
+// 所有线程都空闲时说明灰色对象已全部标黑
+static void* runMarkWorker(void* arg) {
+    MarkWorker* worker = (MarkWorker*)arg;
+    ParallelMark* parallelMark = worker->parallelMark;
+    curWorker = worker;
+    while (true) {
+        ObjHeader* obj = grayDequeTake(&worker->deque);
+        if (obj == NULL) {
+            obj = stealGray(worker);
+        }
+        if (obj != NULL) {
+            blackObject(worker->vm, obj);
+            continue;
+        }
+        // 空闲的线程不持有灰色对象,只有正在标黑的线程会产生新的灰色对象
+        __atomic_fetch_add(&parallelMark->idleNum, 1, __ATOMIC_SEQ_CST);
+        while (true) {
+            if (__atomic_load_n(&parallelMark->idleNum, __ATOMIC_SEQ_CST) ==
+                    __atomic_load_n(&parallelMark->workerNum, __ATOMIC_SEQ_CST)) {
+                curWorker = NULL;
+                return NULL;
+            }
+            if (hasGray(parallelMark)) {
+                __atomic_fetch_sub(&parallelMark->idleNum, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+// 由config.markThreads个线程并行标黑vm->grays中的对象及其引用的所有对象
+// 当前线程作为0号线程参与标记,程序在此期间暂停,因此不需要写屏障和重新扫描线程
+static void parallelBlackObjectInGray(VM* vm) {
+    ParallelMark parallelMark;
+    uint32_t threadNum = vm->config.markThreads;
+    if (threadNum > GC_MARK_THREADS) {
+        threadNum = GC_MARK_THREADS;
+    }
+    // 0号线程启动前其它线程不会认为标记已结束
+    parallelMark.workerNum = threadNum;
+    parallelMark.idleNum = 0;
+    uint32_t idx = 0;
+    while (idx < threadNum) {
+        MarkWorker* worker = &parallelMark.workers[idx];
+        worker->vm = vm;
+        worker->parallelMark = &parallelMark;
+        worker->idx = idx;
+        worker->markedBytes = 0;
+        memset(worker->markedBytesByType, 0, sizeof(worker->markedBytesByType));
+        memset(worker->markedObjectsByType, 0, sizeof(worker->markedObjectsByType));
+        grayDequeInit(&worker->deque, 1024);
+        idx++;
+    }
+    // 根对象都放入0号线程的队列,其它线程从中窃取
+    while (vm->grays.count > 0) {
+        grayDequePush(&parallelMark.workers[0].deque, vm->grays.grayObjects[--vm->grays.count]);
+    }
+
+    pthread_t threads[GC_MARK_THREADS];
+    uint32_t startedNum = 1;
+    while (startedNum < threadNum) {
+        if (pthread_create(&threads[startedNum], NULL, runMarkWorker, &parallelMark.workers[startedNum]) != 0) {
+            break;
+        }
+        startedNum++;
+    }
+    // 创建线程失败时由已启动的线程完成标记
+    __atomic_store_n(&parallelMark.workerNum, startedNum, __ATOMIC_SEQ_CST);
+    runMarkWorker(&parallelMark.workers[0]);
+
+    idx = 1;
+    while (idx < startedNum) {
+        pthread_join(threads[idx], NULL);
+        idx++;
+    }
+    idx = 0;
+    while (idx < threadNum) {
+        MarkWorker* worker = &parallelMark.workers[idx];
+        vm->markedBytes += worker->markedBytes;
+        uint32_t type = 0;
+        while (type < OBJ_TYPE_NUM) {
+            vm->markedBytesByType[type] += worker->markedBytesByType[type];
+            vm->markedObjectsByType[type] += worker->markedObjectsByType[type];
+            type++;
+        }
+        grayDequeFree(&worker->deque);
+        idx++;
+    }
+}
+#endif
+
+// 新建的对象链入allObjects,分代回收模式下链入youngObjects
+// 标记阶段新建的对象直接标灰,使其在本轮回收中存活
+void gcNewObject(VM* vm, ObjHeader* obj) {
+#if GC_GENERATIONAL
+    OBJ_SET_NEXT(obj, vm->youngObjects);
+    vm->youngObjects = obj;
+#else
+    OBJ_SET_NEXT(obj, vm->allObjects);
+    vm->allObjects = obj;
+#endif
+    vm->memStats.objectsByType[OBJ_TYPE(obj)]++;
+    if (vm->gcPhase == GC_PHASE_MARK) {
+        grayObject(vm, obj);
+    }
+}
+
 // 释放obj自身及其占用的内存
 void freeObject(VM* vm, ObjHeader* obj) {
 #ifdef DEBUG
@@ -234,9 +484,12 @@ void freeObject(VM* vm, ObjHeader* obj) {
     dumpValue(OBJ_TO_VALUE(obj));
     printf(" @ %p\n", obj);
 #endif
-    switch (obj->type) {
+    vm->memStats.objectsByType[OBJ_TYPE(obj)]--;
+    switch (OBJ_TYPE(obj)) {
         case OT_CLASS:
-            MethodBufferClear(vm, &((Class*)obj)->methods);
+            methodTableClear(vm, &((Class*)obj)->methods);
+            // 类的地址可能被新对象复用,作废缓存了该类的内联缓存
+            vm->methodEpoch++;
             break;
         case OT_THREAD: {
             ObjThread* objThread = (ObjThread*)obj;
@@ -248,6 +501,11 @@ void freeObject(VM* vm, ObjHeader* obj) {
             ObjFn* fn = (ObjFn*)obj;
             ValueBufferClear(vm, &fn->constants);
             ByteBufferClear(vm, &fn->instrStream);
+            DEALLOCATE_ARRAY(vm, fn->inlineCaches, fn->inlineCacheNum);
+        #if JIT
+            // 机器码在vm的代码区中,随vm一起释放
+            free(fn->jitEntries);
+        #endif
         #if DEBUG
             IntBufferClear(vm, &fn->debug->lineNo);
             DEALLOCATE(vm, fn->debug->fnName);
@@ -262,10 +520,12 @@ void freeObject(VM* vm, ObjHeader* obj) {
             DEALLOCATE(vm, ((ObjMap*)obj)->entries);
             break;
         case OT_MODULE:
-            StringBufferClear(vm, &((ObjModule*)obj)->moduleVarName);
+            symbolTableClear(vm, &((ObjModule*)obj)->moduleVarName);
             ValueBufferClear(vm, &((ObjModule*)obj)->moduleVarValue);
             break;
         case OT_STRING:
+            stringTableRemove(&vm->stringTable, (ObjString*)obj);
+            break;
         case OT_RANGE:
         case OT_CLOSURE:
         case OT_INSTANCE:
@@ -275,13 +535,8 @@ void freeObject(VM* vm, ObjHeader* obj) {
     DEALLOCATE(vm, obj);
 }
 
-void startGC(VM* vm) {
-#ifdef DEBUG
-    double startTime = (double)clock() / CLOCKS_PER_SEC;
-    uint32_t before = vm->allocatedBytes;
-    printf("-- gc before:%d  nextGC:%d vm:%p  --\n", before, vm->config.nextGC, vm);
-#endif
-    vm->allocatedBytes = 0;
+// 标灰根对象
+static void grayRoots(VM* vm) {
     grayObject(vm, (ObjHeader*)vm->allModules);
 
     uint32_t idx = 0;
@@ -297,31 +552,309 @@ void startGC(VM* vm) {
         ASSERT(vm->curParser->curCompileUnit != NULL, "grayCompileUint only be called while compiling!");
         grayCompileUnit(vm, vm->curParser->curCompileUnit);
     }
+}
 
+// 开始新一轮回收:标灰根对象,进入标记阶段
+static void beginMark(VM* vm) {
+    // 存活对象的大小在标黑时重新累计,标记期间allocatedBytes仍照常累计新的分配
+    vm->markedBytes = 0;
+    vm->gcStepDebt = 0;
+    vm->gcPhase = GC_PHASE_MARK;
+    memset(vm->markedBytesByType, 0, sizeof(vm->markedBytesByType));
+    memset(vm->markedObjectsByType, 0, sizeof(vm->markedObjectsByType));
+    // 上一轮的标记结果已经用完,slab中的对象一次清除整页的位图即可
+    slabClearMarks(&vm->slab);
+    grayRoots(vm);
+}
+
+// 结束标记阶段
+// 运行时栈和根对象没有写屏障,需重新扫描后一次性标黑剩余的灰色对象,之后进入清扫阶段
+static void finishMark(VM* vm) {
+    grayRoots(vm);
+    uint32_t idx = 0;
+    while (idx < vm->grayAgainThreads.count) {
+        grayThreadReferences(vm, (ObjThread*)vm->grayAgainThreads.grayObjects[idx]);
+        idx++;
+    }
     blackObjectInGray(vm);
-    // 回收白色对象
-    ObjHeader** obj = &vm->allObjects;
-    while (*obj != NULL) {
-        if (!((*obj)->isDark)) {
-            ObjHeader* unreached = *obj;
-            *obj = unreached->next;
-            freeObject(vm, unreached);
+    vm->grayAgainThreads.count = 0;
+    // 驻留表是弱引用,未标记的字符串即将被回收
+    stringTableRemoveWhite(&vm->stringTable);
+
+    // 此时markedBytes即存活对象的大小,据此确定下一轮回收的时机.
+    // 标记期间新建的对象已被标灰,标黑时计入了markedBytes,其分配时计入allocatedBytes的部分不再保留
+    vm->allocatedBytes = vm->markedBytes;
+    // 乘积超出uint64_t时转换是未定义行为,取饱和值
+    double nextGC = (double)vm->allocatedBytes * vm->config.heapGrowthFactor;
+    vm->config.nextGC = nextGC >= (double)UINT64_MAX ? UINT64_MAX : (uint64_t)nextGC;
+    if (vm->config.nextGC < vm->config.minHeapSize) {
+        vm->config.nextGC = vm->config.minHeapSize;
+    }
+    vm->memStats.liveBytes = vm->allocatedBytes;
+    memcpy(vm->memStats.liveBytesByType, vm->markedBytesByType, sizeof(vm->markedBytesByType));
+    memcpy(vm->memStats.liveObjectsByType, vm->markedObjectsByType, sizeof(vm->markedObjectsByType));
+    vm->memStats.gcCount++;
+
+    // 已分配的对象都转入sweepList等待清扫
+    vm->sweepList = vm->allObjects;
+    vm->allObjects = NULL;
+#if GC_GENERATIONAL
+    // 新生代对象一并清扫,存活的全部晋升,因此记忆集可以清空
+    if (vm->youngObjects != NULL) {
+        ObjHeader* tail = vm->youngObjects;
+        while (OBJ_NEXT(tail) != NULL) {
+            tail = OBJ_NEXT(tail);
+        }
+        OBJ_SET_NEXT(tail, vm->sweepList);
+        vm->sweepList = vm->youngObjects;
+        vm->youngObjects = NULL;
+    }
+    vm->youngBytes = 0;
+    clearRememberedSet(vm);
+    // 老年代线程在清扫时重新收集
+    vm->oldThreads.count = 0;
+#endif
+    vm->gcPhase = GC_PHASE_SWEEP;
+}
+
+// 清扫sweepList中最多count个对象,全部清扫完返回true
+// 存活的对象原地留在链表中,从sweptObjects到sweptTail,清扫完后整段接回allObjects.
+// slab中对象的标记位在页的位图中,因此清扫只读存活对象的next,
+// 仅当其后紧接着的对象被回收时才改写它的next
+static bool sweep(VM* vm, uint32_t count) {
+    while (vm->sweepList != NULL && count > 0) {
+        ObjHeader* obj = vm->sweepList;
+        vm->sweepList = OBJ_NEXT(obj);
+        if (OBJ_IS_DARK(obj)) {
+            // 不在slab中的对象为下一次gc重新判定,恢复为未标记状态
+            // slab中的对象在下一轮标记开始时整页清除
+            if (!OBJ_HAS_FLAG(obj, OBJ_FLAG_IN_SLAB)) {
+                OBJ_CLEAR_FLAG(obj, OBJ_FLAG_DARK);
+            }
+            if (vm->sweptTail == NULL) {
+                vm->sweptObjects = obj;
+            } else if (OBJ_NEXT(vm->sweptTail) != obj) {
+                OBJ_SET_NEXT(vm->sweptTail, obj);
+            }
+            vm->sweptTail = obj;
+#if GC_GENERATIONAL
+            // 存活的对象晋升到老年代
+            if (!OBJ_HAS_FLAG(obj, OBJ_FLAG_OLD)) {
+                OBJ_SET_FLAG(obj, OBJ_FLAG_OLD);
+                // 增量清扫期间,尚未清扫的新生代对象可能已存入新对象而未被写屏障记录
+                if (!vm->isMinorGC) {
+                    rememberObject(vm, obj);
+                }
+            }
+            if (OBJ_TYPE(obj) == OT_THREAD) {
+                pushGray(&vm->oldThreads, obj);
+            }
+#endif
         } else {
-            // 为下一次gc重新判定,恢复为未标记状态
-            (*obj)->isDark = false;
-            obj = &(*obj)->next;
+            // 回收白色对象,白色对象未计入allocatedBytes,释放时不再扣减
+            uint64_t allocatedBytes = vm->allocatedBytes;
+            freeObject(vm, obj);
+            vm->allocatedBytes = allocatedBytes;
         }
+        count--;
     }
-    vm->config.nextGC = vm->allocatedBytes * vm->config.heapGrowthFactor;
-    if (vm->config.nextGC < vm->config.minHeapSize) {
-        vm->config.nextGC = vm->config.minHeapSize;
+    if (vm->sweptTail != NULL) {
+        if (vm->sweepList == NULL) {
+            // 清扫期间新建的对象在allObjects中,接在存活对象之后
+            OBJ_SET_NEXT(vm->sweptTail, vm->allObjects);
+            vm->allObjects = vm->sweptObjects;
+            vm->sweptObjects = vm->sweptTail = NULL;
+        } else if (OBJ_NEXT(vm->sweptTail) != vm->sweepList) {
+            // 保持存活对象与尚未清扫的对象相连,释放vm时可以从sweptObjects一路遍历
+            OBJ_SET_NEXT(vm->sweptTail, vm->sweepList);
+        }
+    }
+    return vm->sweepList == NULL;
+}
+
+// 结束本轮回收
+static void finishSweep(VM* vm) {
+    vm->gcPhase = GC_PHASE_IDLE;
+}
+
+#if GC_GENERATIONAL
+// 新生代回收:只标记和清扫新生代对象,存活的对象晋升到老年代
+// 老年代对新生代的引用只来自记忆集中的对象和老年代线程的运行时栈
+static void minorGC(VM* vm) {
+    uint64_t allocatedBytes = vm->allocatedBytes;
+    vm->isMinorGC = true;
+    grayRoots(vm);
+    uint32_t idx = 0;
+    while (idx < vm->rememberedSet.count) {
+        blackObject(vm, vm->rememberedSet.grayObjects[idx]);
+        idx++;
+    }
+    clearRememberedSet(vm);
+    idx = 0;
+    while (idx < vm->oldThreads.count) {
+        grayThreadReferences(vm, (ObjThread*)vm->oldThreads.grayObjects[idx]);
+        idx++;
+    }
+
+    // 标黑时累计的即是存活的新生代对象的大小
+    vm->markedBytes = 0;
+    blackObjectInGray(vm);
+    uint64_t survivedBytes = vm->markedBytes;
+    vm->grayAgainThreads.count = 0;
+
+    vm->sweepList = vm->youngObjects;
+    vm->youngObjects = NULL;
+    sweep(vm, UINT32_MAX);
+    vm->isMinorGC = false;
+
+    // 临时根对象通常正在初始化,刚晋升后随即会存入新对象而不经过写屏障,
+    // 先记入记忆集
+    idx = 0;
+    while (idx < vm->tmpRootNum) {
+        ObjHeader* obj = vm->tmpRoots[idx];
+        if (OBJ_HAS_FLAG(obj, OBJ_FLAG_OLD) && !OBJ_HAS_FLAG(obj, OBJ_FLAG_REMEMBERED)) {
+            rememberObject(vm, obj);
+        }
+        idx++;
+    }
+
+    // 新生代中只有存活的部分计入堆大小
+    // 老年代对象在此期间扩容的内存也被扣除了,由下一次完整回收重新统计
+    allocatedBytes = allocatedBytes > vm->youngBytes ? allocatedBytes - vm->youngBytes : 0;
+    vm->allocatedBytes = allocatedBytes + survivedBytes;
+    vm->youngBytes = 0;
+    vm->memStats.minorGCCount++;
+}
+#endif
+
+#if !GC_STRESS || GC_GENERATIONAL
+// 执行一个回收片段,每个片段的工作量有上限,以限制每次暂停的时间
+static void gcStep(VM* vm) {
+    if (vm->gcPhase == GC_PHASE_MARK) {
+        // 标黑对象时会把对象大小累加到markedBytes,以此计量标记的工作量
+        uint64_t markedBytes = vm->markedBytes;
+        while (vm->grays.count > 0 && vm->markedBytes - markedBytes < GC_MARK_STEP_BYTES) {
+            ObjHeader* objHeader = vm->grays.grayObjects[--vm->grays.count];
+            blackObject(vm, objHeader);
+        }
+        if (vm->grays.count == 0) {
+            finishMark(vm);
+        }
+    } else if (vm->gcPhase == GC_PHASE_SWEEP) {
+        if (sweep(vm, GC_SWEEP_STEP_OBJECTS)) {
+            finishSweep(vm);
+        }
+    }
+}
+#endif
+
+// 单调时钟的纳秒数,用于统计暂停时间
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 记录一次从startNs开始的暂停
+static void recordPause(VM* vm, uint64_t startNs) {
+    uint64_t pauseNs = nowNs() - startNs;
+    vm->memStats.totalPauseNs += pauseNs;
+    if (pauseNs > vm->memStats.maxPauseNs) {
+        vm->memStats.maxPauseNs = pauseNs;
+    }
+}
+
+// 由memManager在申请bytes字节的内存前调用,驱动自动回收
+void gcAllocationStep(VM* vm, uint32_t bytes) {
+#if GC_STRESS && !GC_GENERATIONAL
+    (void)bytes;
+    startGC(vm);
+#else
+#if GC_GENERATIONAL
+    vm->youngBytes += bytes;
+#endif
+    uint64_t startNs;
+    if (vm->gcPhase == GC_PHASE_IDLE) {
+        if (vm->allocatedBytes > vm->config.nextGC) {
+            startNs = nowNs();
+            beginMark(vm);
+            recordPause(vm, startNs);
+            return;
+        }
+#if GC_GENERATIONAL
+        if (GC_STRESS || vm->youngBytes >= GC_NURSERY_SIZE) {
+            startNs = nowNs();
+            minorGC(vm);
+            recordPause(vm, startNs);
+        }
+#endif
+        return;
+    }
+    vm->gcStepDebt += bytes;
+    if (vm->gcStepDebt >= GC_STEP_SIZE) {
+        vm->gcStepDebt = 0;
+        startNs = nowNs();
+        gcStep(vm);
+        recordPause(vm, startNs);
     }
+#endif
+}
+
+// 清扫一个片段,全部清扫完时结束本轮回收
+// slab在申请新页之前调用,先回收未清扫的垃圾对象占用的槽位
+void gcSweepStep(VM* vm) {
+    if (vm->gcPhase != GC_PHASE_SWEEP) {
+        return;
+    }
+    uint64_t startNs = nowNs();
+    if (sweep(vm, GC_SWEEP_STEP_OBJECTS)) {
+        finishSweep(vm);
+    }
+    recordPause(vm, startNs);
+}
+
+// 完成正在进行的增量回收
+void finishGC(VM* vm) {
+    if (vm->gcPhase == GC_PHASE_MARK) {
+        finishMark(vm);
+    }
+    if (vm->gcPhase == GC_PHASE_SWEEP) {
+        sweep(vm, UINT32_MAX);
+        finishSweep(vm);
+    }
+}
+
+// 立即执行一次完整的回收
+// 程序暂停期间只完成标记,清扫留到之后的分配中逐步进行
+void startGC(VM* vm) {
+    uint64_t startNs = nowNs();
 #ifdef DEBUG
-    double elapsed = ((double)clock() / CLOCKS_PER_SEC) - startTime;
-    printf("GC %lu before %lu after (%lu collected), next at %lu. take %.3fs.\n",
-        (unsigned long)before,
-        (unsigned long)vm->allocatedBytes,
-        (unsigned long)(before - vm->allocatedBytes),
-        (unsigned long)vm->config.nextGC,elapsed);
+    uint64_t before = vm->allocatedBytes;
+    printf("-- gc before:%llu  nextGC:%llu vm:%p  --\n",
+        (unsigned long long)before, (unsigned long long)vm->config.nextGC, vm);
+#endif
+    // 进行中的增量回收的标记结果可能已过时,先将其完成
+    finishGC(vm);
+    beginMark(vm);
+#if GC_MARK_THREADS > 1
+    if (vm->config.markThreads > 1) {
+        parallelBlackObjectInGray(vm);
+    }
 #endif
+    finishMark(vm);
+    recordPause(vm, startNs);
+#ifdef DEBUG
+    printf("GC %llu before %llu after (%llu unreachable), next at %llu. mark take %.3fs.\n",
+        (unsigned long long)before,
+        (unsigned long long)vm->allocatedBytes,
+        (unsigned long long)(before > vm->allocatedBytes ? before - vm->allocatedBytes : 0),
+        (unsigned long long)vm->config.nextGC, (nowNs() - startNs) / 1e9);
+#endif
+}
+
+// 把当前的内存统计填入stats
+void gcMemoryStats(VM* vm, MemoryStats* stats) {
+    *stats = vm->memStats;
+    stats->heapBytes = vm->allocatedBytes;
+    stats->nextGC = vm->config.nextGC;
 }
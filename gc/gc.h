@@ -1,8 +1,80 @@
 #ifndef _GC_GC_H
 #define _GC_GC_H
 #include "vm.h"
+
+// 自动回收是增量进行的:
+// 已分配内存超过config.nextGC时开始新一轮回收,
+// 之后每分配GC_STEP_SIZE字节执行一个回收片段,交替进行标记和程序执行
+#ifndef GC_STEP_SIZE
+    #define GC_STEP_SIZE (64 * 1024)
+#endif
+// 每个标记片段最多标黑的对象字节数,须大于GC_STEP_SIZE以保证标记快于分配
+#ifndef GC_MARK_STEP_BYTES
+    #define GC_MARK_STEP_BYTES (GC_STEP_SIZE * 4)
+#endif
+// 每个清扫片段最多清扫的对象数
+#ifndef GC_SWEEP_STEP_OBJECTS
+    #define GC_SWEEP_STEP_OBJECTS 4096
+#endif
+// 编译时指定-DGC_GENERATIONAL=1启用分代回收:
+// 新对象链入新生代,新生代每分配GC_NURSERY_SIZE字节做一次只扫描新生代的回收,
+// 存活的对象晋升到老年代,老年代仍由上面的增量回收处理
+#ifndef GC_GENERATIONAL
+    #define GC_GENERATIONAL 0
+#endif
+#ifndef GC_NURSERY_SIZE
+    #define GC_NURSERY_SIZE (256 * 1024)
+#endif
+// 编译时指定-DGC_MARK_THREADS=n(n>1)启用并行标记,需要pthread:
+// startGC中由vm->config.markThreads个线程(默认n个,含当前线程)共同标黑所有对象,
+// 每个线程有自己的灰色对象队列,空闲时从其它线程的队列中窃取
+#ifndef GC_MARK_THREADS
+    #define GC_MARK_THREADS 1
+#endif
+// 编译时指定-DGC_STRESS=1则每次申请内存都做一次完整的回收,用于检查根对象是否遗漏
+// 分代回收模式下则是每次申请内存都做一次新生代回收,用于检查写屏障是否遗漏
+#ifndef GC_STRESS
+    #define GC_STRESS 0
+#endif
+
+// 对象是否已标记,slab中对象的标记位在所在页的位图中,其余对象的在对象头中
+#define OBJ_IS_DARK(obj) (OBJ_HAS_FLAG(obj, OBJ_FLAG_IN_SLAB) ?\
+    SLAB_IS_MARKED(obj) != 0 : OBJ_HAS_FLAG(obj, OBJ_FLAG_DARK))
+
+#if GC_GENERATIONAL
+// 写屏障:标记阶段向对象obj中存入value时将value标灰,
+// 保证已标黑的对象不会引用白色对象;
+// 老年代对象obj引用新生代对象时将obj记入记忆集
+#define GC_WRITE_BARRIER(vmPtr, objPtr, value)\
+    do {\
+        if ((vmPtr)->gcPhase == GC_PHASE_MARK) {\
+            grayValue(vmPtr, value);\
+        }\
+        if (OBJ_HAS_FLAG((ObjHeader*)(objPtr), OBJ_FLAG_OLD) &&\
+            !OBJ_HAS_FLAG((ObjHeader*)(objPtr), OBJ_FLAG_REMEMBERED) &&\
+            VALUE_IS_OBJ(value) && !OBJ_HAS_FLAG(VALUE_TO_OBJ(value), OBJ_FLAG_OLD)) {\
+            rememberObject(vmPtr, (ObjHeader*)(objPtr));\
+        }\
+    } while (0)
+#else
+// 写屏障:标记阶段向对象obj中存入value时将value标灰,
+// 保证已标黑的对象不会引用白色对象
+#define GC_WRITE_BARRIER(vmPtr, objPtr, value)\
+    do {\
+        if ((vmPtr)->gcPhase == GC_PHASE_MARK) {\
+            grayValue(vmPtr, value);\
+        }\
+    } while (0)
+#endif
+
 void startGC(VM* vm);
+void finishGC(VM* vm);
+void gcSweepStep(VM* vm);
+void gcMemoryStats(VM* vm, MemoryStats* stats);
+void gcAllocationStep(VM* vm, uint32_t bytes);
+void gcNewObject(VM* vm, ObjHeader* obj);
 void grayObject(VM* vm, ObjHeader* obj);
+void rememberObject(VM* vm, ObjHeader* obj);
 void freeObject(VM* vm, ObjHeader* obj);
 void grayValue(VM* vm, Value value);
-#endif
\ No newline at end of file
+#endif
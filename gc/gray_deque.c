@@ -0,0 +1,101 @@
+#include "gray_deque.h"
+
+// 内存序参照Lê等人给出的C11版本的Chase-Lev队列
+
+static GrayArray* newGrayArray(int64_t capacity) {
+    GrayArray* array = (GrayArray*)malloc(sizeof(GrayArray) + sizeof(ObjHeader*) * capacity);
+    if (array == NULL) {
+        MEM_ERROR("allocate gray deque failed!");
+    }
+    array->capacity = capacity;
+    array->prev = NULL;
+    return array;
+}
+
+#define ARRAY_GET(array, idx) __atomic_load_n(&(array)->objs[(idx) & ((array)->capacity - 1)], __ATOMIC_RELAXED)
+#define ARRAY_SET(array, idx, obj) __atomic_store_n(&(array)->objs[(idx) & ((array)->capacity - 1)], obj, __ATOMIC_RELAXED)
+
+void grayDequeInit(GrayDeque* deque, int64_t capacity) {
+    deque->top = deque->bottom = 0;
+    deque->array = newGrayArray(capacity);
+}
+
+// 释放队列,须在所有线程都不再访问后调用
+void grayDequeFree(GrayDeque* deque) {
+    GrayArray* array = deque->array;
+    while (array != NULL) {
+        GrayArray* prev = array->prev;
+        free(array);
+        array = prev;
+    }
+    deque->array = NULL;
+}
+
+// 由所属线程调用,把obj压入bottom端
+void grayDequePush(GrayDeque* deque, ObjHeader* obj) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    GrayArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    if (bottom - top > array->capacity - 1) {
+        // 已满,扩容为原来的两倍,旧数组留给可能正在窃取的线程
+        GrayArray* newArray = newGrayArray(array->capacity * 2);
+        int64_t idx = top;
+        while (idx < bottom) {
+            ARRAY_SET(newArray, idx, ARRAY_GET(array, idx));
+            idx++;
+        }
+        newArray->prev = array;
+        __atomic_store_n(&deque->array, newArray, __ATOMIC_RELEASE);
+        array = newArray;
+    }
+    ARRAY_SET(array, bottom, obj);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// 由所属线程调用,从bottom端弹出,队列为空时返回NULL
+ObjHeader* grayDequeTake(GrayDeque* deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    GrayArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    ObjHeader* obj = ARRAY_GET(array, bottom);
+    if (top == bottom) {
+        // 只剩最后一个,与窃取者竞争
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            obj = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return obj;
+}
+
+// 由其它线程调用,从top端窃取,队列为空或与其它线程竞争失败时返回NULL
+ObjHeader* grayDequeSteal(GrayDeque* deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+    GrayArray* array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    ObjHeader* obj = ARRAY_GET(array, top);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return obj;
+}
+
+// 队列中是否还有对象,供空闲的线程判断是否需要继续窃取
+bool grayDequeIsEmpty(GrayDeque* deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    return top >= bottom;
+}
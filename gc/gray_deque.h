@@ -0,0 +1,25 @@
+#ifndef _GC_GRAY_DEQUE_H
+#define _GC_GRAY_DEQUE_H
+#include "header_obj.h"
+
+// 并行标记用的灰色对象双端队列(Chase-Lev):
+// 所属线程在bottom端压入和弹出,其它线程在top端窃取
+typedef struct grayArray {
+    int64_t capacity; // 2的幂
+    struct grayArray* prev; // 扩容前的数组,窃取者可能仍在读取,队列销毁时才释放
+    ObjHeader* objs[];
+} GrayArray;
+
+typedef struct {
+    int64_t top;
+    int64_t bottom;
+    GrayArray* array;
+} GrayDeque;
+
+void grayDequeInit(GrayDeque* deque, int64_t capacity);
+void grayDequeFree(GrayDeque* deque);
+void grayDequePush(GrayDeque* deque, ObjHeader* obj);
+ObjHeader* grayDequeTake(GrayDeque* deque);
+ObjHeader* grayDequeSteal(GrayDeque* deque);
+bool grayDequeIsEmpty(GrayDeque* deque);
+#endif
@@ -0,0 +1,177 @@
+#include "slab.h"
+#include <string.h>
+#include "vm.h"
+#include "gc.h"
+#include "utils.h"
+
+// 页地址的散列值,页按SLAB_PAGE_SIZE对齐,低位都是0
+static uint32_t hashPage(const SlabPage* page) {
+    uint64_t key = (uint64_t)(uintptr_t)page / SLAB_PAGE_SIZE;
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+#if SLAB_ALLOCATOR
+// 以下只在slab申请新页时用到
+static void pageSetInsert(SlabPage** slots, uint32_t capacity, SlabPage* page) {
+    uint32_t idx = hashPage(page) & (capacity - 1);
+    while (slots[idx] != NULL) {
+        idx = (idx + 1) & (capacity - 1);
+    }
+    slots[idx] = page;
+}
+
+// 把page登记到pageSet中,负载超过一半时扩容
+static void pageSetAdd(SlabAllocator* slab, SlabPage* page) {
+    if ((slab->pageNum + 1) * 2 > slab->pageSetCapacity) {
+        uint32_t newCapacity = slab->pageSetCapacity == 0 ? 16 : slab->pageSetCapacity * 2;
+        SlabPage** newSlots = (SlabPage**)calloc(newCapacity, sizeof(SlabPage*));
+        if (newSlots == NULL) {
+            MEM_ERROR("allocate slab page set failed!");
+        }
+        uint32_t idx = 0;
+        while (idx < slab->pageSetCapacity) {
+            if (slab->pageSet[idx] != NULL) {
+                pageSetInsert(newSlots, newCapacity, slab->pageSet[idx]);
+            }
+            idx++;
+        }
+        free(slab->pageSet);
+        slab->pageSet = newSlots;
+        slab->pageSetCapacity = newCapacity;
+    }
+    pageSetInsert(slab->pageSet, slab->pageSetCapacity, page);
+    slab->pageNum++;
+}
+#endif
+
+// 返回ptr所在的页,ptr不属于slab时返回NULL
+static SlabPage* findPage(SlabAllocator* slab, void* ptr) {
+    if (slab->pageNum == 0) {
+        return NULL;
+    }
+    SlabPage* page = (SlabPage*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    uint32_t idx = hashPage(page) & (slab->pageSetCapacity - 1);
+    while (slab->pageSet[idx] != NULL) {
+        if (slab->pageSet[idx] == page) {
+            return page;
+        }
+        idx = (idx + 1) & (slab->pageSetCapacity - 1);
+    }
+    return NULL;
+}
+
+void slabInit(SlabAllocator* slab) {
+    uint32_t idx = 0;
+    while (idx < SLAB_CLASS_NUM) {
+        SlabClass* slabClass = &slab->classes[idx];
+        slabClass->slotSize = (idx + 1) * SLAB_GRANULE;
+        slabClass->freeList = NULL;
+        slabClass->bumpPtr = slabClass->bumpEnd = NULL;
+        slabClass->pages = NULL;
+        slabClass->pageNum = 0;
+        slabClass->usedSlots = 0;
+        idx++;
+    }
+    slab->pageSet = NULL;
+    slab->pageSetCapacity = 0;
+    slab->pageNum = 0;
+    slab->lastSlot = NULL;
+}
+
+// 释放所有页,页中的对象须已全部释放
+void slabClear(SlabAllocator* slab) {
+    uint32_t idx = 0;
+    while (idx < SLAB_CLASS_NUM) {
+        SlabPage* page = slab->classes[idx].pages;
+        while (page != NULL) {
+            SlabPage* next = page->next;
+            free(page);
+            page = next;
+        }
+        idx++;
+    }
+    free(slab->pageSet);
+    slabInit(slab);
+}
+
+#if SLAB_ALLOCATOR
+// 为slabClass申请新页,之后的槽位从新页中顺序切分
+static void slabNewPage(SlabAllocator* slab, uint32_t classIdx) {
+    SlabPage* page = (SlabPage*)aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL) {
+        MEM_ERROR("allocate slab page failed!");
+    }
+    SlabClass* slabClass = &slab->classes[classIdx];
+    page->classIdx = classIdx;
+    memset(page->markBits, 0, sizeof(page->markBits));
+    page->next = slabClass->pages;
+    slabClass->pages = page;
+    slabClass->pageNum++;
+    slabClass->bumpPtr = (char*)page + SLAB_PAGE_HEADER_SIZE;
+    slabClass->bumpEnd = slabClass->bumpPtr + SLAB_SLOTS_PER_PAGE(slabClass->slotSize) * slabClass->slotSize;
+    pageSetAdd(slab, page);
+}
+#endif
+
+// 申请size字节的对象内存,与memManager一样计入allocatedBytes并驱动自动回收
+void* slabAllocate(VM* vm, uint32_t size) {
+#if SLAB_ALLOCATOR
+    if (size > SLAB_MAX_SIZE) {
+        return memManager(vm, NULL, 0, size);
+    }
+    vm->allocatedBytes += size;
+    // 回收过程中释放的槽位可直接用于本次分配
+    gcAllocationStep(vm, size);
+
+    uint32_t classIdx = (size - 1) / SLAB_GRANULE;
+    SlabClass* slabClass = &vm->slab.classes[classIdx];
+    slabClass->usedSlots++;
+    // 当前页已用完时,若上一轮回收尚未清扫完,先清扫一个片段,
+    // 垃圾对象释放的槽位可能满足本次分配,不必申请新页
+    if (slabClass->freeList == NULL && slabClass->bumpPtr == slabClass->bumpEnd) {
+        gcSweepStep(vm);
+    }
+    SlabSlot* slot = slabClass->freeList;
+    if (slot != NULL) {
+        slabClass->freeList = slot->next;
+        vm->slab.lastSlot = slot;
+        return slot;
+    }
+    if (slabClass->bumpPtr == slabClass->bumpEnd) {
+        slabNewPage(&vm->slab, classIdx);
+    }
+    slot = (SlabSlot*)slabClass->bumpPtr;
+    slabClass->bumpPtr += slabClass->slotSize;
+    vm->slab.lastSlot = slot;
+    return slot;
+#else
+    return memManager(vm, NULL, 0, size);
+#endif
+}
+
+// ptr属于slab时将其归还到所属大小类的空闲链表并返回true,否则返回false
+bool slabFree(SlabAllocator* slab, void* ptr) {
+    SlabPage* page = findPage(slab, ptr);
+    if (page == NULL) {
+        return false;
+    }
+    SlabClass* slabClass = &slab->classes[page->classIdx];
+    SlabSlot* slot = (SlabSlot*)ptr;
+    slot->next = slabClass->freeList;
+    slabClass->freeList = slot;
+    slabClass->usedSlots--;
+    return true;
+}
+
+// 清除所有页的标记位图,在每轮完整回收的标记开始前调用
+void slabClearMarks(SlabAllocator* slab) {
+    uint32_t idx = 0;
+    while (idx < SLAB_CLASS_NUM) {
+        SlabPage* page = slab->classes[idx].pages;
+        while (page != NULL) {
+            memset(page->markBits, 0, sizeof(page->markBits));
+            page = page->next;
+        }
+        idx++;
+    }
+}
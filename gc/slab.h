@@ -0,0 +1,75 @@
+#ifndef _GC_SLAB_H
+#define _GC_SLAB_H
+#include "common.h"
+
+// 编译时指定-DSLAB_ALLOCATOR=0关闭slab分配器,所有对象都直接由malloc分配
+// 开启时ALLOCATE和ALLOCATE_EXTRA申请的小对象按大小类从每个vm自有的页中分配,
+// 释放的槽位挂到所属大小类的空闲链表上供复用
+#ifndef SLAB_ALLOCATOR
+    #define SLAB_ALLOCATOR 1
+#endif
+
+#define SLAB_PAGE_SIZE (16 * 1024) // 页的大小,页按此大小对齐
+#define SLAB_GRANULE 16 // 相邻大小类的间隔
+#define SLAB_MAX_SIZE 256 // 超过此大小的对象直接由malloc分配
+#define SLAB_CLASS_NUM (SLAB_MAX_SIZE / SLAB_GRANULE)
+
+typedef struct slabPage {
+    struct slabPage* next; // 同一大小类的页链表
+    uint32_t classIdx;
+    // 页中对象的标记位图,每SLAB_GRANULE字节对应一位,按对象在页内的偏移索引
+    // 回收时只读写位图,不必写回存活对象本身
+    uint64_t markBits[SLAB_PAGE_SIZE / SLAB_GRANULE / 64];
+} SlabPage; // 页头,位于每页的开头
+
+typedef struct slabSlot {
+    struct slabSlot* next;
+} SlabSlot;
+
+typedef struct {
+    uint32_t slotSize;
+    SlabSlot* freeList; // 已释放可复用的槽位
+    char* bumpPtr; // 最新一页中尚未用过的部分
+    char* bumpEnd;
+    SlabPage* pages;
+    uint32_t pageNum;
+    uint32_t usedSlots; // 正在使用的槽位数
+} SlabClass;
+
+typedef struct {
+    SlabClass classes[SLAB_CLASS_NUM];
+    // 所有页的地址,开放定址,容量为2的幂
+    // 释放内存时据此判断地址是否属于slab
+    SlabPage** pageSet;
+    uint32_t pageSetCapacity;
+    uint32_t pageNum;
+    // 最近一次分配的槽位,initObjHeader据此判断对象是否在slab中而无需查pageSet.
+    // 判断不出的slab对象会把标记位存放在对象头中,同样正确
+    void* lastSlot;
+} SlabAllocator;
+
+// 页头按SLAB_GRANULE对齐后的大小,槽位从其后开始
+#define SLAB_PAGE_HEADER_SIZE ((sizeof(SlabPage) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE)
+// 每页可容纳的槽位数
+#define SLAB_SLOTS_PER_PAGE(slotSize) ((SLAB_PAGE_SIZE - SLAB_PAGE_HEADER_SIZE) / (slotSize))
+
+// 标记位图的存取,ptr须是slab中的地址
+#define SLAB_PAGE_OF(ptr) ((SlabPage*)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+#define SLAB_MARK_INDEX(ptr) (((uintptr_t)(ptr) & (SLAB_PAGE_SIZE - 1)) / SLAB_GRANULE)
+#define SLAB_IS_MARKED(ptr)\
+    ((SLAB_PAGE_OF(ptr)->markBits[SLAB_MARK_INDEX(ptr) / 64] >> (SLAB_MARK_INDEX(ptr) % 64)) & 1)
+#define SLAB_SET_MARK(ptr)\
+    (SLAB_PAGE_OF(ptr)->markBits[SLAB_MARK_INDEX(ptr) / 64] |= (uint64_t)1 << (SLAB_MARK_INDEX(ptr) % 64))
+// 原子地置位标记位,返回置位前是否已标记,用于并行标记
+#define SLAB_TEST_AND_SET_MARK(ptr)\
+    ((__atomic_fetch_or(&SLAB_PAGE_OF(ptr)->markBits[SLAB_MARK_INDEX(ptr) / 64],\
+        (uint64_t)1 << (SLAB_MARK_INDEX(ptr) % 64), __ATOMIC_RELAXED) >> (SLAB_MARK_INDEX(ptr) % 64)) & 1)
+#define SLAB_CLEAR_MARK(ptr)\
+    (SLAB_PAGE_OF(ptr)->markBits[SLAB_MARK_INDEX(ptr) / 64] &= ~((uint64_t)1 << (SLAB_MARK_INDEX(ptr) % 64)))
+
+void slabInit(SlabAllocator* slab);
+void slabClear(SlabAllocator* slab);
+void* slabAllocate(VM* vm, uint32_t size);
+bool slabFree(SlabAllocator* slab, void* ptr);
+void slabClearMarks(SlabAllocator* slab);
+#endif
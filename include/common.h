@@ -13,6 +13,11 @@ typedef struct class Class;
 #define false 0
 #define UNUSED __attribute__ ((unused))
 
+// 编译时指定-DNAN_BOXING=1使用NaN-boxing的8字节值表示
+#ifndef NAN_BOXING
+    #define NAN_BOXING 0
+#endif
+
 #ifdef DEBUG
     #define ASSERT(condition, errMsg) \
     do {\
@@ -0,0 +1,376 @@
+#include "numConv.h"
+#include <string.h>
+#include <ctype.h>
+#include "common.h"
+#include "numConv.inc"
+
+#define MASK_63 0x7fffffffffffffffULL
+#define EXP_MASK 0x7ffULL
+#define C_MIN (1ULL << 52)  // 规格化数的最小有效数字
+#define Q_MIN -1074         // 非规格化数的二进制指数
+#define C_TINY 3            // 小于此值的非规格化有效数字需先乘10再求解
+
+// 两个64位无符号数相乘,返回128位积的高64位,低64位存入low
+static uint64_t mul128(uint64_t a, uint64_t b, uint64_t* low) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *low = (uint64_t)product;
+    return (uint64_t)(product >> 64);
+#else
+    uint64_t aLow = a & 0xffffffff, aHigh = a >> 32;
+    uint64_t bLow = b & 0xffffffff, bHigh = b >> 32;
+    uint64_t ll = aLow * bLow;
+    uint64_t lh = aLow * bHigh;
+    uint64_t hl = aHigh * bLow;
+    uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+    *low = (mid << 32) | (ll & 0xffffffff);
+    return aHigh * bHigh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+// floor(q * log10(2))
+static int32_t floorLog10Pow2(int32_t q) {
+    return (int32_t)(((int64_t)q * 661971961083LL) >> 41);
+}
+
+// floor(q * log10(2) + log10(3/4))
+static int32_t floorLog10ThreeQuartersPow2(int32_t q) {
+    return (int32_t)(((int64_t)q * 661971961083LL - 274743187321LL) >> 41);
+}
+
+// floor(e * log2(10))
+static int32_t floorLog2Pow10(int32_t e) {
+    return (int32_t)(((int64_t)e * 913124641741LL) >> 38);
+}
+
+// 计算g * cp / 2^127, 结果不精确时把最低位置1(向奇数舍入)
+static uint64_t roundToOdd(const uint64_t* g, uint64_t cp) {
+    // 把126位的g拆成两个63位的部分
+    uint64_t g1 = (g[0] << 1) | (g[1] >> 63);
+    uint64_t g0 = g[1] & MASK_63;
+    uint64_t discard;
+    uint64_t x1 = mul128(g0, cp, &discard);
+    uint64_t y0;
+    uint64_t y1 = mul128(g1, cp, &y0);
+    uint64_t z = (y0 >> 1) + x1;
+    uint64_t vbp = y1 + (z >> 63);
+    return vbp | (((z & MASK_63) + MASK_63) >> 63);
+}
+
+// Schubfach算法: 求c * 2^q舍入区间内最短的十进制数s * 10^exp10
+static uint64_t toDecimal(int32_t q, uint64_t c, int32_t dk, int32_t* exp10) {
+    uint64_t out = c & 1;  // c为奇数时区间不含端点
+    uint64_t cb = c << 2;
+    uint64_t cbr = cb + 2;
+    uint64_t cbl;
+    int32_t k;
+    if (c != C_MIN || q == Q_MIN) {
+        cbl = cb - 2;
+        k = floorLog10Pow2(q);
+    } else {
+        // 2的整数次幂下方的间距只有上方的一半
+        cbl = cb - 1;
+        k = floorLog10ThreeQuartersPow2(q);
+    }
+    int32_t h = q + floorLog2Pow10(-k) + 2;
+    const uint64_t* g = SCHUBFACH_POW10[-k - SCHUBFACH_POW10_MIN];
+    uint64_t vb = roundToOdd(g, cb << h);
+    uint64_t vbl = roundToOdd(g, cbl << h);
+    uint64_t vbr = roundToOdd(g, cbr << h);
+
+    uint64_t s = vb >> 2;
+    if (s >= 100) {
+        // 先尝试少一位有效数字
+        uint64_t sp10 = s / 10 * 10;
+        uint64_t tp10 = sp10 + 10;
+        bool upin = vbl + out <= sp10 << 2;
+        bool wpin = (tp10 << 2) + out <= vbr;
+        if (upin != wpin) {
+            *exp10 = k;
+            return upin ? sp10 : tp10;
+        }
+    }
+    uint64_t t = s + 1;
+    bool uin = vbl + out <= s << 2;
+    bool win = (t << 2) + out <= vbr;
+    *exp10 = k + dk;
+    if (uin != win) {
+        return uin ? s : t;
+    }
+    // s和t都在区间内时取离原值更近的,一样近时取偶数
+    int64_t cmp = (int64_t)(vb - ((s + t) << 1));
+    return cmp < 0 || (cmp == 0 && (s & 1) == 0) ? s : t;
+}
+
+// 把不含符号位的非零有限double的位模式转为最短的十进制表示s * 10^exp10
+static uint64_t shortestDecimal(uint64_t bits, int32_t* exp10) {
+    uint64_t t = bits & (C_MIN - 1);
+    int32_t bq = (int32_t)((bits >> 52) & EXP_MASK);
+    if (bq != 0) {
+        int32_t mq = -Q_MIN + 1 - bq;
+        uint64_t c = C_MIN | t;
+        // 小于2^53的整数直接得出
+        if (0 < mq && mq < 53) {
+            uint64_t f = c >> mq;
+            if (f << mq == c) {
+                *exp10 = 0;
+                return f;
+            }
+        }
+        return toDecimal(-mq, c, 0, exp10);
+    }
+    // 非规格化数
+    return t < C_TINY ? toDecimal(Q_MIN, 10 * t, -1, exp10) : toDecimal(Q_MIN, t, 0, exp10);
+}
+
+// 把num格式化为能原样读回的最短字符串,写入至少NUM_CHARS_MAX字节的buf,返回长度
+uint32_t num2Chars(double num, char* buf) {
+    char* p = buf;
+    if (num != num) {
+        memcpy(buf, "nan", 4);
+        return 3;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    if (bits >> 63) {
+        *p++ = '-';
+        bits &= MASK_63;
+    }
+    if (bits == EXP_MASK << 52) {
+        memcpy(p, "infinity", 9);
+        return (uint32_t)(p - buf) + 8;
+    }
+    if (bits == 0) {
+        *p++ = '0';
+        *p = '\0';
+        return (uint32_t)(p - buf);
+    }
+
+    int32_t exp10;
+    uint64_t s = shortestDecimal(bits, &exp10);
+    while (s % 10 == 0) {
+        s /= 10;
+        exp10++;
+    }
+
+    // 由低位到高位生成各位数字
+    char digits[20];
+    int32_t start = sizeof(digits);
+    while (s > 0) {
+        digits[--start] = '0' + s % 10;
+        s /= 10;
+    }
+    int32_t digitNum = sizeof(digits) - start;
+    // 科学计数法d.ddd * 10^sciExp中的指数
+    int32_t sciExp = digitNum + exp10 - 1;
+
+    if (sciExp >= NUM_FIXED_MIN_EXP && sciExp < NUM_FIXED_MAX_EXP) {
+        if (sciExp < 0) {
+            // 0.00ddd
+            *p++ = '0';
+            *p++ = '.';
+            int32_t zeros = -sciExp - 1;
+            while (zeros-- > 0) {
+                *p++ = '0';
+            }
+            memcpy(p, digits + start, digitNum);
+            p += digitNum;
+        } else if (digitNum <= sciExp + 1) {
+            // 整数ddd00
+            memcpy(p, digits + start, digitNum);
+            p += digitNum;
+            int32_t zeros = sciExp + 1 - digitNum;
+            while (zeros-- > 0) {
+                *p++ = '0';
+            }
+        } else {
+            // dd.ddd
+            memcpy(p, digits + start, sciExp + 1);
+            p += sciExp + 1;
+            *p++ = '.';
+            memcpy(p, digits + start + sciExp + 1, digitNum - sciExp - 1);
+            p += digitNum - sciExp - 1;
+        }
+        *p = '\0';
+        return (uint32_t)(p - buf);
+    }
+
+    // 与printf的%g一致: d.ddde+XX, 指数至少两位
+    *p++ = digits[start];
+    if (digitNum > 1) {
+        *p++ = '.';
+        memcpy(p, digits + start + 1, digitNum - 1);
+        p += digitNum - 1;
+    }
+    *p++ = 'e';
+    if (sciExp < 0) {
+        *p++ = '-';
+        sciExp = -sciExp;
+    } else {
+        *p++ = '+';
+    }
+    if (sciExp >= 100) {
+        *p++ = '0' + sciExp / 100;
+    }
+    *p++ = '0' + sciExp / 10 % 10;
+    *p++ = '0' + sciExp % 10;
+    *p = '\0';
+    return (uint32_t)(p - buf);
+}
+
+// 可用double精确运算的10的幂
+static const double EXACT_POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Eisel-Lemire算法: 把w * 10^q舍入为double,无法确定舍入方向时返回false
+static bool eiselLemire(uint64_t w, int64_t q, double* result) {
+    // w和10^q都能精确表示为double时一次乘除即是正确舍入的结果
+    if (w <= (1ULL << 53) && q >= -22 && q <= 22) {
+        *result = q < 0 ? (double)w / EXACT_POW10[-q] : (double)w * EXACT_POW10[q];
+        return true;
+    }
+    if (q < LEMIRE_POW5_MIN || q > LEMIRE_POW5_MAX) {
+        return false;
+    }
+
+    const uint64_t* pow5 = LEMIRE_POW5[q - LEMIRE_POW5_MIN];
+    // floor(q * log2(10)) + 1087
+    int64_t exponent = (((152170 + 65536) * q) >> 16) + 1024 + 63;
+    int32_t lz = __builtin_clzll(w);
+    w <<= lz;
+
+    uint64_t lower;
+    uint64_t upper = mul128(w, pow5[0], &lower);
+    // 截断的低位可能影响舍入时再用5^q的低64位修正
+    if ((upper & 0x1ff) == 0x1ff && lower + w < lower) {
+        uint64_t productLow;
+        uint64_t productMiddle2 = mul128(w, pow5[1], &productLow);
+        uint64_t productMiddle = lower + productMiddle2;
+        uint64_t productHigh = upper;
+        if (productMiddle < lower) {
+            productHigh++;
+        }
+        if (productMiddle + 1 == 0 && (productHigh & 0x1ff) == 0x1ff && productLow + w < productLow) {
+            return false;
+        }
+        upper = productHigh;
+        lower = productMiddle;
+    }
+
+    uint64_t upperBit = upper >> 63;
+    uint64_t mantissa = upper >> (upperBit + 9);
+    lz += (int32_t)(1 ^ upperBit);
+    // 恰在两个double正中间,需要更多位才能决定
+    if (lower == 0 && (upper & 0x1ff) == 0 && (mantissa & 3) == 1) {
+        return false;
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (1ULL << 53)) {
+        mantissa = 1ULL << 52;
+        lz--;
+    }
+    mantissa &= ~(1ULL << 52);
+    int64_t realExponent = exponent - lz;
+    // 非规格化数和溢出交给strtod,以便其设置errno
+    if (realExponent < 1 || realExponent > 2046) {
+        return false;
+    }
+    mantissa |= (uint64_t)realExponent << 52;
+    memcpy(result, &mantissa, sizeof(*result));
+    return true;
+}
+
+// 与strtod用法一致的十进制数解析
+// 快速处理形如[+-]ddd[.ddd][e[+-]ddd]且有效数字不超过19位的串,其余交给strtod
+double chars2Num(const char* str, char** endPtr) {
+    const char* p = str;
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    bool negative = false;
+    if (*p == '-' || *p == '+') {
+        negative = *p == '-';
+        p++;
+    }
+    // 十六进制由strtod处理
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        return strtod(str, endPtr);
+    }
+
+    uint64_t w = 0;
+    int32_t digitNum = 0;  // w中的有效数字个数
+    int64_t q = 0;
+    bool hasDigit = false;
+    bool truncated = false;
+    while (isdigit((unsigned char)*p)) {
+        hasDigit = true;
+        if (w != 0 || *p != '0') {
+            if (digitNum < 19) {
+                w = w * 10 + (*p - '0');
+                digitNum++;
+            } else {
+                truncated = true;
+            }
+        }
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        while (isdigit((unsigned char)*p)) {
+            hasDigit = true;
+            if (w != 0 || *p != '0') {
+                if (digitNum < 19) {
+                    w = w * 10 + (*p - '0');
+                    digitNum++;
+                    q--;
+                } else {
+                    truncated = true;
+                }
+            } else {
+                q--;  // 小数点后的前导0
+            }
+            p++;
+        }
+    }
+    // inf和nan等以及超过19位有效数字的串由strtod处理
+    if (!hasDigit || truncated) {
+        return strtod(str, endPtr);
+    }
+
+    if (*p == 'e' || *p == 'E') {
+        const char* e = p + 1;
+        bool expNegative = false;
+        if (*e == '-' || *e == '+') {
+            expNegative = *e == '-';
+            e++;
+        }
+        // 没有数字时e不属于这个数
+        if (isdigit((unsigned char)*e)) {
+            int64_t expValue = 0;
+            while (isdigit((unsigned char)*e)) {
+                // 超出范围的指数由strtod给出0或inf
+                if (expValue < 100000) {
+                    expValue = expValue * 10 + (*e - '0');
+                }
+                e++;
+            }
+            q += expNegative ? -expValue : expValue;
+            p = e;
+        }
+    }
+
+    double result;
+    if (w == 0) {
+        result = 0.0;
+    } else if (!eiselLemire(w, q, &result)) {
+        return strtod(str, endPtr);
+    }
+    if (endPtr != NULL) {
+        *endPtr = (char*)p;
+    }
+    return negative ? -result : result;
+}
@@ -0,0 +1,14 @@
+#ifndef _INCLUDE_NUMCONV_H
+#define _INCLUDE_NUMCONV_H
+#include <stdint.h>
+
+// 容纳任意double的最短表示所需的缓冲区大小,含结尾的'\0'
+#define NUM_CHARS_MAX 32
+
+// 科学计数法的指数落在[NUM_FIXED_MIN_EXP, NUM_FIXED_MAX_EXP)时按定点格式输出
+#define NUM_FIXED_MIN_EXP -4
+#define NUM_FIXED_MAX_EXP 17
+
+uint32_t num2Chars(double num, char* buf);
+double chars2Num(const char* str, char** endPtr);
+#endif
@@ -11,18 +11,27 @@
 //  3 释放内存
 
 void* memManager(VM* vm, void* ptr, uint32_t oldSize, uint32_t newSize) {
-    // 累计系统分配的总内存
-    vm->allocatedBytes += newSize - oldSize;
+    // 累计系统分配的总内存,释放时新大小小于旧大小,不能直接相减
+    if (newSize >= oldSize) {
+        vm->allocatedBytes += newSize - oldSize;
+    } else {
+        // allocatedBytes在每轮标记时重新累计,释放的内存可能未计入其中,扣减后不低于0
+        uint32_t freedBytes = oldSize - newSize;
+        vm->allocatedBytes = vm->allocatedBytes > freedBytes ? vm->allocatedBytes - freedBytes : 0;
+    }
 
     // 避免realloc(Null, 0)定义的新地址, 此地址不能被释放
     if (newSize == 0) {
-        free(ptr);
+        // 由ALLOCATE和ALLOCATE_EXTRA申请的内存可能属于slab
+        if (!slabFree(&vm->slab, ptr)) {
+            free(ptr);
+        }
         return NULL;
     }
     
-    if(newSize > 0 && vm->allocatedBytes > vm->config.nextGC) {
-        // startGC(vm);
-    }
+    // 在申请内存之前驱动自动回收,
+    // 此时ptr尚未被realloc,回收过程中仍可安全访问
+    gcAllocationStep(vm, newSize > oldSize ? newSize - oldSize : 0);
 
     return realloc(ptr, newSize);
 }
@@ -45,12 +54,21 @@ DEFINE_BUFFER_METHOD(Int)
 DEFINE_BUFFER_METHOD(Char)
 DEFINE_BUFFER_METHOD(Byte)
 
-void symbolTableClear(VM* vm, SymbolTable* buffer) {
+void symbolTableInit(SymbolTable* table) {
+    table->datas = NULL;
+    table->count = table->capacity = 0;
+    table->slots = NULL;
+    table->slotCapacity = 0;
+}
+
+void symbolTableClear(VM* vm, SymbolTable* table) {
     uint32_t idx = 0;
-    while (idx < buffer->count) {
-        memManager(vm, buffer->datas[idx++].str, 0, 0);
+    while (idx < table->count) {
+        memManager(vm, table->datas[idx++].str, 0, 0);
     }
-    StringBufferClear(vm, buffer);
+    memManager(vm, table->datas, sizeof(String) * table->capacity, 0);
+    memManager(vm, table->slots, sizeof(int) * table->slotCapacity, 0);
+    symbolTableInit(table);
 }
 
 // 通用报错函数
@@ -1,13 +1,15 @@
 #ifndef _INCLUDE_UTILS_H
 #define _INCLUDE_UTILS_H
 #include "common.h"
+#include "slab.h"
 
 void* memManager(VM* vm, void* ptr, uint32_t oldSize, uint32_t newSize);
+// 对象等定长内存由slab分配,见slab.h
 #define ALLOCATE(vmPtr, type) \
-    (type*)memManager(vmPtr, NULL, 0, sizeof(type))
+    (type*)slabAllocate(vmPtr, sizeof(type))
 
 #define ALLOCATE_EXTRA(vmPtr, mainType, extraSize) \
-    (mainType*)memManager(vmPtr, NULL, 0, sizeof(mainType) + extraSize)
+    (mainType*)slabAllocate(vmPtr, sizeof(mainType) + extraSize)
 
 #define ALLOCATE_ARRAY(vmPtr, type, count) \
     (type*)memManager(vmPtr, NULL, 0, sizeof(type) * count)
@@ -77,9 +79,19 @@ typedef struct {
         type##BufferInit(buf);\
     }
 
-#define SymbolTable StringBuffer
-
 DECLARE_BUFFER_TYPE(String)
+
+// 符号表: 按添加顺序保存符号,符号在datas中的下标即其索引
+// 符号数超过SYMBOL_TABLE_INDEX_MIN后另建开放定址的哈希索引,查找时不必逐个比较
+typedef struct {
+    String* datas;
+    uint32_t count;
+    uint32_t capacity;
+    int* slots; // 哈希索引,存放符号在datas中的下标,-1为空槽
+    uint32_t slotCapacity; // 为0时未建立索引,按顺序查找
+} SymbolTable;
+
+#define SYMBOL_TABLE_INDEX_MIN 8
 typedef uint8_t Byte;
 typedef char Char;
 typedef int Int;
@@ -96,7 +108,8 @@ typedef enum {
 } ErrorType;
 
 void errorReport(void* parser, ErrorType errorType, const char* fmt, ...);
-void symbolTableClear(VM*, SymbolTable* buffer);
+void symbolTableInit(SymbolTable* table);
+void symbolTableClear(VM*, SymbolTable* table);
 
 #define IO_ERROR(...) errorReport(NULL, ERROR_IO, __VA_ARGS__)
 #define MEM_ERROR(...) errorReport(NULL, ERROR_MEM, __VA_ARGS__)
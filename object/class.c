@@ -5,40 +5,99 @@
 #include "core.h"
 #include "vm.h"
 
-DEFINE_BUFFER_METHOD(Method)
+// 初始化方法表
+void methodTableInit(MethodTable* table) {
+    table->entries = NULL;
+    table->count = table->capacity = 0;
+}
+
+// 在entries中为index找到其所在或应插入的entry
+static MethodEntry* findMethodEntry(MethodEntry* entries, uint32_t capacity, uint32_t index) {
+    uint32_t slot = hashMethodIndex(index, capacity);
+    while (entries[slot].index != index && entries[slot].index != EMPTY_METHOD_INDEX) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &entries[slot];
+}
+
+// 调整方法表的容量为newCapacity,并把原有方法重新放入
+static void resizeMethodTable(VM* vm, MethodTable* table, uint32_t newCapacity) {
+    MethodEntry* newEntries = ALLOCATE_ARRAY(vm, MethodEntry, newCapacity);
+    uint32_t idx = 0;
+    while (idx < newCapacity) {
+        newEntries[idx].index = EMPTY_METHOD_INDEX;
+        idx++;
+    }
+    idx = 0;
+    while (idx < table->capacity) {
+        MethodEntry* entry = &table->entries[idx];
+        if (entry->index != EMPTY_METHOD_INDEX) {
+            *findMethodEntry(newEntries, newCapacity, entry->index) = *entry;
+        }
+        idx++;
+    }
+    DEALLOCATE_ARRAY(vm, table->entries, table->capacity);
+    table->entries = newEntries;
+    table->capacity = newCapacity;
+}
+
+// 使方法表中索引为index的方法为method
+void methodTableSet(VM* vm, MethodTable* table, uint32_t index, Method method) {
+    if (table->count + 1 > table->capacity * METHOD_TABLE_LOAD_PERCENT) {
+        uint32_t newCapacity = table->capacity * 2;
+        if (newCapacity < MIN_METHOD_TABLE_CAPACITY) {
+            newCapacity = MIN_METHOD_TABLE_CAPACITY;
+        }
+        resizeMethodTable(vm, table, newCapacity);
+    }
+    MethodEntry* entry = findMethodEntry(table->entries, table->capacity, index);
+    if (entry->index == EMPTY_METHOD_INDEX) {
+        entry->index = index;
+        table->count++;
+    }
+    entry->method = method;
+}
+
+// 释放方法表
+void methodTableClear(VM* vm, MethodTable* table) {
+    DEALLOCATE_ARRAY(vm, table->entries, table->capacity);
+    methodTableInit(table);
+}
 
 // 判断a和b是否相等
 bool valueIsEqual(Value a, Value b) {
     // 类型不同则无需进行后面的比较
-    if (a.type != b.type) {
+    if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
         return false;
     }
 
     // 同为数字，比较数值
-    if (a.type == VT_NUM) {
-        return a.num == b.num;
+    if (VALUE_IS_NUM(a)) {
+        return VALUE_TO_NUM(a) == VALUE_TO_NUM(b);
+    }
+
+    // 同为单例值(null,true,false)
+    if (!VALUE_IS_OBJ(a)) {
+        return true;
     }
 
     // 相同对象返回true
-    if (a.objHeader == b.objHeader) {
+    if (VALUE_TO_OBJ(a) == VALUE_TO_OBJ(b)) {
         return true;
     }
 
     // 类型不同不比较
-    if (a.objHeader->type != b.objHeader->type) {
+    if (OBJ_TYPE(VALUE_TO_OBJ(a)) != OBJ_TYPE(VALUE_TO_OBJ(b))) {
         return false;
     }
 
-    // 若对象同为字符串
-    if (a.objHeader->type == OT_STRING) {
-        ObjString* strA = VALUE_TO_OBJSTR(a);
-        ObjString* strB = VALUE_TO_OBJSTR(b);
-        return (strA->value.length == strB->value.length &&
-            memcmp(strA->value.start, strB->value.start, strA->value.length) == 0);
+    // 字符串都已驻留,内容相同的字符串必是同一对象,上面已比较过
+    if (OBJ_TYPE(VALUE_TO_OBJ(a)) == OT_STRING) {
+        return false;
     }
 
     // 若对象同为range
-    if (a.objHeader->type == OT_RANGE)  {
+    if (OBJ_TYPE(VALUE_TO_OBJ(a)) == OT_RANGE)  {
         ObjRange* rgA = VALUE_TO_OBJRANGE(a);
         ObjRange* rgB = VALUE_TO_OBJRANGE(b);
         return (rgA->from == rgB->from && rgA->to == rgB->to);
@@ -52,11 +111,15 @@ Class* newRawClass(VM* vm, const char* name, uint32_t fieldNum) {
     Class* class = ALLOCATE(vm, Class);
     // 裸类没有元类
     initObjHeader(vm, &class->objHeader, OT_CLASS, NULL);
-    class->name = newObjString(vm, name, strlen(name));
+    // 先初始化各字段,再申请类名,申请类名时可能触发gc
+    class->name = NULL;
     class->fieldNum = fieldNum;
     class->superClass = NULL; // 默认没有基类
-    MethodBufferInit(&class->methods);
+    methodTableInit(&class->methods);
 
+    pushTmpRoot(vm, (ObjHeader*)class);
+    class->name = newObjString(vm, name, strlen(name));
+    popTmpRoot(vm);
     return class;
 }
 
@@ -70,6 +133,7 @@ Class* newClass(VM* vm, ObjString* className, uint32_t fieldNum, Class* superCla
     // 先创建子类的meta类
     Class* metaClass = newRawClass(vm, newClassName, 0);
     metaClass->objHeader.class = vm->classOfClass;
+    pushTmpRoot(vm, (ObjHeader*)metaClass);
 
     // 绑定classOfClass为meta类的基类
     // 所有的类的基类都是classOfClass
@@ -80,14 +144,17 @@ Class* newClass(VM* vm, ObjString* className, uint32_t fieldNum, Class* superCla
     newClassName[className->value.length] = '\0';
     Class* class = newRawClass(vm, newClassName, fieldNum);
     class->objHeader.class = metaClass;
+    popTmpRoot(vm);
+    pushTmpRoot(vm, (ObjHeader*)class);
     bindSuperClass(vm, class, superClass);
+    popTmpRoot(vm);
 
     return class;
 }
 
 // 数字等Value也被视为对象，因此参数为Value。获得对象obj所属的类
 inline Class* getClassOfObj(VM* vm, Value object) {
-    switch (object.type) {
+    switch (VALUE_TYPE(object)) {
         case VT_NULL:
             return vm->nullClass;
         case VT_FALSE:
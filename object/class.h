@@ -13,6 +13,38 @@ typedef enum {
     MT_FN_CALL // 有关函数对象的调用方法，实现函数的重载
 } MethodType; // 方法类型
 
+#if NAN_BOXING
+#if UINTPTR_MAX != 0xffffffffffffffff
+    #error "NAN_BOXING requires 64-bit pointers"
+#endif
+// 符号位,与QNAN同时置位时表示对象指针
+#define SIGN_BIT ((uint64_t)1 << 63)
+// 指数位全为1,并置位尾数的最高两位.
+// 硬件运算产生的NaN只置位尾数最高位,因此不会与装箱后的值冲突
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+// 单例值用其ValueType作为低位标记
+#define VT_TO_VALUE(vt) ((Value)(QNAN | (uint64_t)(vt)))
+
+#define BOOL_TO_VALUE(boolean) (boolean ? VT_TO_VALUE(VT_TRUE) : VT_TO_VALUE(VT_FALSE))
+#define VALUE_TO_BOOL(value) ((value) == VT_TO_VALUE(VT_TRUE) ? true : false)
+
+// 借助Bits64在double和位模式之间转换
+#define NUM_TO_VALUE(number) (((Bits64){.num = (number)}).bits64)
+#define VALUE_TO_NUM(value) (((Bits64){.bits64 = (value)}).num)
+
+// 对象指针最多48位,直接放入低位
+#define OBJ_TO_VALUE(objPtr) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(objPtr)))
+#define VALUE_TO_OBJ(value) ((ObjHeader*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define VALUE_IS_UNDEFINED(value) ((value) == VT_TO_VALUE(VT_UNDEFINED))
+#define VALUE_IS_NULL(value) ((value) == VT_TO_VALUE(VT_NULL))
+#define VALUE_IS_TRUE(value) ((value) == VT_TO_VALUE(VT_TRUE))
+#define VALUE_IS_FALSE(value) ((value) == VT_TO_VALUE(VT_FALSE))
+#define VALUE_IS_NUM(value) (((value) & QNAN) != QNAN)
+#define VALUE_IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define VALUE_TYPE(value) getValueType(value)
+#else
 #define VT_TO_VALUE(vt) ((Value){vt, {0}})
 
 #define BOOL_TO_VALUE(boolean) (boolean ? VT_TO_VALUE(VT_TRUE) : VT_TO_VALUE(VT_FALSE))
@@ -28,8 +60,17 @@ typedef enum {
     value;\
 })
 
-
 #define VALUE_TO_OBJ(value) (value.objHeader)
+
+#define VALUE_IS_UNDEFINED(value) ((value).type == VT_UNDEFINED)
+#define VALUE_IS_NULL(value) ((value).type == VT_NULL)
+#define VALUE_IS_TRUE(value) ((value).type == VT_TRUE)
+#define VALUE_IS_FALSE(value) ((value).type == VT_FALSE)
+#define VALUE_IS_NUM(value) ((value).type == VT_NUM)
+#define VALUE_IS_OBJ(value) ((value).type == VT_OBJ)
+#define VALUE_TYPE(value) ((value).type)
+#endif
+
 #define VALUE_TO_OBJSTR(value) ((ObjString*)VALUE_TO_OBJ(value))
 #define VALUE_TO_OBJFN(value) ((ObjFn*)VALUE_TO_OBJ(value))
 #define VALUE_TO_OBJRANGE(value) ((ObjRange*)VALUE_TO_OBJ(value))
@@ -40,20 +81,13 @@ typedef enum {
 #define VALUE_TO_OBJTHREAD(value) ((ObjThread*)VALUE_TO_OBJ(value))
 #define VALUE_TO_CLASS(value) ((Class*)VALUE_TO_OBJ(value))
 
-
-#define VALUE_IS_UNDEFINED(value) ((value).type == VT_UNDEFINED)
-#define VALUE_IS_NULL(value) ((value).type == VT_NULL)
-#define VALUE_IS_TRUE(value) ((value).type == VT_TRUE)
-#define VALUE_IS_FALSE(value) ((value).type == VT_FALSE)
-#define VALUE_IS_NUM(value) ((value).type == VT_NUM)
-#define VALUE_IS_OBJ(value) ((value).type == VT_OBJ)
-#define VALUE_IS_CERTAIN_OBJ(value, objType) (VALUE_IS_OBJ(value) && VALUE_TO_OBJ(value)->type == objType)
+#define VALUE_IS_CERTAIN_OBJ(value, objType) (VALUE_IS_OBJ(value) && OBJ_TYPE(VALUE_TO_OBJ(value)) == objType)
 #define VALUE_IS_OBJSTR(value) (VALUE_IS_CERTAIN_OBJ(value, OT_STRING))
 #define VALUE_IS_OBJINSTANCE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_INSTANCE))
 #define VALUE_IS_OBJCLOSURE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_CLOSURE))
 #define VALUE_IS_OBJRANGE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_RANGE))
 #define VALUE_IS_CLASS(value) (VALUE_IS_CERTAIN_OBJ(value, OT_CLASS))
-#define VALUE_IS_0(value) (VALUE_IS_NUM(value) && (value).num == 0)
+#define VALUE_IS_0(value) (VALUE_IS_NUM(value) && VALUE_TO_NUM(value) == 0)
 
 // 原生方法指针
 typedef bool (*Primitive)(VM* vm, Value* args);
@@ -68,14 +102,49 @@ typedef struct method {
     };
 } Method;
 
-DECLARE_BUFFER_TYPE(Method)
+// 方法表中空槽的方法索引
+#define EMPTY_METHOD_INDEX UINT32_MAX
+#define METHOD_TABLE_LOAD_PERCENT 0.75
+#define MIN_METHOD_TABLE_CAPACITY 8
+
+typedef struct {
+    uint32_t index; // 方法名在vm->allMethodNames中的索引
+    Method method;
+} MethodEntry;
+
+// 类的方法表
+// 以方法名的全局索引为键的开放寻址哈希表,容量是2的幂,冲突时线性探测
+// 只占用与类实际拥有的方法数成正比的内存,而不是与全局方法名的数量成正比
+// 方法只会被绑定或覆盖而不会被删除,因此不需要墓碑
+typedef struct {
+    MethodEntry* entries;
+    uint32_t count; // 已使用的entry数
+    uint32_t capacity; // entries的容量
+} MethodTable;
+
+// 每个调用点最多缓存的接收者类数量,超出后不再缓存新的类
+#define INLINE_CACHE_SIZE 4
+
+typedef struct {
+    Class* class; // 接收者的类
+    Method method; // 在该类中查找到的方法
+} InlineCacheEntry;
+
+// 方法调用点的内联缓存
+// 只缓存了1个类时是单态缓存,多于1个时是多态缓存
+// epoch与vm->methodEpoch不一致说明之后有方法被绑定或类被回收,缓存作废
+struct inlineCache {
+    uint32_t epoch;
+    uint32_t count; // entries中已使用的项数
+    InlineCacheEntry entries[INLINE_CACHE_SIZE];
+};
 
 // 类是对象的模板
 struct class {
     ObjHeader objHeader; 
     struct class* superClass; // 父类
     uint32_t fieldNum; // 本体的字段数，包括基类的字段数
-    MethodBuffer methods; // 本体的方法
+    MethodTable methods; // 本体的方法,包括继承自基类的方法
     ObjString* name; // 类名
 }; // 对象类
 
@@ -85,6 +154,47 @@ typedef union {
     double num;
 } Bits64;
 
+#if NAN_BOXING
+// 获得装箱值的类型
+static inline ValueType getValueType(Value value) {
+    if (VALUE_IS_NUM(value)) {
+        return VT_NUM;
+    }
+    if (VALUE_IS_OBJ(value)) {
+        return VT_OBJ;
+    }
+    return (ValueType)(value & 0x7);
+}
+#endif
+
+// 计算方法索引在方法表中的起始槽位
+static inline uint32_t hashMethodIndex(uint32_t index, uint32_t capacity) {
+    uint32_t hash = index * 2654435769u;
+    return (hash ^ (hash >> 16)) & (capacity - 1);
+}
+
+// 在class中查找索引为index的方法,没有则返回NULL
+static inline Method* findMethod(Class* class, uint32_t index) {
+    MethodTable* table = &class->methods;
+    if (table->capacity == 0) {
+        return NULL;
+    }
+    uint32_t slot = hashMethodIndex(index, table->capacity);
+    while (true) {
+        MethodEntry* entry = &table->entries[slot];
+        if (entry->index == index) {
+            return &entry->method;
+        }
+        if (entry->index == EMPTY_METHOD_INDEX) {
+            return NULL;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+}
+
+void methodTableInit(MethodTable* table);
+void methodTableSet(VM* vm, MethodTable* table, uint32_t index, Method method);
+void methodTableClear(VM* vm, MethodTable* table);
 bool valueIsEqual(Value a, Value b);
 Class* newRawClass(VM* vm, const char* name, uint32_t fieldNum);
 
@@ -1,14 +1,24 @@
 #include "header_obj.h"
 #include "class.h"
 #include "vm.h"
+#include "gc.h"
 
 DEFINE_BUFFER_METHOD(Value)
 
 // 初始化对象头
 void initObjHeader(VM* vm, ObjHeader* objHeader, ObjType objType, Class* class) {
+#if COMPACT_OBJ_HEADER
+    objHeader->meta = (uint64_t)objType << OBJ_TYPE_SHIFT;
+#else
     objHeader->type = objType;
-    objHeader->isDark = false;
+    objHeader->flags = 0;
+#endif
     objHeader->class = class;
-    objHeader->next = vm->allObjects;
-    vm->allObjects = objHeader;
+    // slab中的对象的标记位在页的位图中.
+    // 槽位只在未标记时才会被释放,复用时其标记位已是清除状态
+    if (objHeader == vm->slab.lastSlot) {
+        ASSERT(!SLAB_IS_MARKED(objHeader), "reused slab slot is still marked!");
+        OBJ_SET_FLAG(objHeader, OBJ_FLAG_IN_SLAB);
+    }
+    gcNewObject(vm, objHeader);
 }
\ No newline at end of file
@@ -16,13 +16,61 @@ typedef enum {
     OT_THREAD
 } ObjType; // 对象类型
 
+#define OBJ_TYPE_NUM (OT_THREAD + 1)
+
+// 编译时指定-DCOMPACT_OBJ_HEADER=0则使用各字段分开存放的对象头
+// 开启时对象头只有16字节:next指针只用到低48位,对象类型和回收标志存放在其高16位中
+#ifndef COMPACT_OBJ_HEADER
+    #define COMPACT_OBJ_HEADER 1
+#endif
+
+// 对象头中的回收标志
+#define OBJ_FLAG_DARK 0x1 // 对象是否可达,只用于不在slab中的对象,slab中对象的标记位在所在页的位图中
+#define OBJ_FLAG_OLD 0x2 // 分代回收模式下对象是否已晋升到老年代
+#define OBJ_FLAG_REMEMBERED 0x4 // 分代回收模式下老年代对象是否已在记忆集中
+#define OBJ_FLAG_IN_SLAB 0x8 // 对象是否由slab分配
+
+#if COMPACT_OBJ_HEADER
+typedef struct objHeader {
+    Class* class; // 对象所属的类
+    // 低48位是链接所有已分配对象的next指针,
+    // 第48至55位是对象类型,第56至63位是回收标志
+    uint64_t meta;
+} ObjHeader; // 对象头，用于记录元信息和垃圾回收
+
+#define OBJ_PTR_MASK (((uint64_t)1 << 48) - 1)
+#define OBJ_TYPE_SHIFT 48
+#define OBJ_FLAG_SHIFT 56
+
+#define OBJ_TYPE(obj) ((ObjType)(((obj)->meta >> OBJ_TYPE_SHIFT) & 0xff))
+#define OBJ_NEXT(obj) ((ObjHeader*)(uintptr_t)((obj)->meta & OBJ_PTR_MASK))
+#define OBJ_SET_NEXT(obj, nextObj)\
+    ((obj)->meta = ((obj)->meta & ~OBJ_PTR_MASK) | (uint64_t)(uintptr_t)(nextObj))
+#define OBJ_HAS_FLAG(obj, flag) (((obj)->meta & ((uint64_t)(flag) << OBJ_FLAG_SHIFT)) != 0)
+#define OBJ_SET_FLAG(obj, flag) ((obj)->meta |= (uint64_t)(flag) << OBJ_FLAG_SHIFT)
+#define OBJ_CLEAR_FLAG(obj, flag) ((obj)->meta &= ~((uint64_t)(flag) << OBJ_FLAG_SHIFT))
+// 原子地置位标志,返回置位前该标志是否已置位,用于并行标记
+#define OBJ_TEST_AND_SET_FLAG(obj, flag)\
+    ((__atomic_fetch_or(&(obj)->meta, (uint64_t)(flag) << OBJ_FLAG_SHIFT, __ATOMIC_RELAXED) &\
+        ((uint64_t)(flag) << OBJ_FLAG_SHIFT)) != 0)
+#else
 typedef struct objHeader {
     ObjType type;
-    bool isDark; // 对象是否可达
+    uint8_t flags; // OBJ_FLAG_*
     Class* class; // 对象所属的类
     struct objHeader* next; // 用于链接所有已分配的对象
 } ObjHeader; // 对象头，用于记录元信息和垃圾回收
 
+#define OBJ_TYPE(obj) ((obj)->type)
+#define OBJ_NEXT(obj) ((obj)->next)
+#define OBJ_SET_NEXT(obj, nextObj) ((obj)->next = (nextObj))
+#define OBJ_HAS_FLAG(obj, flag) (((obj)->flags & (flag)) != 0)
+#define OBJ_SET_FLAG(obj, flag) ((obj)->flags |= (flag))
+#define OBJ_CLEAR_FLAG(obj, flag) ((obj)->flags &= ~(flag))
+#define OBJ_TEST_AND_SET_FLAG(obj, flag)\
+    ((__atomic_fetch_or(&(obj)->flags, (uint8_t)(flag), __ATOMIC_RELAXED) & (flag)) != 0)
+#endif
+
 typedef enum {
     VT_UNDEFINED,
     VT_NULL,
@@ -32,6 +80,13 @@ typedef enum {
     VT_OBJ // 值为对象，指向对象头
 } ValueType; // value 类型
 
+#if NAN_BOXING
+// NaN-boxing模式下值被打包进一个64位字:
+// 非NaN的位模式即是数字本身,
+// 置位quiet NaN的位模式用来表示单例值(null,true,false,undefined)和对象指针
+// 存取统一通过class.h中的VALUE_*宏进行
+typedef uint64_t Value; // 通用的值结构
+#else
 typedef struct {
     ValueType type;
     union {
@@ -39,6 +94,7 @@ typedef struct {
         ObjHeader* objHeader;
     };
 } Value; // 通用的值结构
+#endif
 
 DECLARE_BUFFER_TYPE(Value)
 
@@ -13,12 +13,14 @@ ObjModule* newObjModule(VM* vm, const char* modName) {
     // ObjModule 是元信息对象，不属于任何一个类
     initObjHeader(vm, &objModule->objHeader, OT_MODULE, NULL);
 
-    StringBufferInit(&objModule->moduleVarName);
+    symbolTableInit(&objModule->moduleVarName);
     ValueBufferInit(&objModule->moduleVarValue);
 
     objModule->name = NULL; // 核心模块名为NULL
     if (modName != NULL) {
+        pushTmpRoot(vm, (ObjHeader*)objModule);
         objModule->name = newObjString(vm, modName, strlen(modName));
+        popTmpRoot(vm);
     }
     return objModule;
 }
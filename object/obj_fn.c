@@ -15,6 +15,16 @@ ObjFn* newObjFn(VM* vm, ObjModule* objModule, uint32_t slotNum) {
     objFn->module = objModule;
     objFn->maxStackSlotUsedNum = slotNum;
     objFn->upvalueNum = objFn->argNum = 0;
+    objFn->inlineCaches = NULL;
+    objFn->inlineCacheNum = 0;
+#if JIT
+    objFn->jitCode = NULL;
+    objFn->jitEntries = NULL;
+    objFn->jitHotness = 0;
+#endif
+#if AOT
+    objFn->aotCode = NULL;
+#endif
 
 #ifdef DEBUG
     objFn->debug = ALLOCATE(vm, FnDebug);
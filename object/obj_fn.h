@@ -4,12 +4,29 @@
 #include "utils.h"
 #include "meta_obj.h"
 
+// 编译时指定-DJIT=0去掉模板jit,jit只支持x86-64的Linux
+// 开启时以--jit运行,执行次数达到阈值的函数被逐条指令翻译成机器码,见jit.h
+#ifndef JIT
+    #if defined(__x86_64__) && defined(__linux__)
+        #define JIT 1
+    #else
+        #define JIT 0
+    #endif
+#endif
+
+// 编译时指定-DAOT=0去掉对aot生成代码的支持
+// 开启时ccc --aot把模块编译成c代码,与libccc.a链接成可执行程序,见aot.h
+#ifndef AOT
+    #define AOT 1
+#endif
 
 typedef struct {
     char* fnName; // 函数名
     IntBuffer lineNo; // 行号
 } FnDebug; // 在函数中的调试结构
 
+typedef struct inlineCache InlineCache; // 方法调用点的内联缓存,定义在class.h
+
 typedef struct {
     ObjHeader objHeader;
     ByteBuffer instrStream; // 函数编译后的指令流
@@ -21,6 +38,20 @@ typedef struct {
     uint32_t upvalueNum; // 本函数所涵盖的upvalue数量
     uint8_t argNum; // 函数期望的参数个数
 
+    // 每个方法调用点各有一个内联缓存,下标是调用指令中2字节的缓存索引
+    InlineCache* inlineCaches;
+    uint32_t inlineCacheNum;
+
+#if JIT
+    void* jitCode; // 编译出的机器码,尚未编译时为NULL
+    // 各条指令对应的机器码在jitCode中的偏移,下标是指令在instrStream中的偏移
+    uint32_t* jitEntries;
+    uint32_t jitHotness; // 函数入口和循环回边的执行次数
+#endif
+#if AOT
+    void* aotCode; // aot为该函数生成的c函数,没有时为NULL
+#endif
+
 #if DEBUG
     FnDebug* debug;
 #endif
@@ -1,4 +1,5 @@
 #include "obj_list.h"
+#include "gc.h"
 
 // 新建list对象，元素个数为elementNum
 ObjList* newObjList(VM* vm, uint32_t elementNum) {
@@ -35,13 +36,14 @@ void insertElement(VM* vm, ObjList* objList, uint32_t index, Value value) {
 
     // 在index处插入数值
     objList->elements.datas[index] = value;
+    GC_WRITE_BARRIER(vm, objList, value);
 }
 
 // 调整list容量
 static void shrinkList(VM* vm, ObjList* objList, uint32_t newCapacity) {
     uint32_t oldSize = objList->elements.capacity * sizeof(Value);
     uint32_t newSize = newCapacity * sizeof(Value);
-    memManager(vm, objList->elements.datas, oldSize, newSize);
+    objList->elements.datas = memManager(vm, objList->elements.datas, oldSize, newSize);
     objList->elements.capacity = newCapacity;
 }
 
@@ -3,28 +3,44 @@
 #include "vm.h"
 #include "obj_string.h"
 #include "obj_range.h"
+#include "gc.h"
+#include <string.h>
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+// 探测未找到时的返回值
+#define SLOT_NOT_FOUND UINT32_MAX
 
 // 创建新map对象
 ObjMap* newObjMap(VM* vm) {
     ObjMap* objMap = ALLOCATE(vm, ObjMap);
     initObjHeader(vm, &objMap->objHeader, OT_MAP, vm->mapClass);
-    objMap->capacity = objMap->count = 0;
+    objMap->capacity = objMap->count = objMap->tombstones = 0;
     objMap->entries = NULL;
+    objMap->ctrl = NULL;
     return objMap;
 }
 
 // 计算数字的哈希码
+// valueIsEqual认为0和-0相等,二者须有相同的哈希码,故-0按0计算,所有NaN也按同一位模式计算
 static uint32_t hashNum(double num) {
     Bits64 bits64;
-    bits64.num = num;
+    if (num == 0) {
+        bits64.bits64 = 0;
+    } else if (num != num) {
+        bits64.bits64 = 0x7ff8000000000000ULL;
+    } else {
+        bits64.num = num;
+    }
     return bits64.bits32[0] ^ bits64.bits32[1];
 }
 
 // 计算对象的哈希码
 static uint32_t hashObj(ObjHeader* objHeader) {
-    switch (objHeader->type) {
+    switch (OBJ_TYPE(objHeader)) {
         case OT_CLASS: // 计算class的哈希值
-            return hashString(((Class*)objHeader)->name->value.start, ((Class*)objHeader)->name->value.length);
+            return ((Class*)objHeader)->name->hashCode;
         case OT_RANGE: // 计算range对象哈希值
         {
             ObjRange* objRange = (ObjRange*)objHeader;
@@ -39,161 +55,248 @@ static uint32_t hashObj(ObjHeader* objHeader) {
 }
 
 // 根据value的类型调用相应的哈希函数
+// 控制字节和组的选择分别用到哈希值的低7位和其余位,
+// 整数的位模式低位几乎全是0,因此再做一次混合使每一位都均匀
 static uint32_t hashValue(Value value) {
-    switch (value.type) {
+    uint32_t hashCode = 0;
+    switch (VALUE_TYPE(value)) {
         case VT_FALSE:
-            return 0;
+            hashCode = 0;
+            break;
         case VT_NULL:
-            return 1;
+            hashCode = 1;
+            break;
         case VT_NUM:
-            return hashNum(value.num);
+            hashCode = hashNum(VALUE_TO_NUM(value));
+            break;
         case VT_TRUE:
-            return 2;
+            hashCode = 2;
+            break;
         case VT_OBJ:
-            return hashObj(value.objHeader);
+            hashCode = hashObj(VALUE_TO_OBJ(value));
+            break;
         default:
             RUN_ERROR("unsupport type hashed!");
     }
-    return 0;
+    // murmur3的fmix32
+    hashCode ^= hashCode >> 16;
+    hashCode *= 0x85ebca6b;
+    hashCode ^= hashCode >> 13;
+    hashCode *= 0xc2b2ae35;
+    hashCode ^= hashCode >> 16;
+    return hashCode;
 }
 
-// 在entries中添加entry，如果是新的key则返回true
-static bool addEntry(Entry* entries, uint32_t capacity, Value key, Value value) {
-    uint32_t index = hashValue(key) % capacity;
-
-    // 通过开放探测法去找可用的slot
-    while (true) {
-        // 找到空闲的slot，说明目前没有此key，直接赋值返回
-        if (entries[index].key.type == VT_UNDEFINED) {
-            entries[index].key = key;
-            entries[index].value = value;
-            return true;
-        } else if (valueIsEqual(entries[index].key, key)) { // key已存在，只更新即可
-            entries[index].value = value;
-            return false;
+// 返回一组控制字节中等于ctrlByte的位置的位掩码
+static inline uint32_t groupMatch(const uint8_t* group, uint8_t ctrlByte) {
+#if defined(__SSE2__)
+    __m128i ctrls = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrls, _mm_set1_epi8((char)ctrlByte)));
+#else
+    uint32_t mask = 0, idx = 0;
+    while (idx < MAP_GROUP_WIDTH) {
+        if (group[idx] == ctrlByte) {
+            mask |= 1u << idx;
         }
-
-        // 开放探测定址，尝试下一个slot
-        index = (index + 1) % capacity;
+        idx++;
     }
+    return mask;
+#endif
 }
 
-// 使对象objMap的容量调整到newCapacity
-static void resizeMap(VM* vm, ObjMap* objMap, uint32_t newCapacity) {
-    // 1. 先建立一个新的entry数组
-    Entry* newEntries = ALLOCATE_ARRAY(vm, Entry, newCapacity);
-    uint32_t idx = 0;
-    while (idx < newCapacity) {
-        newEntries[idx].key = VT_TO_VALUE(VT_UNDEFINED);
-        newEntries[idx].value = VT_TO_VALUE(VT_FALSE);
+// 返回一组控制字节中空槽位或已删除槽位的位掩码,即最高位为1的位置
+static inline uint32_t groupMatchFree(const uint8_t* group) {
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0, idx = 0;
+    while (idx < MAP_GROUP_WIDTH) {
+        if (group[idx] & 0x80) {
+            mask |= 1u << idx;
+        }
         idx++;
     }
+    return mask;
+#endif
+}
 
-    // 2.再遍历老的数组，把有值的部分插入到新数组
-    if (objMap->capacity > 0) {
-        Entry* entryArr = objMap->entries;
-        idx = 0;
-        while (idx < objMap->capacity) {
-            // 该slot有值
-            if (entryArr[idx].key.type != VT_UNDEFINED) {
-                addEntry(newEntries, newCapacity, entryArr[idx].key, entryArr[idx].value);
+// 哈希值除低7位外的部分决定起始组
+#define START_GROUP(hashCode, groupMask) (((hashCode) >> 7) & (groupMask))
+// 低7位存入控制字节
+#define HASH_TO_CTRL(hashCode) ((uint8_t)((hashCode) & 0x7f))
+
+// 在objMap中查找key所在的槽位,不存在则返回SLOT_NOT_FOUND
+// 以组为单位做三角数探测,组数是2的幂,可保证遍历到所有组
+static uint32_t findSlot(ObjMap* objMap, Value key, uint32_t hashCode) {
+    if (objMap->count == 0) {
+        return SLOT_NOT_FOUND;
+    }
+    uint32_t groupMask = objMap->capacity / MAP_GROUP_WIDTH - 1;
+    uint32_t group = START_GROUP(hashCode, groupMask);
+    uint8_t ctrlByte = HASH_TO_CTRL(hashCode);
+    uint32_t step = 0;
+    while (true) {
+        const uint8_t* ctrls = objMap->ctrl + group * MAP_GROUP_WIDTH;
+        // 先用控制字节过滤,再比较缓存的哈希值,最后才比较key
+        uint32_t match = groupMatch(ctrls, ctrlByte);
+        while (match != 0) {
+            uint32_t slot = group * MAP_GROUP_WIDTH + __builtin_ctz(match);
+            Entry* entry = &objMap->entries[slot];
+            if (entry->hashCode == hashCode && valueIsEqual(entry->key, key)) {
+                return slot;
             }
-            idx++;
+            match &= match - 1;
         }
+        // 组内有空槽位说明key从未越过此组插入
+        if (groupMatch(ctrls, MAP_CTRL_EMPTY) != 0) {
+            return SLOT_NOT_FOUND;
+        }
+        step++;
+        group = (group + step) & groupMask;
     }
-
-    // 3.将entry数组空间回收
-    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->count);
-    objMap->entries = newEntries; // 更新指针为新的entry数组
-    objMap->capacity = newCapacity; // 更新容量
 }
 
-// 在objMap中查找key对应的entry
-static Entry* findEntry(ObjMap* objMap, Value key) {
-    // obgMap 为空则返回null
-    if (objMap->capacity == 0) {
-        return NULL;
-    }
-
-    // 以下开放定址探测
-    // 用哈希值对容量取模计算槽位(slot)
-    uint32_t index = hashValue(key) % objMap->capacity;
-    Entry* entry;
+// 在控制字节ctrl中为哈希值为hashCode的新key找到第一个空槽位或已删除槽位
+static uint32_t findFreeSlot(const uint8_t* ctrl, uint32_t capacity, uint32_t hashCode) {
+    uint32_t groupMask = capacity / MAP_GROUP_WIDTH - 1;
+    uint32_t group = START_GROUP(hashCode, groupMask);
+    uint32_t step = 0;
     while (true) {
-        entry = &objMap->entries[index];
-
-        // 若该slot中的entry正好是该key的entry，找到返回
-        if (valueIsEqual(entry->key, key)) {
-            return entry;
+        uint32_t match = groupMatchFree(ctrl + group * MAP_GROUP_WIDTH);
+        if (match != 0) {
+            return group * MAP_GROUP_WIDTH + __builtin_ctz(match);
         }
+        step++;
+        group = (group + step) & groupMask;
+    }
+}
 
-        // key为VT_UNDEFINED且value为VT_TRUE表示探测链未断可继续探测
-        // key为VT_UNDEFINED且value为VT_FALSE表示探测链结束
+// 使对象objMap的容量调整到newCapacity
+static void resizeMap(VM* vm, ObjMap* objMap, uint32_t newCapacity) {
+    // 1. 先建立新的entry数组,控制字节紧随其后,全部置为空槽位
+    Entry* newEntries = (Entry*)memManager(vm, NULL, 0, (sizeof(Entry) + sizeof(uint8_t)) * newCapacity);
+    uint8_t* newCtrl = (uint8_t*)(newEntries + newCapacity);
+    memset(newCtrl, MAP_CTRL_EMPTY, newCapacity);
 
-        if (VALUE_IS_UNDEFINED(entry->key) && VALUE_IS_FALSE(entry->value)) {
-            return NULL; // 未找到
+    // 2.再遍历老的数组，把在用的entry放入新数组,哈希值已缓存无需重新计算
+    uint32_t idx = 0;
+    while (idx < objMap->capacity) {
+        if (MAP_SLOT_IS_FULL(objMap, idx)) {
+            Entry* entry = &objMap->entries[idx];
+            uint32_t slot = findFreeSlot(newCtrl, newCapacity, entry->hashCode);
+            newCtrl[slot] = HASH_TO_CTRL(entry->hashCode);
+            newEntries[slot] = *entry;
         }
-
-        // 继续向下探测
-        index = (index + 1) & objMap->capacity;
+        idx++;
     }
+
+    // 3.将entry数组空间回收
+    DEALLOCATE(vm, objMap->entries);
+    objMap->entries = newEntries; // 更新指针为新的entry数组
+    objMap->ctrl = newCtrl;
+    objMap->capacity = newCapacity; // 更新容量
+    objMap->tombstones = 0; // 已删除的槽位在搬迁后消失
 }
 
 // 在objMap中实现key与value的关联：objMap[key] = value
 void mapSet(VM* vm, ObjMap* objMap, Value key, Value value) {
-    // 当容量利于率达到80%时扩容
-    if (objMap->count + 1 > objMap->capacity * MAP_LOAD_PRECENT) {
-        uint32_t newCapacity = objMap->capacity * CAPACITY_GROW_FACTOR;
+    uint32_t hashCode = hashValue(key);
+    uint32_t slot = findSlot(objMap, key, hashCode);
+    // key已存在，只更新即可
+    if (slot != SLOT_NOT_FOUND) {
+        objMap->entries[slot].value = value;
+        GC_WRITE_BARRIER(vm, objMap, value);
+        return;
+    }
+
+    // 在用和已删除的槽位达到87.5%时扩容
+    if (objMap->count + objMap->tombstones + 1 > objMap->capacity * MAP_LOAD_PRECENT) {
+        // 已删除的槽位较多时只需原容量重新搬迁
+        uint32_t newCapacity = objMap->capacity;
+        if (objMap->count + 1 > objMap->capacity * MAP_LOAD_PRECENT / 2) {
+            newCapacity = objMap->capacity * 2;
+        }
         if (newCapacity < MIN_CAPACITY) {
             newCapacity = MIN_CAPACITY;
         }
+        // 扩容时可能触发gc,key和value此时可能只被c的局部变量引用
+        uint32_t rootNum = 0;
+        if (VALUE_IS_OBJ(key)) {
+            pushTmpRoot(vm, VALUE_TO_OBJ(key));
+            rootNum++;
+        }
+        if (VALUE_IS_OBJ(value)) {
+            pushTmpRoot(vm, VALUE_TO_OBJ(value));
+            rootNum++;
+        }
         resizeMap(vm, objMap, newCapacity);
+        while (rootNum-- > 0) {
+            popTmpRoot(vm);
+        }
     }
 
-    // 若创建了新的key，则使objMap->count 加1
-    if (addEntry(objMap->entries, objMap->capacity, key, value)) {
-        objMap->count++;
+    slot = findFreeSlot(objMap->ctrl, objMap->capacity, hashCode);
+    if (objMap->ctrl[slot] == MAP_CTRL_DELETED) {
+        objMap->tombstones--;
     }
+    objMap->ctrl[slot] = HASH_TO_CTRL(hashCode);
+    Entry* entry = &objMap->entries[slot];
+    entry->key = key;
+    entry->value = value;
+    entry->hashCode = hashCode;
+    objMap->count++;
+    GC_WRITE_BARRIER(vm, objMap, key);
+    GC_WRITE_BARRIER(vm, objMap, value);
 }
 
 // 从map中查找key对应的value：map[key]
 Value mapGet(ObjMap* objMap, Value key) {
-    Entry* entry = findEntry(objMap, key);
-    if (entry == NULL) {
+    uint32_t slot = findSlot(objMap, key, hashValue(key));
+    if (slot == SLOT_NOT_FOUND) {
         return VT_TO_VALUE(VT_UNDEFINED);
     }
-    return entry->value;
+    return objMap->entries[slot].value;
 }
 
 // 回收objMap.entries占用的空间
 void clearMap(VM* vm, ObjMap* objMap) {
-    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->count);
+    DEALLOCATE(vm, objMap->entries);
     objMap->entries = NULL;
-    objMap->capacity = objMap->count = 0;
+    objMap->ctrl = NULL;
+    objMap->capacity = objMap->count = objMap->tombstones = 0;
 }
 
 // 删除objMap中的key，返回map[key]
 Value removeKey(VM* vm, ObjMap* objMap, Value key) {
-    Entry* entry = findEntry(objMap, key);
-    if (entry == NULL) {
+    uint32_t slot = findSlot(objMap, key, hashValue(key));
+    if (slot == SLOT_NOT_FOUND) {
         return VT_TO_VALUE(VT_NULL);
     }
 
-    // 设置开放定址伪删除
-    Value value = entry->value;
-    entry->key = VT_TO_VALUE(VT_UNDEFINED);
-    entry->value = VT_TO_VALUE(VT_TRUE); // 值为真，伪删除
+    Value value = objMap->entries[slot].value;
+    // 所在组仍有空槽位说明没有key越过此组插入,可直接置为空槽位,
+    // 否则置为已删除,使探测链不中断
+    const uint8_t* group = objMap->ctrl + slot / MAP_GROUP_WIDTH * MAP_GROUP_WIDTH;
+    if (groupMatch(group, MAP_CTRL_EMPTY) != 0) {
+        objMap->ctrl[slot] = MAP_CTRL_EMPTY;
+    } else {
+        objMap->ctrl[slot] = MAP_CTRL_DELETED;
+        objMap->tombstones++;
+    }
 
     objMap->count--;
     if (objMap->count == 0) { // 若删除后map为空则回收空间
         clearMap(vm, objMap);
-    } else if (objMap->count < objMap->capacity / (CAPACITY_GROW_FACTOR) * MAP_LOAD_PRECENT && 
-        objMap->count > MIN_CAPACITY) { // 若map利用率低就缩小空间
-        uint32_t newCapacity = objMap->capacity / CAPACITY_GROW_FACTOR;
-        if (newCapacity < MIN_CAPACITY) {
-            newCapacity = MIN_CAPACITY;
+    } else if (objMap->count < objMap->capacity * MAP_LOAD_PRECENT / 4 &&
+        objMap->capacity > MIN_CAPACITY) { // 若map利用率低就缩小空间
+        // 缩容时可能触发gc,value已不在map中
+        if (VALUE_IS_OBJ(value)) {
+            pushTmpRoot(vm, VALUE_TO_OBJ(value));
+        }
+        resizeMap(vm, objMap, objMap->capacity / 2);
+        if (VALUE_IS_OBJ(value)) {
+            popTmpRoot(vm);
         }
-        resizeMap(vm, objMap, newCapacity);
     }
     return value;
-}
\ No newline at end of file
+}
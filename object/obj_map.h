@@ -2,20 +2,33 @@
 #define _OBJECT_MAP_H
 #include "header_obj.h"
 
-#define MAP_LOAD_PRECENT 0.8
+// 槽位被占用的比例达到此值时扩容,已删除的槽位也计入
+#define MAP_LOAD_PRECENT 0.875
+// 每组槽位数,一次用SSE2比较一组的控制字节
+#define MAP_GROUP_WIDTH 16
+
+// 控制字节:最高位为0表示槽位在用,低7位是key哈希值的低7位
+#define MAP_CTRL_EMPTY 0x80 // 空槽位,探测到所在组有空槽位即可停止
+#define MAP_CTRL_DELETED 0xfe // 已删除的槽位,探测需越过
 
 typedef struct {
     Value key;
     Value value;
+    uint32_t hashCode; // key的哈希值,探测和扩容时不再重新计算
 } Entry;
 
 typedef struct {
     ObjHeader objHeader;
-    uint32_t capacity; // Entry的容量，包括已使用和未使用的entry的数量
+    uint32_t capacity; // Entry的容量，为MAP_GROUP_WIDTH的整数倍且是2的幂
     uint32_t count; // map中使用的Entry的数量
+    uint32_t tombstones; // 已删除的Entry的数量
     Entry* entries; // Entry 数组
+    uint8_t* ctrl; // 每个Entry的控制字节,与entries在同一块内存中,紧随其后
 } ObjMap;
 
+// 索引为idx的entry是否在用
+#define MAP_SLOT_IS_FULL(objMap, idx) (((objMap)->ctrl[idx] & 0x80) == 0)
+
 ObjMap* newObjMap(VM* vm);
 
 void mapSet(VM* vm, ObjMap* objMap, Value key, Value value);
@@ -24,4 +37,4 @@ void clearMap(VM* vm, ObjMap* objMap);
 Value removeKey(VM* v, ObjMap* objMap, Value key);
 
 
-#endif
\ No newline at end of file
+#endif
@@ -1,10 +1,15 @@
 #include "obj_string.h"
 #include <string.h>
 #include "vm.h"
+#include "gc.h"
 #include "utils.h"
 #include "common.h"
 #include <stdlib.h>
 
+// 已删除槽位的标记,使探测链不中断
+static char tombstone;
+#define TOMBSTONE ((ObjString*)&tombstone)
+
 // fnv-la算法
 uint32_t hashString(char* str, uint32_t length) {
     uint32_t hashCode = 2166136261, idx = 0;
@@ -21,17 +26,207 @@ void hashObjString(ObjString* objString) {
     objString->hashCode = hashString(objString->value.start, objString->value.length);
 }
 
+void stringTableInit(StringTable* table) {
+    table->strings = NULL;
+    table->capacity = table->count = table->tombstones = 0;
+}
+
+// 回收驻留表占用的空间,表中的字符串由gc回收
+void stringTableClear(VM* vm, StringTable* table) {
+    DEALLOCATE_ARRAY(vm, table->strings, table->capacity);
+    stringTableInit(table);
+}
+
+// 在驻留表中查找内容为str的字符串,不存在返回NULL
+static ObjString* stringTableFind(StringTable* table, const char* str, uint32_t length, uint32_t hashCode) {
+    if (table->count == 0) {
+        return NULL;
+    }
+    uint32_t index = hashCode & (table->capacity - 1);
+    while (true) {
+        ObjString* objString = table->strings[index];
+        if (objString == NULL) {
+            return NULL;
+        }
+        if (objString != TOMBSTONE && objString->hashCode == hashCode &&
+            objString->value.length == length &&
+            (length == 0 || memcmp(objString->value.start, str, length) == 0)) {
+            return objString;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+// 把objString放入strings中第一个可用的槽位
+static void stringTableInsert(ObjString** strings, uint32_t capacity, ObjString* objString) {
+    uint32_t index = objString->hashCode & (capacity - 1);
+    while (strings[index] != NULL && strings[index] != TOMBSTONE) {
+        index = (index + 1) & (capacity - 1);
+    }
+    strings[index] = objString;
+}
+
+// 确保驻留表还能再放入一个字符串,扩容时顺带清除墓碑
+// 扩容可能触发gc,须在新字符串链入对象链表之前调用
+static void stringTableReserve(VM* vm, StringTable* table) {
+    if (table->count + table->tombstones + 1 <= table->capacity * STRING_TABLE_LOAD_PERCENT) {
+        return;
+    }
+    uint32_t newCapacity = ceilToPowerOf2((table->count + 1) * 2);
+    if (newCapacity < MIN_STRING_TABLE_CAPACITY) {
+        newCapacity = MIN_STRING_TABLE_CAPACITY;
+    }
+    ObjString** newStrings = ALLOCATE_ARRAY(vm, ObjString*, newCapacity);
+    memset(newStrings, 0, sizeof(ObjString*) * newCapacity);
+
+    // 申请内存时gc可能已从表中删除了字符串,须在申请之后再搬迁
+    uint32_t idx = 0;
+    while (idx < table->capacity) {
+        ObjString* objString = table->strings[idx];
+        if (objString != NULL && objString != TOMBSTONE) {
+            stringTableInsert(newStrings, newCapacity, objString);
+        }
+        idx++;
+    }
+    DEALLOCATE_ARRAY(vm, table->strings, table->capacity);
+    table->strings = newStrings;
+    table->capacity = newCapacity;
+    table->tombstones = 0;
+}
+
+// 从驻留表中删除objString,由gc在回收字符串时调用
+void stringTableRemove(StringTable* table, ObjString* objString) {
+    if (table->count == 0) {
+        return;
+    }
+    uint32_t index = objString->hashCode & (table->capacity - 1);
+    while (table->strings[index] != NULL) {
+        if (table->strings[index] == objString) {
+            table->strings[index] = TOMBSTONE;
+            table->count--;
+            table->tombstones++;
+            return;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+// 标记结束后删除表中未被标记的字符串,
+// 避免在增量清扫期间把即将回收的字符串再次返回给程序
+void stringTableRemoveWhite(StringTable* table) {
+    uint32_t idx = 0;
+    while (idx < table->capacity) {
+        ObjString* objString = table->strings[idx];
+        if (objString != NULL && objString != TOMBSTONE && !OBJ_IS_DARK(&objString->objHeader)) {
+            table->strings[idx] = TOMBSTONE;
+            table->count--;
+            table->tombstones++;
+        }
+        idx++;
+    }
+}
+
+// 把驻留表中所有字符串的类设为class
+void stringTableSetClass(StringTable* table, Class* class) {
+    uint32_t idx = 0;
+    while (idx < table->capacity) {
+        ObjString* objString = table->strings[idx];
+        if (objString != NULL && objString != TOMBSTONE) {
+            objString->objHeader.class = class;
+        }
+        idx++;
+    }
+}
+
+// 初始化objString的对象头并将其登记到驻留表
+static void stringTableAdd(VM* vm, ObjString* objString) {
+    // objString尚未链入对象链表,扩容时触发的gc不会访问它
+    stringTableReserve(vm, &vm->stringTable);
+    initObjHeader(vm, &objString->objHeader, OT_STRING, vm->stringClass);
+    stringTableInsert(vm->stringTable.strings, vm->stringTable.capacity, objString);
+    vm->stringTable.count++;
+}
+
+// 驻留表中已有的字符串被再次取用,等同于新建对象
+static ObjString* reuseInternedString(VM* vm, ObjString* objString) {
+    // 与gcNewObject一致,标记阶段取用的字符串直接标灰
+    if (vm->gcPhase == GC_PHASE_MARK) {
+        grayObject(vm, &objString->objHeader);
+    }
+    return objString;
+}
+
+// 驻留已填好内容但尚未初始化对象头的字符串objString
+// 若已有相同内容的字符串则释放objString并返回已有的字符串
+ObjString* internObjString(VM* vm, ObjString* objString) {
+    hashObjString(objString);
+    ObjString* interned = stringTableFind(&vm->stringTable, objString->value.start,
+        objString->value.length, objString->hashCode);
+    if (interned != NULL) {
+        DEALLOCATE(vm, objString);
+        return reuseInternedString(vm, interned);
+    }
+    stringTableAdd(vm, objString);
+    return objString;
+}
+
+// 初始化builder,预先分配capacity字节,已知结果长度时只需分配一次
+void stringBuilderInit(VM* vm, StringBuilder* builder, uint32_t capacity) {
+    builder->objString = ALLOCATE_EXTRA(vm, ObjString, capacity + 1);
+    if (builder->objString == NULL) {
+        MEM_ERROR("Allocating ObjString failed!");
+    }
+    builder->length = 0;
+    builder->capacity = capacity;
+}
+
+// 将str的前length个字节追加到builder,容量不足时按2倍扩容
+void stringBuilderAppend(VM* vm, StringBuilder* builder, const char* str, uint32_t length) {
+    uint32_t needed = builder->length + length;
+    if (needed > builder->capacity) {
+        // 字符串可能分配自slab,不能用realloc扩容
+        uint32_t newCapacity = ceilToPowerOf2(needed);
+        ObjString* newString = ALLOCATE_EXTRA(vm, ObjString, newCapacity + 1);
+        if (newString == NULL) {
+            MEM_ERROR("Allocating ObjString failed!");
+        }
+        memcpy(newString->value.start, builder->objString->value.start, builder->length);
+        DEALLOCATE(vm, builder->objString);
+        builder->objString = newString;
+        builder->capacity = newCapacity;
+    }
+    if (length > 0) {
+        memcpy(builder->objString->value.start + builder->length, str, length);
+    }
+    builder->length = needed;
+}
+
+// 结束拼接,返回驻留后的字符串,builder此后不可再用
+ObjString* stringBuilderFinish(VM* vm, StringBuilder* builder) {
+    ObjString* objString = builder->objString;
+    objString->value.start[builder->length] = '\0';
+    objString->value.length = builder->length;
+    builder->objString = NULL;
+    return internObjString(vm, objString);
+}
+
 // 以str字符串创建ObjString对象, 允许空串""
+// 内容相同的字符串只创建一次
 ObjString* newObjString(VM* vm, const char* str, uint32_t length) {
 
     // length 为0时str必为NULL length 不为0时str不为NULL
     ASSERT(length == 0 || str != NULL, "str length dont't match str!");
 
+    uint32_t hashCode = hashString((char*)str, length);
+    ObjString* interned = stringTableFind(&vm->stringTable, str, length, hashCode);
+    if (interned != NULL) {
+        return reuseInternedString(vm, interned);
+    }
+
     // +1 是为了结尾的'\0'
     ObjString* objString = ALLOCATE_EXTRA(vm, ObjString, length + 1);
 
     if (objString != NULL) {
-        initObjHeader(vm, &objString->objHeader, OT_STRING, vm->stringClass);
         objString->value.length = length;
 
         // 支持空字符串：str为null， length为0
@@ -40,10 +235,11 @@ ObjString* newObjString(VM* vm, const char* str, uint32_t length) {
             memcpy(objString->value.start, str, length);
         }
         objString->value.start[length] = '\0';
-        hashObjString(objString);
+        objString->hashCode = hashCode;
+        stringTableAdd(vm, objString);
     } else {
         MEM_ERROR("Allocating ObjString failed!");
     }
 
     return objString;
-}
\ No newline at end of file
+}
@@ -8,9 +8,37 @@ typedef struct {
     CharValue value;
 } ObjString;
 
+// 字符串驻留表,所有字符串对象都登记在此,内容相同的字符串只有一个对象
+// 驻留表对字符串是弱引用,字符串被回收时从表中删除
+typedef struct {
+    ObjString** strings; // 开放定址的槽位,容量为2的幂
+    uint32_t capacity;
+    uint32_t count; // 已登记的字符串数
+    uint32_t tombstones; // 已删除的槽位数
+} StringTable;
+
+// 拼接字符串用的缓冲区,内容直接写入尚未初始化对象头的ObjString,
+// 完成时驻留该字符串,省去中间结果的复制
+typedef struct {
+    ObjString* objString;
+    uint32_t length; // 已写入的字节数
+    uint32_t capacity; // 不含结尾'\0'的容量
+} StringBuilder;
+
+#define STRING_TABLE_LOAD_PERCENT 0.75
+#define MIN_STRING_TABLE_CAPACITY 64
+
 uint32_t hashString(char* str, uint32_t length);
 void hashObjString(ObjString* objString);
 ObjString* newObjString(VM* vm, const char* str, uint32_t length);
+ObjString* internObjString(VM* vm, ObjString* objString);
+void stringBuilderInit(VM* vm, StringBuilder* builder, uint32_t capacity);
+void stringBuilderAppend(VM* vm, StringBuilder* builder, const char* str, uint32_t length);
+ObjString* stringBuilderFinish(VM* vm, StringBuilder* builder);
+void stringTableInit(StringTable* table);
+void stringTableClear(VM* vm, StringTable* table);
+void stringTableRemove(StringTable* table, ObjString* objString);
+void stringTableRemoveWhite(StringTable* table);
+void stringTableSetClass(StringTable* table, Class* class);
 
-
-#endif
\ No newline at end of file
+#endif
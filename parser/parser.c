@@ -4,6 +4,7 @@
 #include "common.h"
 #include "utils.h"
 #include "unicodeUtf8.h"
+#include "numConv.h"
 #include <string.h>
 #include <ctype.h>
 #include "obj_string.h"
@@ -35,7 +36,7 @@ struct keywordToken keywordsToken[] = {
     {"this", 4, TOKEN_THIS},
     {"super", 5, TOKEN_SUPER},
     {"import", 6, TOKEN_IMPORT},
-    {"null", 0, TOKEN_UNKNOWN}
+    {NULL, 0, TOKEN_UNKNOWN}
 };
 
 // 判断start是否为关键字并返回相应的token
@@ -136,7 +137,7 @@ static void parseNum(Parser* parser) {
         parser->curToken.value = NUM_TO_VALUE(strtol(parser->curToken.start, NULL, 8));
     } else {
         parseDecNum(parser);
-        parser->curToken.value = NUM_TO_VALUE(strtod(parser->curToken.start, NULL));
+        parser->curToken.value = NUM_TO_VALUE(chars2Num(parser->curToken.start, NULL));
     }
     // nextCharPtr 会指向第一个不合法字符的下一个字符,因此-1
     parser->curToken.length = (uint32_t) (parser->nextCharPtr - parser->curToken.start - 1);
@@ -262,8 +263,8 @@ static void skipAline(Parser* parser) {
             getNextChar(parser);
             break;
         }
+        getNextChar(parser);
     }
-    getNextChar(parser);
 }
 
 // 跳过行注释或区块注释
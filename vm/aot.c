@@ -0,0 +1,384 @@
+#include "aot.h"
+#include <string.h>
+#include "compiler.h"
+#include "bytecode.h"
+#include "peephole.h"
+#include "core.h"
+#include "utils.h"
+
+#if AOT
+// aot程序的主模块,由aotMain设置,载入后清空
+static const AotModule* mainModule = NULL;
+
+/////////////////////////////////////// 生成c代码 ///////////////////////////////////////
+
+// 算术和比较运算在AOT_NUM_INFIX中的写法,下标是操作码与OPCODE_ADD的差
+static const char* numInfixOps[][2] = {
+    {"NUM_TO_VALUE", "a + b"},
+    {"NUM_TO_VALUE", "a - b"},
+    {"NUM_TO_VALUE", "a * b"},
+    {"NUM_TO_VALUE", "a / b"},
+    {"NUM_TO_VALUE", "fmod(a, b)"},
+    {"BOOL_TO_VALUE", "a > b"},
+    {"BOOL_TO_VALUE", "a >= b"},
+    {"BOOL_TO_VALUE", "a < b"},
+    {"BOOL_TO_VALUE", "a <= b"},
+    {"BOOL_TO_VALUE", "a == b"},
+    {"BOOL_TO_VALUE", "a != b"}
+};
+
+static uint32_t readShortAt(uint8_t* code, uint32_t offset) {
+    return (code[offset] << 8) | code[offset + 1];
+}
+
+// 返回offset处指令之后的偏移,超级指令按其第一条指令计
+static uint32_t nextInstruction(ObjFn* fn, uint32_t offset) {
+    if (fn->instrStream.datas[offset] == OPCODE_END) {
+        return offset + 1;
+    }
+    return offset + 1 + getBytesOfOperands(fn->instrStream.datas, fn->constants.datas, offset);
+}
+
+// 标出需要标签的指令: 跳转目标,以及回到aotExecute后要从其继续执行的调用之后的指令
+static void markLabels(ObjFn* fn, bool* labels) {
+    uint8_t* code = fn->instrStream.datas;
+    labels[0] = true;
+    uint32_t offset = 0;
+    while (offset < fn->instrStream.count) {
+        OpCode opCode = unfuseOpCode((OpCode)code[offset]);
+        uint32_t next = nextInstruction(fn, offset);
+        switch (opCode) {
+            case OPCODE_JUMP:
+            case OPCODE_JUMP_IF_FALSE:
+                labels[next + (int16_t)readShortAt(code, offset + 1)] = true;
+                break;
+            case OPCODE_AND:
+            case OPCODE_OR:
+                labels[next + readShortAt(code, offset + 1)] = true;
+                break;
+            case OPCODE_LOOP:
+                labels[next - readShortAt(code, offset + 1)] = true;
+                break;
+            case OPCODE_FOR_RANGE:
+                labels[next + readShortAt(code, offset + 2)] = true;
+                labels[next + readShortAt(code, offset + 4)] = true;
+                break;
+            default:
+                if ((opCode >= OPCODE_CALL0 && opCode <= OPCODE_SUPER16) ||
+                    (opCode >= OPCODE_ADD && opCode <= OPCODE_NOT_EQUAL)) {
+                    labels[next] = true;
+                }
+                break;
+        }
+        offset = next;
+    }
+}
+
+// 生成offset处的指令,超级指令按原来的指令对逐条生成
+static void emitInstruction(FILE* file, ObjFn* fn, uint32_t offset) {
+    uint8_t* code = fn->instrStream.datas;
+    OpCode opCode = unfuseOpCode((OpCode)code[offset]);
+    uint32_t next = nextInstruction(fn, offset);
+    switch (opCode) {
+        case OPCODE_LOAD_CONSTANT:
+            fprintf(file, "    AOT_LOAD_CONSTANT(%u);\n", readShortAt(code, offset + 1));
+            break;
+        case OPCODE_PUSH_NULL:
+            fprintf(file, "    AOT_PUSH(VT_TO_VALUE(VT_NULL));\n");
+            break;
+        case OPCODE_PUSH_FALSE:
+            fprintf(file, "    AOT_PUSH(VT_TO_VALUE(VT_FALSE));\n");
+            break;
+        case OPCODE_PUSH_TRUE:
+            fprintf(file, "    AOT_PUSH(VT_TO_VALUE(VT_TRUE));\n");
+            break;
+        case OPCODE_LOAD_LOCAL_VAR:
+            fprintf(file, "    AOT_LOAD_LOCAL_VAR(%u);\n", code[offset + 1]);
+            break;
+        case OPCODE_STORE_LOCAL_VAR:
+            fprintf(file, "    AOT_STORE_LOCAL_VAR(%u);\n", code[offset + 1]);
+            break;
+        case OPCODE_LOAD_UPVALUE:
+            fprintf(file, "    AOT_LOAD_UPVALUE(%u);\n", code[offset + 1]);
+            break;
+        case OPCODE_STORE_UPVALUE:
+            fprintf(file, "    AOT_STORE_UPVALUE(%u);\n", code[offset + 1]);
+            break;
+        case OPCODE_LOAD_MODULE_VAR:
+            fprintf(file, "    AOT_LOAD_MODULE_VAR(%u);\n", readShortAt(code, offset + 1));
+            break;
+        case OPCODE_STORE_MODULE_VAR:
+            fprintf(file, "    AOT_STORE_MODULE_VAR(%u);\n", readShortAt(code, offset + 1));
+            break;
+        case OPCODE_LOAD_THIS_FIELD:
+            fprintf(file, "    AOT_LOAD_THIS_FIELD(%u);\n", offset);
+            break;
+        case OPCODE_STORE_THIS_FIELD:
+            fprintf(file, "    AOT_STORE_THIS_FIELD(%u);\n", offset);
+            break;
+        case OPCODE_LOAD_FIELD:
+            fprintf(file, "    AOT_LOAD_FIELD(%u);\n", offset);
+            break;
+        case OPCODE_STORE_FIELD:
+            fprintf(file, "    AOT_STORE_FIELD(%u);\n", offset);
+            break;
+        case OPCODE_POP:
+            fprintf(file, "    AOT_POP();\n");
+            break;
+        case OPCODE_JUMP:
+            fprintf(file, "    goto L%u;\n", next + (int16_t)readShortAt(code, offset + 1));
+            break;
+        case OPCODE_LOOP:
+            fprintf(file, "    goto L%u;\n", next - readShortAt(code, offset + 1));
+            break;
+        case OPCODE_JUMP_IF_FALSE:
+            fprintf(file, "    AOT_JUMP_IF_FALSE(L%u);\n", next + (int16_t)readShortAt(code, offset + 1));
+            break;
+        case OPCODE_AND:
+            fprintf(file, "    AOT_AND(L%u);\n", next + readShortAt(code, offset + 1));
+            break;
+        case OPCODE_OR:
+            fprintf(file, "    AOT_OR(L%u);\n", next + readShortAt(code, offset + 1));
+            break;
+        case OPCODE_FOR_RANGE:
+            fprintf(file, "    AOT_FOR_RANGE(%u, L%u, L%u);\n", code[offset + 1],
+                next + readShortAt(code, offset + 2), next + readShortAt(code, offset + 4));
+            break;
+        case OPCODE_RETURN:
+            fprintf(file, "    AOT_RETURN(%u);\n", offset);
+            break;
+        case OPCODE_CONSTRUCT:
+            fprintf(file, "    AOT_CONSTRUCT();\n");
+            break;
+        // 以下指令只在定义类、方法和闭包或拼接字符串时执行,由nativeSlowPath完成
+        case OPCODE_CLOSE_UPVALUE:
+        case OPCODE_CREATE_CLOSURE:
+        case OPCODE_CREATE_CLASS:
+        case OPCODE_INSTANCE_METHOD:
+        case OPCODE_STATIC_METHOD:
+        case OPCODE_INTERPOLATE:
+            fprintf(file, "    AOT_SLOW_PATH(%u);\n", offset);
+            break;
+        case OPCODE_END:
+            fprintf(file, "    NOT_REACHED();\n");
+            break;
+        default:
+            if (opCode >= OPCODE_CALL0 && opCode <= OPCODE_CALL16) {
+                fprintf(file, "    AOT_CALL(%u, %d, %u);\n", offset,
+                    opCode - OPCODE_CALL0 + 1, readShortAt(code, offset + 3));
+            } else if (opCode >= OPCODE_SUPER0 && opCode <= OPCODE_SUPER16) {
+                fprintf(file, "    AOT_SUPER(%u, %d, %u, %u);\n", offset, opCode - OPCODE_SUPER0 + 1,
+                    readShortAt(code, offset + 3), readShortAt(code, offset + 5));
+            } else {
+                ASSERT(opCode >= OPCODE_ADD && opCode <= OPCODE_NOT_EQUAL, "unknown opcode!");
+                fprintf(file, "    AOT_NUM_INFIX(%u, %s, %s);\n", offset,
+                    numInfixOps[opCode - OPCODE_ADD][0], numInfixOps[opCode - OPCODE_ADD][1]);
+            }
+            break;
+    }
+}
+
+// 为fn生成c函数aotFn<idx>,再按先序为常量中的内层函数生成
+static void emitFn(FILE* file, ObjFn* fn, uint32_t* fnNum) {
+    uint32_t count = fn->instrStream.count;
+    bool* labels = (bool*)calloc(count, sizeof(bool));
+    if (labels == NULL) {
+        MEM_ERROR("allocate aot labels failed!");
+    }
+    markLabels(fn, labels);
+
+    fprintf(file, "\nstatic int aotFn%u(VM* vm, ObjThread* thread, Frame* frame) {\n", (*fnNum)++);
+    fprintf(file, "    AOT_PROLOGUE();\n");
+    // 从frame->ip处继续执行,ip不是调用之后的指令时交给解释器
+    fprintf(file, "    switch (frame->ip - code) {\n");
+    uint32_t offset = 0;
+    while (offset < count) {
+        if (labels[offset]) {
+            fprintf(file, "        case %u: goto L%u;\n", offset, offset);
+        }
+        offset = nextInstruction(fn, offset);
+    }
+    fprintf(file, "        default: return NATIVE_EXIT;\n    }\n");
+
+    offset = 0;
+    while (offset < count) {
+        if (labels[offset]) {
+            fprintf(file, "L%u:\n", offset);
+        }
+        emitInstruction(file, fn, offset);
+        offset = nextInstruction(fn, offset);
+    }
+    fprintf(file, "}\n");
+    free(labels);
+
+    uint32_t idx = 0;
+    while (idx < fn->constants.count) {
+        Value constant = fn->constants.datas[idx];
+        if (VALUE_IS_CERTAIN_OBJ(constant, OT_FUNCTION)) {
+            emitFn(file, VALUE_TO_OBJFN(constant), fnNum);
+        }
+        idx++;
+    }
+}
+
+// 按emitFn的顺序生成函数表的各项
+static void emitFnTable(FILE* file, ObjFn* fn, uint32_t* fnNum) {
+    fprintf(file, "    {aotFn%u, %u},\n", (*fnNum)++, fn->instrStream.count);
+    uint32_t idx = 0;
+    while (idx < fn->constants.count) {
+        Value constant = fn->constants.datas[idx];
+        if (VALUE_IS_CERTAIN_OBJ(constant, OT_FUNCTION)) {
+            emitFnTable(file, VALUE_TO_OBJFN(constant), fnNum);
+        }
+        idx++;
+    }
+}
+
+// 把str以c字符串字面量的形式写入file,每行源码一个字面量
+static void emitCString(FILE* file, const char* str) {
+    fprintf(file, "\"");
+    while (*str != '\0') {
+        uint8_t c = (uint8_t)*str++;
+        if (c == '\n') {
+            fprintf(file, *str == '\0' ? "\\n" : "\\n\"\n    \"");
+        } else if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f || c == '?') {
+            // 八进制转义固定写3位,不会与其后的数字连在一起,'?'转义以免构成三字符组
+            fprintf(file, "\\%03o", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fprintf(file, "\"");
+}
+
+// 为刚编译完成的模块函数fn生成c代码写入outputPath,
+// moduleVarNumBefore是编译前模块变量的数量,sourceCode是模块的源码
+void aotEmitModule(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourceCode, const char* outputPath) {
+    uint32_t size;
+    uint8_t* image = serializeBytecodeSnapshot(vm, objModule, fn, moduleVarNumBefore, sourceCode, &size);
+    if (image == NULL) {
+        IO_ERROR("module %s can't be serialized!", objModule->name->value.start);
+    }
+    FILE* file = fopen(outputPath, "w");
+    if (file == NULL) {
+        IO_ERROR("Could't open file %s", outputPath);
+    }
+    fprintf(file, "// 由 ccc --aot 根据%s生成,请勿手动修改\n", objModule->name->value.start);
+    fprintf(file, "// 须与相同编译开关构建的libccc.a链接\n");
+    fprintf(file, "#include \"aot.h\"\n\n");
+
+    fprintf(file, "static const char aotSource[] =\n    ");
+    emitCString(file, sourceCode);
+    fprintf(file, ";\n\n");
+    fprintf(file, "static const uint8_t aotImage[%u] = {", size);
+    uint32_t idx = 0;
+    while (idx < size) {
+        fprintf(file, idx % 16 == 0 ? "\n    0x%02x," : " 0x%02x,", image[idx]);
+        idx++;
+    }
+    fprintf(file, "\n};\n");
+    free(image);
+
+    uint32_t fnNum = 0;
+    emitFn(file, fn, &fnNum);
+
+    fprintf(file, "\nstatic const AotFunction aotFns[%u] = {\n", fnNum);
+    fnNum = 0;
+    emitFnTable(file, fn, &fnNum);
+    fprintf(file, "};\n\n");
+    fprintf(file, "static const AotModule aotModule = {\n");
+    fprintf(file, "    ");
+    emitCString(file, objModule->name->value.start);
+    fprintf(file, ",\n    aotSource, aotImage, sizeof(aotImage), aotFns, %u\n};\n\n", fnNum);
+    fprintf(file, "int main(void) {\n    return aotMain(&aotModule);\n}\n");
+    if (fclose(file) != 0) {
+        IO_ERROR("Could't write file %s", outputPath);
+    }
+}
+
+/////////////////////////////////////// 运行时 ///////////////////////////////////////
+
+// 按先序为fn及其内层函数挂上module中的c函数,函数与c函数不能一一对应时返回false.
+// apply为false时只校验,不修改函数
+static bool bindAotFns(ObjFn* fn, const AotModule* module, uint32_t* fnNum, bool apply) {
+    if (*fnNum >= module->fnNum || module->fns[*fnNum].instrNum != fn->instrStream.count) {
+        return false;
+    }
+    if (apply) {
+        fn->aotCode = (void*)module->fns[*fnNum].code;
+    #if JIT
+        // 已有c函数,不必再由jit编译
+        fn->jitHotness = UINT32_MAX;
+    #endif
+    }
+    (*fnNum)++;
+    uint32_t idx = 0;
+    while (idx < fn->constants.count) {
+        Value constant = fn->constants.datas[idx];
+        if (VALUE_IS_CERTAIN_OBJ(constant, OT_FUNCTION) &&
+            !bindAotFns(VALUE_TO_OBJFN(constant), module, fnNum, apply)) {
+            return false;
+        }
+        idx++;
+    }
+    return true;
+}
+
+// objModule是aot程序的主模块时从程序中的字节码载入模块函数,并为各函数挂上c函数,否则返回NULL.
+// 字节码与当前的运行时不一致时返回NULL,由调用方重新编译源码后解释执行
+ObjFn* aotLoadModule(VM* vm, ObjModule* objModule, const char* moduleCode) {
+    const AotModule* module = mainModule;
+    if (module == NULL || objModule->name == NULL || strcmp(objModule->name->value.start, module->name) != 0) {
+        return NULL;
+    }
+    mainModule = NULL;
+    ObjFn* fn = loadBytecodeSnapshot(vm, objModule, module->image, module->imageSize, moduleCode);
+    uint32_t fnNum = 0;
+    if (fn == NULL || !bindAotFns(fn, module, &fnNum, false) || fnNum != module->fnNum) {
+        fprintf(stderr, "aot code of %s doesn't match the runtime, interpreted instead\n", module->name);
+        return fn;
+    }
+    fnNum = 0;
+    bindAotFns(fn, module, &fnNum, true);
+    return fn;
+}
+
+// 从thread的当前frame起执行c函数,调用和返回后接着执行新的当前frame,
+// 遇到没有c函数的frame或c函数退回到解释器时返回,
+// 返回true表示原生方法返回了false,解释器须处理出错或线程切换
+bool aotExecute(VM* vm, ObjThread* thread) {
+    while (true) {
+        Frame* frame = &thread->frames[thread->usedFrameNum - 1];
+        AotFn code = (AotFn)frame->closure->fn->aotCode;
+        if (code == NULL) {
+            return false;
+        }
+        int result = code(vm, thread, frame);
+        if (result == NATIVE_PRIMITIVE_FAILED) {
+            return true;
+        }
+        if (result == NATIVE_EXIT) {
+            return false;
+        }
+    }
+}
+
+// aot生成的程序的入口,以module为主模块运行
+int aotMain(const AotModule* module) {
+    // 与直接运行脚本一样以模块所在目录为根目录,导入的其它模块仍从源码载入
+    const char* lastSlash = strrchr(module->name, '/');
+    if (lastSlash != NULL) {
+        char* root = (char*)malloc(lastSlash - module->name + 2);
+        memcpy(root, module->name, lastSlash - module->name + 1);
+        root[lastSlash - module->name + 1] = '\0';
+        rootDir = root;
+    }
+    mainModule = module;
+    VM* vm = newVM();
+    Value moduleName = OBJ_TO_VALUE(newObjString(vm, module->name, strlen(module->name)));
+    return executeModule(vm, moduleName, module->source, NULL) == VM_RESULT_SUCCESS ? 0 : 1;
+}
+#endif
@@ -0,0 +1,204 @@
+#ifndef _VM_AOT_H
+#define _VM_AOT_H
+#include <math.h>
+#include "vm.h"
+#include "class.h"
+#include "meta_obj.h"
+#include "gc.h"
+
+// 提前编译: ccc --aot out.c xxx.ccc 把模块编译后的每个函数(含方法和闭包)生成一个c函数,
+// 函数体按指令流的顺序把每条指令展开成下面的AOT_*宏.
+// 生成的代码与libccc.a链接成可执行程序,启动时从其中的字节码载入模块,再为各函数挂上c函数.
+// c函数与解释器共用Frame和运行时栈,调用脚本方法和返回时回到aotExecute,
+// 由它接着执行新的当前frame,没有c函数的frame(如核心模块的方法)交给解释器
+
+typedef int (*AotFn)(VM* vm, ObjThread* thread, Frame* frame);
+
+typedef struct {
+    AotFn code;
+    uint32_t instrNum; // 生成时指令流的长度,载入时据此校验
+} AotFunction;
+
+typedef struct {
+    const char* name; // 模块名,即生成时源码文件的路径
+    const char* source; // 模块源码,字节码载入失败时据此重新编译后解释执行
+    const uint8_t* image; // 模块编译后的字节码,由loadBytecodeSnapshot载入
+    uint32_t imageSize;
+    const AotFunction* fns; // 模块函数及其常量中的内层函数,按先序排列
+    uint32_t fnNum;
+} AotModule;
+
+#if AOT
+// 以下宏供生成的代码使用,offset是指令在指令流中的偏移.
+// 方法索引在载入时、field索引在绑定方法时才确定,从指令流中读取,其余操作数在生成时已写成常数
+#define AOT_BYTE_AT(offset) (code[offset])
+#define AOT_SHORT_AT(offset) ((uint16_t)(code[offset] << 8 | code[(offset) + 1]))
+
+// 每个c函数的开头
+#define AOT_PROLOGUE()\
+    ObjFn* fn = frame->closure->fn;\
+    uint8_t* code UNUSED = fn->instrStream.datas;\
+    Value* stackStart UNUSED = frame->stackStart;\
+    Value* esp = thread->esp;\
+    (void)vm
+
+// 由nativeSlowPath执行offset处的指令,须回到aotExecute时返回
+#define AOT_SLOW_PATH(offset)\
+    do {\
+        thread->esp = esp;\
+        int result = nativeSlowPath(vm, thread, frame, code + (offset));\
+        if (result != NATIVE_CONTINUE) {\
+            return result;\
+        }\
+        esp = thread->esp;\
+    } while (0)
+
+#define AOT_PUSH(value) (*esp++ = (value))
+#define AOT_POP() (esp--)
+#define AOT_LOAD_CONSTANT(idx) AOT_PUSH(fn->constants.datas[idx])
+#define AOT_LOAD_LOCAL_VAR(idx) AOT_PUSH(stackStart[idx])
+#define AOT_STORE_LOCAL_VAR(idx) (stackStart[idx] = esp[-1])
+#define AOT_LOAD_UPVALUE(idx) AOT_PUSH(*frame->closure->upvalues[idx]->localVarPtr)
+#define AOT_STORE_UPVALUE(idx)\
+    do {\
+        ObjUpvalue* upvalue = frame->closure->upvalues[idx];\
+        *upvalue->localVarPtr = esp[-1];\
+        GC_WRITE_BARRIER(vm, upvalue, esp[-1]);\
+    } while (0)
+#define AOT_LOAD_MODULE_VAR(idx) AOT_PUSH(fn->module->moduleVarValue.datas[idx])
+#define AOT_STORE_MODULE_VAR(idx)\
+    do {\
+        fn->module->moduleVarValue.datas[idx] = esp[-1];\
+        GC_WRITE_BARRIER(vm, fn->module, esp[-1]);\
+    } while (0)
+#define AOT_LOAD_THIS_FIELD(offset)\
+    AOT_PUSH(VALUE_TO_OBJINSTANCE(stackStart[0])->fields[AOT_BYTE_AT((offset) + 1)])
+#define AOT_STORE_THIS_FIELD(offset)\
+    do {\
+        ObjInstance* objInstance = VALUE_TO_OBJINSTANCE(stackStart[0]);\
+        objInstance->fields[AOT_BYTE_AT((offset) + 1)] = esp[-1];\
+        GC_WRITE_BARRIER(vm, objInstance, esp[-1]);\
+    } while (0)
+#define AOT_LOAD_FIELD(offset)\
+    (esp[-1] = VALUE_TO_OBJINSTANCE(esp[-1])->fields[AOT_BYTE_AT((offset) + 1)])
+#define AOT_STORE_FIELD(offset)\
+    do {\
+        ObjInstance* objInstance = VALUE_TO_OBJINSTANCE(*(--esp));\
+        objInstance->fields[AOT_BYTE_AT((offset) + 1)] = esp[-1];\
+        GC_WRITE_BARRIER(vm, objInstance, esp[-1]);\
+    } while (0)
+
+// 算术和比较运算: 两个操作数都是数字时直接计算,否则调用运算符方法
+#define AOT_NUM_INFIX(offset, valueMacro, expr)\
+    do {\
+        if (VALUE_IS_NUM(esp[-2]) && VALUE_IS_NUM(esp[-1])) {\
+            double a = VALUE_TO_NUM(esp[-2]);\
+            double b = VALUE_TO_NUM(esp[-1]);\
+            esp--;\
+            esp[-1] = valueMacro(expr);\
+        } else {\
+            AOT_SLOW_PATH(offset);\
+        }\
+    } while (0)
+
+// 方法调用: 内联缓存的第一项命中时不必调用lookupMethod,原生方法直接调用其c实现.
+// 被调的脚本方法也有c函数且栈和frame都够用时直接压入frame,其余情况由nativeCall完成,
+// 之后回到aotExecute执行被调方
+#define AOT_INVOKE(offset, next, argNum, classExpr, cacheIdx)\
+    do {\
+        Value* args = esp - (argNum);\
+        Class* class = classExpr;\
+        InlineCache* cache = &fn->inlineCaches[cacheIdx];\
+        Method* method;\
+        if (cache->epoch == vm->methodEpoch && cache->count != 0 && cache->entries[0].class == class) {\
+            vm->inlineCacheHits++;\
+            method = &cache->entries[0].method;\
+        } else {\
+            method = lookupMethod(vm, cache, class, AOT_SHORT_AT((offset) + 1));\
+        }\
+        thread->esp = esp;\
+        frame->ip = code + (next);\
+        if (method->type == MT_PRIMITIVE) {\
+            if (!method->primFn(vm, args)) {\
+                return NATIVE_PRIMITIVE_FAILED;\
+            }\
+            esp = thread->esp - ((argNum) - 1);\
+            break;\
+        }\
+        if (method->type == MT_SCRIPT && method->obj->fn->aotCode != NULL &&\
+            thread->usedFrameNum < thread->frameCapacity &&\
+            (uint32_t)(esp - thread->stack) + method->obj->fn->maxStackSlotUsedNum <= thread->stackCapacity) {\
+            Frame* callee = &thread->frames[thread->usedFrameNum++];\
+            callee->stackStart = args;\
+            callee->closure = method->obj;\
+            callee->ip = method->obj->fn->instrStream.datas;\
+            return NATIVE_CALL;\
+        }\
+        return nativeCall(vm, thread, method, argNum);\
+    } while (0)
+#define AOT_CALL(offset, argNum, cacheIdx)\
+    AOT_INVOKE(offset, (offset) + 5, argNum, getClassOfObj(vm, args[0]), cacheIdx)
+#define AOT_SUPER(offset, argNum, superIdx, cacheIdx)\
+    AOT_INVOKE(offset, (offset) + 7, argNum, VALUE_TO_CLASS(fn->constants.datas[superIdx]), cacheIdx)
+
+#define AOT_JUMP_IF_FALSE(label)\
+    do {\
+        esp--;\
+        if (VALUE_IS_FALSE(*esp) || VALUE_IS_NULL(*esp)) {\
+            goto label;\
+        }\
+    } while (0)
+#define AOT_AND(label)\
+    do {\
+        if (VALUE_IS_FALSE(esp[-1]) || VALUE_IS_NULL(esp[-1])) {\
+            goto label;\
+        }\
+        esp--;\
+    } while (0)
+#define AOT_OR(label)\
+    do {\
+        if (!VALUE_IS_FALSE(esp[-1]) && !VALUE_IS_NULL(esp[-1])) {\
+            goto label;\
+        }\
+        esp--;\
+    } while (0)
+// seq不是range时继续执行其后调用iterate和iteratorValue的指令
+#define AOT_FOR_RANGE(seqSlot, condLabel, bodyLabel)\
+    do {\
+        RangeStep step = stepRange(&stackStart[seqSlot]);\
+        if (step == RANGE_FINISHED) {\
+            AOT_PUSH(VT_TO_VALUE(VT_FALSE));\
+            goto condLabel;\
+        } else if (step == RANGE_NEXT) {\
+            AOT_PUSH(stackStart[(seqSlot) + 1]);\
+            goto bodyLabel;\
+        }\
+    } while (0)
+
+// 没有要关闭的upvalue时直接弹出frame,否则由nativeSlowPath完成
+#define AOT_RETURN(offset)\
+    do {\
+        if (thread->usedFrameNum > 1 &&\
+            (thread->openUpvalues == NULL || thread->openUpvalues->localVarPtr < stackStart)) {\
+            stackStart[0] = esp[-1];\
+            thread->esp = stackStart + 1;\
+            thread->usedFrameNum--;\
+            return NATIVE_RETURN;\
+        }\
+        thread->esp = esp;\
+        return nativeSlowPath(vm, thread, frame, code + (offset));\
+    } while (0)
+
+#define AOT_CONSTRUCT()\
+    do {\
+        thread->esp = esp;\
+        stackStart[0] = OBJ_TO_VALUE(newObjInstance(vm, VALUE_TO_CLASS(stackStart[0])));\
+    } while (0)
+
+void aotEmitModule(VM* vm, ObjModule* objModule, ObjFn* fn,
+    uint32_t moduleVarNumBefore, const char* sourceCode, const char* outputPath);
+ObjFn* aotLoadModule(VM* vm, ObjModule* objModule, const char* moduleCode);
+bool aotExecute(VM* vm, ObjThread* thread);
+int aotMain(const AotModule* module);
+#endif
+#endif
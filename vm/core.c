@@ -5,20 +5,28 @@
 #include "common.h"
 #include "obj_thread.h"
 #include "compiler.h"
+#include "bytecode.h"
 #include "class.h"
 #include "utils.h"
 #include "obj_range.h"
 #include "unicodeUtf8.h"
+#include "numConv.h"
 #include "obj_list.h"
 #include "core.script.inc"
+#if CORE_SNAPSHOT
+    #include "core.snapshot.inc"
+#endif
 #include <time.h>
+#include <sys/time.h>
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
 #include <errno.h>
 #include "gc.h"
+#include "aot.h"
 
 char* rootDir  = NULL; // 根目录
+char* coreSnapshotPath = NULL; // 不为NULL时把编译后的核心模块导出为快照文件
 
 #define CORE_MODULE VT_TO_VALUE(VT_NULL)
 
@@ -62,23 +70,10 @@ char* rootDir  = NULL; // 根目录
     bindMethod(vm, classPtr, (uint32_t)globalIdx, method);\
 }
 
+// 数字转为能原样读回的最短字符串,nan和inf分别为nan和infinity
 static ObjString* num2Str(VM* vm, double num) {
-    // NaN不是一个确定的值,所以如果num!=num 就可以断定num是NaN
-    if (num != num) {
-        return newObjString(vm, "nan", 3);
-    }
-
-    if (num == INFINITY) {
-        return newObjString(vm, "infinity", 8);
-    }
-
-    if (num == -INFINITY) {
-        return newObjString(vm, "-infinity", 9);
-    }
-
-    // 双精度数字用24字节缓冲区足已容纳
-    char buf[24] = {'\0'};
-    int len = sprintf(buf, "%.14g", num);
+    char buf[NUM_CHARS_MAX];
+    uint32_t len = num2Chars(num, buf);
     return newObjString(vm, buf, len);
 }
 
@@ -112,14 +107,15 @@ static bool primNumFromString(VM* vm, Value* args) {
     errno = 0;
     char* endPtr;
     // 将字符串转化为double类型,它会自动跳过前面的空白
-    double num = strtod(objString->value.start, &endPtr);
+    double num = chars2Num(objString->value.start, &endPtr);
 
     while (*endPtr != '\0' && isspace((unsigned char)*endPtr)) {
         endPtr++;
     }
 
-    // 字符串过长strtod会修改errno的值,errno为全局定义的宏
-    if (errno == ERANGE) {
+    // 数值超出范围时strtod会修改errno的值,errno为全局定义的宏.
+    // 下溢时结果是非规格化数或0,仍能表示,只把上溢视为错误
+    if (errno == ERANGE && isinf(num)) {
         RUN_ERROR("string too large");
     }
 
@@ -149,9 +145,9 @@ PRIM_NUM_INFIX(primNumMinus, -, NUM);
 PRIM_NUM_INFIX(primNumMul, *, NUM);
 PRIM_NUM_INFIX(primNumDiv, /, NUM);
 PRIM_NUM_INFIX(primNumGt, >, BOOL);
-PRIM_NUM_INFIX(primNumGe, >=, NUM);
-PRIM_NUM_INFIX(primNumLt, <, NUM);
-PRIM_NUM_INFIX(primNumLe, <=, NUM);
+PRIM_NUM_INFIX(primNumGe, >=, BOOL);
+PRIM_NUM_INFIX(primNumLt, <, BOOL);
+PRIM_NUM_INFIX(primNumLe, <=, BOOL);
 #undef PRIM_NUM_INFIX
 
 #define PRIM_NUM_BIT(name, operator)\
@@ -318,12 +314,10 @@ static Value makeStringFromcodePoint(VM* vm, int value) {
     if (objString == NULL) {
         MEM_ERROR("allocate memory failed in runtime");
     }
-    initObjHeader(vm, &objString->objHeader, OT_STRING, vm->stringClass);
     objString->value.length = byteNum;
     objString->value.start[byteNum] = '\0';
     encodeUtf8((uint8_t*)objString->value.start, value);
-    hashObjString(objString);
-    return OBJ_TO_VALUE(objString);
+    return OBJ_TO_VALUE(internObjString(vm, objString));
 }
 
 // 用索引index处的字节创建字符串对象
@@ -363,7 +357,6 @@ static ObjString* newObjStringFromSub(VM* vm, ObjString* sourceStr, int startInd
     if (result == NULL) {
         MEM_ERROR("allocate memory failed in runtime!");
     }
-    initObjHeader(vm, &result->objHeader, OT_STRING, vm->stringClass);
     result->value.start[totalLength] = '\0';
     result->value.length = totalLength;
     
@@ -378,8 +371,7 @@ static ObjString* newObjStringFromSub(VM* vm, ObjString* sourceStr, int startInd
         }
         idx++;
     }
-    hashObjString(result);
-    return result;
+    return internObjString(vm, result);
 }
 
 // 使用Boyer-Moore-horpool字符串匹配算法在haystack中查找need
@@ -438,20 +430,41 @@ static bool primStringPlus(VM* vm, Value* args) {
     }
     ObjString* left = VALUE_TO_OBJSTR(args[0]);
     ObjString* right = VALUE_TO_OBJSTR(args[1]);
-    
-    uint32_t totalLength = strlen(left->value.start) + strlen(right->value.start);
-    ObjString* result = ALLOCATE_EXTRA(vm, ObjString, totalLength+1);
-    if (result == NULL) {
-        MEM_ERROR("allocate memory failed in runtime!");
+
+    StringBuilder builder;
+    stringBuilderInit(vm, &builder, left->value.length + right->value.length);
+    stringBuilderAppend(vm, &builder, left->value.start, left->value.length);
+    stringBuilderAppend(vm, &builder, right->value.start, right->value.length);
+    RET_OBJ(stringBuilderFinish(vm, &builder));
+}
+
+// objString*(_): 将字符串重复count次
+static bool primStringMultiply(VM* vm, Value* args) {
+    if (!VALUE_IS_NUM(args[1]) || VALUE_TO_NUM(args[1]) < 0 ||
+        trunc(VALUE_TO_NUM(args[1])) != VALUE_TO_NUM(args[1])) {
+        SET_ERROR_FALSE(vm, "Count must be a non-negative integer.");
+    }
+    ObjString* objString = VALUE_TO_OBJSTR(args[0]);
+    double count = VALUE_TO_NUM(args[1]);
+    // 先检查范围再转换,超出uint32_t(包括inf)的转换是未定义行为
+    if (count > UINT32_MAX) {
+        SET_ERROR_FALSE(vm, "Count is too large.");
+    }
+    if (count == 0 || objString->value.length == 0) {
+        RET_OBJ(newObjString(vm, "", 0));
+    }
+    if (count * objString->value.length > UINT32_MAX - 1) {
+        SET_ERROR_FALSE(vm, "result string is too long!");
     }
-    initObjHeader(vm, &result->objHeader, OT_STRING, vm->stringClass);
-    memcpy(result->value.start, left->value.start, strlen(left->value.start));
-    memcpy(result->value.start+strlen(left->value.start), right->value.start, strlen(right->value.start));
-    result->value.start[totalLength] = '\0';
-    result->value.length = totalLength;
 
-    hashObjString(result);
-    RET_OBJ(result);
+    uint32_t times = (uint32_t)count;
+    StringBuilder builder;
+    stringBuilderInit(vm, &builder, times * objString->value.length);
+    while (times > 0) {
+        stringBuilderAppend(vm, &builder, objString->value.start, objString->value.length);
+        times--;
+    }
+    RET_OBJ(stringBuilderFinish(vm, &builder));
 }
 
 // objString[_]:用数字或objRange对象做字符串的subscript
@@ -545,6 +558,47 @@ static bool primStringIndexOf(VM* vm UNUSED, Value* args) {
     RET_NUM(index);
 }
 
+// 把start开始的length个字节作为新字符串追加到objList
+static void listAddString(VM* vm, ObjList* objList, const char* start, uint32_t length) {
+    ObjString* objString = newObjString(vm, start, length);
+    // list扩容时可能触发回收
+    pushTmpRoot(vm, (ObjHeader*)objString);
+    ValueBufferAdd(vm, &objList->elements, OBJ_TO_VALUE(objString));
+    GC_WRITE_BARRIER(vm, objList, OBJ_TO_VALUE(objString));
+    popTmpRoot(vm);
+}
+
+// objString.split(_): 以args[1]为分隔符切分字符串,返回各片段组成的list
+static bool primStringSplit(VM* vm, Value* args) {
+    if (!validateString(vm, args[1])) {
+        return false;
+    }
+    ObjString* objString = VALUE_TO_OBJSTR(args[0]);
+    ObjString* sep = VALUE_TO_OBJSTR(args[1]);
+    if (sep->value.length == 0) {
+        SET_ERROR_FALSE(vm, "separator can't be empty!");
+    }
+    HandleScope scope = openHandleScope(vm);
+    ObjList* result = newObjList(vm, 0);
+    pushTmpRoot(vm, (ObjHeader*)result);
+
+    const char* pieceStart = objString->value.start;
+    const char* cur = pieceStart;
+    const char* end = pieceStart + objString->value.length;
+    while ((uint32_t)(end - cur) >= sep->value.length) {
+        if (*cur == sep->value.start[0] && memcmp(cur, sep->value.start, sep->value.length) == 0) {
+            listAddString(vm, result, pieceStart, cur - pieceStart);
+            cur += sep->value.length;
+            pieceStart = cur;
+        } else {
+            cur++;
+        }
+    }
+    listAddString(vm, result, pieceStart, end - pieceStart);
+    closeHandleScope(vm, scope);
+    RET_OBJ(result);
+}
+
 // objString.iterate(_):返回下一个utf-8字符串(不是字节)的迭代器
 static bool primStringIterate(VM* vm UNUSED, Value* args) {
     ObjString* objString = VALUE_TO_OBJSTR(args[0]);
@@ -656,13 +710,14 @@ static bool primListSubscript(VM* vm, Value* args) {
 }
 
 // objList[_]=(_): 值支持数字作为subscript
-static bool primListSubscriptSetter(VM* vm UNUSED, Value* args) {
+static bool primListSubscriptSetter(VM* vm, Value* args) {
     ObjList* objList = VALUE_TO_OBJLIST(args[0]);
     uint32_t index = validateIndex(vm, args[1], objList->elements.count);
     if (index == UINT32_MAX) {
         return false;
     }
     objList->elements.datas[index] = args[2];
+    GC_WRITE_BARRIER(vm, objList, args[2]);
     RET_VALUE(args[2]);
 }
 
@@ -670,6 +725,7 @@ static bool primListSubscriptSetter(VM* vm UNUSED, Value* args) {
 static bool primListAdd(VM* vm, Value* args) {
     ObjList* objList = VALUE_TO_OBJLIST(args[0]);
     ValueBufferAdd(vm, &objList->elements, args[1]);
+    GC_WRITE_BARRIER(vm, objList, args[1]);
     RET_VALUE(args[1]); // 参数作为返回值
 }
 
@@ -677,9 +733,48 @@ static bool primListAdd(VM* vm, Value* args) {
 static bool primListAddCore(VM* vm, Value* args) {
     ObjList* objList = VALUE_TO_OBJLIST(args[0]);
     ValueBufferAdd(vm, &objList->elements, args[1]);
+    GC_WRITE_BARRIER(vm, objList, args[1]);
     RET_VALUE(args[0]); // 返回自身
 }
 
+// objList.joinStrings_(_): 以sep连接全是字符串的list
+// 先算出总长度再一次写入,有非字符串元素时返回null,由脚本逐个调用toString
+static bool primListJoinStrings(VM* vm, Value* args) {
+    if (!validateString(vm, args[1])) {
+        return false;
+    }
+    ObjList* objList = VALUE_TO_OBJLIST(args[0]);
+    ObjString* sep = VALUE_TO_OBJSTR(args[1]);
+    uint64_t length = 0;
+    uint32_t idx = 0;
+    while (idx < objList->elements.count) {
+        if (!VALUE_IS_OBJSTR(objList->elements.datas[idx])) {
+            RET_NULL;
+        }
+        length += VALUE_TO_OBJSTR(objList->elements.datas[idx])->value.length;
+        if (idx > 0) {
+            length += sep->value.length;
+        }
+        idx++;
+    }
+    if (length > UINT32_MAX - 1) {
+        SET_ERROR_FALSE(vm, "result string is too long!");
+    }
+
+    StringBuilder builder;
+    stringBuilderInit(vm, &builder, (uint32_t)length);
+    idx = 0;
+    while (idx < objList->elements.count) {
+        if (idx > 0) {
+            stringBuilderAppend(vm, &builder, sep->value.start, sep->value.length);
+        }
+        ObjString* element = VALUE_TO_OBJSTR(objList->elements.datas[idx]);
+        stringBuilderAppend(vm, &builder, element->value.start, element->value.length);
+        idx++;
+    }
+    RET_OBJ(stringBuilderFinish(vm, &builder));
+}
+
 // objList.clear(): 清空list
 static bool primListClear(VM* vm, Value* args) {
     ObjList* objList = VALUE_TO_OBJLIST(args[0]);
@@ -844,7 +939,7 @@ static bool primMapIterate(VM* vm, Value* args) {
     while (index < objMap->capacity) {
         // entries十个数组,元素是哈希槽
         // 哈希值散布在这些槽中并不连续,因此逐个判断是否在用
-        if (!VALUE_IS_UNDEFINED(objMap->entries[index].key)) {
+        if (MAP_SLOT_IS_FULL(objMap, index)) {
             RET_NUM(index);
         }
         index++;
@@ -858,10 +953,10 @@ static bool primMapKeyIteratorValue(VM* vm, Value* args) {
     if (index == UINT32_MAX) {
         return false;
     }
-    Entry* entry = &objMap->entries[index];
-    if (VALUE_IS_UNDEFINED(entry->key)) {
+    if (!MAP_SLOT_IS_FULL(objMap, index)) {
         SET_ERROR_FALSE(vm, "invalid iterator!");
     }
+    Entry* entry = &objMap->entries[index];
     RET_VALUE(entry->key);
 }
 
@@ -873,10 +968,10 @@ static bool primMapValueIteratorValue(VM* vm, Value* args) {
     if (index == UINT32_MAX) {
         return false;
     }
-    Entry* entry = &objMap->entries[index];
-    if (VALUE_IS_UNDEFINED(entry->key)) {
+    if (!MAP_SLOT_IS_FULL(objMap, index)) {
         SET_ERROR_FALSE(vm, "invalid iterator!");
     }
+    Entry* entry = &objMap->entries[index];
     RET_VALUE(entry->value);
 
 }
@@ -954,13 +1049,6 @@ static char* getFilePath(const char* moduleName) {
     path[pathLength] = '\0';
     return path;
 }
-// 读取模块
-static char* readModule(const char* moduleName) {
-    char* modulePath = getFilePath(moduleName);
-    char* moduleCode = readFile(modulePath);
-    free(modulePath);
-    return moduleCode;
-}
 // 输出字符串
 static void printString(const char* str) {
     printf("%s", str);
@@ -970,14 +1058,15 @@ static void printString(const char* str) {
 // 从modules中获取名为moduleName的模块
 static ObjModule* getModule(VM* vm, Value moduleName) {
     Value value = mapGet(vm->allModules, moduleName);
-    if (value.type == VT_UNDEFINED) {
+    if (VALUE_IS_UNDEFINED(value)) {
         return NULL;
     }
-    return (ObjModule*)(value.objHeader);
+    return (ObjModule*)VALUE_TO_OBJ(value);
 }
 
 // 载入模块moduleName并编译
-static ObjThread* loadModule(VM* vm, Value moduleName, const char* moduleCode) {
+// modulePath是源码文件的路径,不为NULL时优先载入其字节码缓存
+static ObjThread* loadModule(VM* vm, Value moduleName, const char* moduleCode, const char* modulePath UNUSED) {
     // 确保模块已经载入到vm->allModules
     // 先查看是否已经导入了该模块，避免重新导入
     ObjModule* module = getModule(vm, moduleName);
@@ -987,8 +1076,11 @@ static ObjThread* loadModule(VM* vm, Value moduleName, const char* moduleCode) {
         // 创建模块并添加到vm->allModules
         ObjString* modName = VALUE_TO_OBJSTR(moduleName);
         ASSERT(modName->value.start[modName->value.length] == '\0', "string.value.start is not terminated!");
+        // 模块名可能只被调用方的局部变量引用,在录入allModules之前需保护起来
+        pushTmpRoot(vm, (ObjHeader*)modName);
         module = newObjModule(vm, modName->value.start);
         mapSet(vm, vm->allModules, moduleName, OBJ_TO_VALUE(module));
+        popTmpRoot(vm);
 
         // 继承核心模块中的变量
         ObjModule* coreModule = getModule(vm, CORE_MODULE);
@@ -1002,13 +1094,56 @@ static ObjThread* loadModule(VM* vm, Value moduleName, const char* moduleCode) {
         }
     }
 
-    ObjFn* fn = compileModule(vm, module, moduleCode);
+    ObjFn* fn = NULL;
+    bool isCoreModule = module->name == NULL;
+#if CORE_SNAPSHOT
+    if (isCoreModule && coreSnapshotPath == NULL) {
+        fn = loadBytecodeSnapshot(vm, module, coreSnapshot, sizeof(coreSnapshot), moduleCode);
+    }
+#endif
+#if BYTECODE_CACHE
+    if (modulePath != NULL) {
+        fn = loadBytecodeCache(vm, module, modulePath, moduleCode);
+    }
+#endif
+#if AOT
+    if (fn == NULL && !isCoreModule) {
+        fn = aotLoadModule(vm, module, moduleCode);
+    }
+#endif
+    if (fn == NULL) {
+        uint32_t moduleVarNumBefore UNUSED = module->moduleVarValue.count;
+        fn = compileModule(vm, module, moduleCode);
+        if (isCoreModule && coreSnapshotPath != NULL) {
+            dumpBytecodeSnapshot(vm, module, fn, moduleVarNumBefore, moduleCode, coreSnapshotPath);
+        }
+#if BYTECODE_CACHE
+        if (modulePath != NULL) {
+            saveBytecodeCache(vm, module, fn, moduleVarNumBefore, modulePath, moduleCode);
+        }
+#endif
+    }
+    pushTmpRoot(vm, (ObjHeader*)fn);
     ObjClosure* objClosure = newObjClosure(vm, fn);
+    popTmpRoot(vm);
+    pushTmpRoot(vm, (ObjHeader*)objClosure);
     ObjThread* moduleThread = newObjThread(vm, objClosure);
+    popTmpRoot(vm);
 
     return moduleThread;
 }
 
+#if AOT
+// 编译模块moduleName但不执行,为其生成c代码写入outputPath
+void compileModuleToC(VM* vm, Value moduleName, const char* moduleCode, const char* outputPath) {
+    ObjThread* moduleThread = loadModule(vm, moduleName, moduleCode, NULL);
+    ObjFn* fn = moduleThread->frames[0].closure->fn;
+    // 新模块继承了核心模块的全部变量,其后的都是编译时新增的
+    uint32_t moduleVarNumBefore = getModule(vm, CORE_MODULE)->moduleVarValue.count;
+    aotEmitModule(vm, fn->module, fn, moduleVarNumBefore, moduleCode, outputPath);
+}
+#endif
+
 // 导入模块moduleName,主要是编译模块加载到vm->allModules
 static Value importModule(VM* vm, Value moduleName) {
     // 若已经存在则返回null_val
@@ -1016,9 +1151,11 @@ static Value importModule(VM* vm, Value moduleName) {
         return VT_TO_VALUE(VT_NULL);
     }
     ObjString* objString = VALUE_TO_OBJSTR(moduleName);
-    const char* sourceCode = readModule(objString->value.start);
+    char* modulePath = getFilePath(objString->value.start);
+    const char* sourceCode = readFile(modulePath);
 
-    ObjThread* moduleThread = loadModule(vm, moduleName, sourceCode);
+    ObjThread* moduleThread = loadModule(vm, moduleName, sourceCode, modulePath);
+    free(modulePath);
     return OBJ_TO_VALUE(moduleThread);
 }
 // 在模块moduleName中获取模块变量variableName
@@ -1048,13 +1185,119 @@ static Value getModuleVariable(VM* vm, Value moduleName, Value variableName) {
 }
 // System.clock: 返回秒为单位的系统时钟
 static bool primSystemClock(VM* vm UNUSED, Value* args UNUSED) {
-    RET_NUM((double)time(NULL));
+    // 精确到微秒,便于在脚本中计时
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    RET_NUM((double)tv.tv_sec + tv.tv_usec / 1000000.0);
 }
 // System.gc()
 static bool primSystemGC(VM* vm, Value* args) {
     startGC(vm);
     RET_NULL;
 }
+// 向objMap中添加键为name的数字项
+static void mapSetNum(VM* vm, ObjMap* objMap, const char* name, double num) {
+    ObjString* key = newObjString(vm, name, strlen(name));
+    pushTmpRoot(vm, (ObjHeader*)key);
+    mapSet(vm, objMap, OBJ_TO_VALUE(key), NUM_TO_VALUE(num));
+    popTmpRoot(vm);
+}
+// System.inlineCacheStats: 返回方法调用点内联缓存的命中情况
+static bool primSystemInlineCacheStats(VM* vm, Value* args) {
+    ObjMap* stats = newObjMap(vm);
+    pushTmpRoot(vm, (ObjHeader*)stats);
+    uint64_t total = vm->inlineCacheHits + vm->inlineCacheMisses;
+    mapSetNum(vm, stats, "hits", (double)vm->inlineCacheHits);
+    mapSetNum(vm, stats, "misses", (double)vm->inlineCacheMisses);
+    mapSetNum(vm, stats, "hitRate", total == 0 ? 0 : (double)vm->inlineCacheHits / total);
+    popTmpRoot(vm);
+    RET_OBJ(stats);
+}
+// System.slabStats: 返回slab各大小类的占用情况,每个用过的大小类一个map
+static bool primSystemSlabStats(VM* vm, Value* args) {
+    ObjList* stats = newObjList(vm, 0);
+    pushTmpRoot(vm, (ObjHeader*)stats);
+    uint32_t idx = 0;
+    while (idx < SLAB_CLASS_NUM) {
+        SlabClass* slabClass = &vm->slab.classes[idx++];
+        if (slabClass->pageNum == 0) {
+            continue;
+        }
+        ObjMap* classStats = newObjMap(vm);
+        pushTmpRoot(vm, (ObjHeader*)classStats);
+        uint32_t slots = slabClass->pageNum * SLAB_SLOTS_PER_PAGE(slabClass->slotSize);
+        mapSetNum(vm, classStats, "size", slabClass->slotSize);
+        mapSetNum(vm, classStats, "pages", slabClass->pageNum);
+        mapSetNum(vm, classStats, "slots", slots);
+        mapSetNum(vm, classStats, "used", slabClass->usedSlots);
+        mapSetNum(vm, classStats, "occupancy", (double)slabClass->usedSlots / slots);
+        ValueBufferAdd(vm, &stats->elements, OBJ_TO_VALUE(classStats));
+        GC_WRITE_BARRIER(vm, stats, OBJ_TO_VALUE(classStats));
+        popTmpRoot(vm);
+    }
+    popTmpRoot(vm);
+    RET_OBJ(stats);
+}
+// 向objMap中添加键为name的对象项
+static void mapSetObj(VM* vm, ObjMap* objMap, const char* name, ObjHeader* obj) {
+    ObjString* key = newObjString(vm, name, strlen(name));
+    pushTmpRoot(vm, (ObjHeader*)key);
+    mapSet(vm, objMap, OBJ_TO_VALUE(key), OBJ_TO_VALUE(obj));
+    popTmpRoot(vm);
+}
+// System.memoryStats: 返回堆的使用和回收情况,types中按对象类型统计,时间单位是秒
+static bool primSystemMemoryStats(VM* vm, Value* args UNUSED) {
+    static const char* typeNames[OBJ_TYPE_NUM] = {
+        "Class", "List", "Map", "Module", "Range", "String",
+        "Upvalue", "Fn", "Closure", "Instance", "Thread"
+    };
+    MemoryStats memStats;
+    gcMemoryStats(vm, &memStats);
+
+    HandleScope scope = openHandleScope(vm);
+    ObjMap* stats = newObjMap(vm);
+    pushTmpRoot(vm, (ObjHeader*)stats);
+    mapSetNum(vm, stats, "heapBytes", (double)memStats.heapBytes);
+    mapSetNum(vm, stats, "nextGC", (double)memStats.nextGC);
+    mapSetNum(vm, stats, "liveBytes", (double)memStats.liveBytes);
+    mapSetNum(vm, stats, "gcCount", memStats.gcCount);
+    mapSetNum(vm, stats, "minorGCCount", memStats.minorGCCount);
+    mapSetNum(vm, stats, "totalPause", memStats.totalPauseNs / 1e9);
+    mapSetNum(vm, stats, "maxPause", memStats.maxPauseNs / 1e9);
+
+    ObjMap* types = newObjMap(vm);
+    pushTmpRoot(vm, (ObjHeader*)types);
+    mapSetObj(vm, stats, "types", (ObjHeader*)types);
+    uint32_t idx = 0;
+    while (idx < OBJ_TYPE_NUM) {
+        ObjMap* typeStats = newObjMap(vm);
+        pushTmpRoot(vm, (ObjHeader*)typeStats);
+        mapSetNum(vm, typeStats, "objects", (double)memStats.objectsByType[idx]);
+        mapSetNum(vm, typeStats, "liveObjects", (double)memStats.liveObjectsByType[idx]);
+        mapSetNum(vm, typeStats, "liveBytes", (double)memStats.liveBytesByType[idx]);
+        mapSetObj(vm, types, typeNames[idx], (ObjHeader*)typeStats);
+        popTmpRoot(vm);
+        idx++;
+    }
+    closeHandleScope(vm, scope);
+    RET_OBJ(stats);
+}
+// System.gcMarkThreads: 返回System.gc()中参与标记的线程数
+static bool primSystemGCMarkThreads(VM* vm, Value* args UNUSED) {
+    RET_NUM(vm->config.markThreads);
+}
+// System.gcMarkThreads=(_): 设置System.gc()中参与标记的线程数,超过GC_MARK_THREADS时取GC_MARK_THREADS
+static bool primSystemSetGCMarkThreads(VM* vm, Value* args) {
+    if (!validateInt(vm, args[1])) {
+        return false;
+    }
+    double threadNum = VALUE_TO_NUM(args[1]);
+    if (threadNum < 1) {
+        SET_ERROR_FALSE(vm, "thread number must be at least 1!");
+    }
+    vm->config.markThreads = threadNum > GC_MARK_THREADS ? GC_MARK_THREADS : (uint32_t)threadNum;
+    RET_NUM(vm->config.markThreads);
+}
 // System.importModule(_): 导入未编译模块args[1], 把模块挂载到vm->allModules
 static bool primSystemImportModule(VM* vm, Value* args) {
     // args[1]模块名
@@ -1251,7 +1494,7 @@ static bool primThreadIsDone(VM* vm UNUSED, Value* args) {
 static Class* defineClass(VM* vm, ObjModule* objModule, const char* name) {
     // 1. 先创建类
     Class* class = newRawClass(vm, name, 0);
-    // 2.把类作为普通变量在模块中定义
+    // 2.把类作为普通变量在模块中定义,defineModuleVar会保护class不被gc回收
     defineModuleVar(vm, objModule, name, strlen(name), OBJ_TO_VALUE(class));
     return class;
 }
@@ -1281,14 +1524,14 @@ static bool primObjectIs(VM* vm, Value* args) {
     }
 
     Class* thisClass = getClassOfObj(vm, args[0]);
-    Class* baseClass = (Class*)(args[1].objHeader);
+    Class* baseClass = VALUE_TO_CLASS(args[1]);
 
-    // 有可能多级继承，自上而下遍历
-    while (baseClass != NULL) {
+    // 有可能多级继承，自下而上遍历
+    while (thisClass != NULL) {
         if (thisClass == baseClass) {
             RET_VALUE(VT_TO_VALUE(VT_TRUE));
         }
-        baseClass = baseClass->superClass;
+        thisClass = thisClass->superClass;
     }
     // 若未找到基类，说明不具备is_a关系
     RET_VALUE(VT_TO_VALUE(VT_FALSE));
@@ -1296,7 +1539,7 @@ static bool primObjectIs(VM* vm, Value* args) {
 
 // args[0].tostring: 返回args[0]所属class的名字
 static bool primObjectToString(VM* vm UNUSED, Value* args) {
-    Class* class = args[0].objHeader->class;
+    Class* class = VALUE_TO_OBJ(args[0])->class;
     Value nameValue = OBJ_TO_VALUE(class->name);
     RET_VALUE(nameValue);
 }
@@ -1384,16 +1627,51 @@ char* readFile(const char* path) {
     return fileContent;
 }
 
+// 把datas中下标为index的符号登记到哈希索引
+static void symbolTableIndexInsert(SymbolTable* table, uint32_t index) {
+    String* string = &table->datas[index];
+    uint32_t mask = table->slotCapacity - 1;
+    uint32_t slot = hashString(string->str, string->length) & mask;
+    while (table->slots[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    table->slots[slot] = index;
+}
+
+// 以newCapacity个槽位重建哈希索引
+static void symbolTableReindex(VM* vm, SymbolTable* table, uint32_t newCapacity) {
+    DEALLOCATE_ARRAY(vm, table->slots, table->slotCapacity);
+    table->slots = ALLOCATE_ARRAY(vm, int, newCapacity);
+    table->slotCapacity = newCapacity;
+    memset(table->slots, -1, sizeof(int) * newCapacity);
+    uint32_t idx = 0;
+    while (idx < table->count) {
+        symbolTableIndexInsert(table, idx++);
+    }
+}
+
 // table中查找符号symbol, 找到后返回索引，否则返回-1
 int getIndexFromSymbolTable(SymbolTable* table, const char* symbol, uint32_t length) {
     ASSERT(length != 0, "length of symbol is 0!");
-    uint32_t index = 0;
-    while (index < table->count) {
-        if (length == table->datas[index].length &&
-            memcmp(table->datas[index].str, symbol, length) == 0) {
-                return index;
-            }
-            index++;
+    if (table->slotCapacity == 0) {
+        uint32_t index = 0;
+        while (index < table->count) {
+            if (length == table->datas[index].length &&
+                memcmp(table->datas[index].str, symbol, length) == 0) {
+                    return index;
+                }
+                index++;
+        }
+        return -1;
+    }
+    uint32_t mask = table->slotCapacity - 1;
+    uint32_t slot = hashString((char*)symbol, length) & mask;
+    while (table->slots[slot] != -1) {
+        String* string = &table->datas[table->slots[slot]];
+        if (length == string->length && memcmp(string->str, symbol, length) == 0) {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & mask;
     }
     return -1;
 }
@@ -1406,7 +1684,22 @@ int addSymbol(VM* vm, SymbolTable* table, const char* symbol, uint32_t length) {
     memcpy(string.str, symbol, length);
     string.str[length] = '\0';
     string.length = length;
-    StringBufferAdd(vm, table, string);
+    if (table->count >= table->capacity) {
+        uint32_t oldCapacity = table->capacity;
+        table->capacity = ceilToPowerOf2(table->count + 1);
+        table->datas = (String*)memManager(vm, table->datas,
+            sizeof(String) * oldCapacity, sizeof(String) * table->capacity);
+    }
+    table->datas[table->count++] = string;
+
+    // 哈希索引的装载因子保持在0.5以下
+    if (table->count > SYMBOL_TABLE_INDEX_MIN) {
+        if (table->count * 2 > table->slotCapacity) {
+            symbolTableReindex(vm, table, ceilToPowerOf2(table->count * 4));
+        } else {
+            symbolTableIndexInsert(table, table->count - 1);
+        }
+    }
     return table->count - 1;
 }
 
@@ -1418,23 +1711,28 @@ int ensureSymbolExist(VM* vm, SymbolTable* table, const char* symbol, uint32_t l
     return symbolIndex;
 }
 
-// 使class->methods[index]=method
+// 使class的方法表中索引为index的方法为method
 void bindMethod(VM* vm, Class* class, uint32_t index, Method method) {
-    if (index >= class->methods.count) {
-        Method emptyPad = {MT_NONE, {0}};
-        MethodBufferFillWrite(vm, &class->methods, emptyPad, index-class->methods.count + 1);
+    methodTableSet(vm, &class->methods, index, method);
+    if (method.type == MT_SCRIPT) {
+        GC_WRITE_BARRIER(vm, class, OBJ_TO_VALUE(method.obj));
     }
-    class->methods.datas[index] = method;
+    // 调用点可能缓存了该类原来的方法
+    vm->methodEpoch++;
 }
 // 绑定基类
 void bindSuperClass(VM* vm, Class* subClass, Class* superClass) {
     subClass->superClass = superClass;
+    GC_WRITE_BARRIER(vm, subClass, OBJ_TO_VALUE(superClass));
     // 继承基类属性数
     subClass->fieldNum += superClass->fieldNum;
     //继承基类方法
     uint32_t idx = 0;
-    while (idx < superClass->methods.count) {
-        bindMethod(vm, subClass, idx, superClass->methods.datas[idx]);
+    while (idx < superClass->methods.capacity) {
+        MethodEntry* entry = &superClass->methods.entries[idx];
+        if (entry->index != EMPTY_METHOD_INDEX) {
+            bindMethod(vm, subClass, entry->index, entry->method);
+        }
         idx++;
     }
 }
@@ -1483,7 +1781,7 @@ void buildCore(VM* vm) {
     vm->classOfClass->objHeader.class = vm->classOfClass; // 元信息类回路，meta类终点
 
     
-    executeModule(vm, CORE_MODULE, coreModuleCode);
+    executeModule(vm, CORE_MODULE, coreModuleCode, NULL);
 
     vm->boolClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Bool"));
     PRIM_METHOD_BIND(vm->boolClass, "toString", primBoolToString);
@@ -1500,9 +1798,9 @@ void buildCore(VM* vm) {
     PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "yield()", primThreadYieldWithoutArg);
     
     // 以下是实例方法
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "call()", primThreadCallWithoutArg);
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "call(_)", primThreadCallWithArg);
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "isDone", primThreadIsDone);
+    PRIM_METHOD_BIND(vm->threadClass, "call()", primThreadCallWithoutArg);
+    PRIM_METHOD_BIND(vm->threadClass, "call(_)", primThreadCallWithArg);
+    PRIM_METHOD_BIND(vm->threadClass, "isDone", primThreadIsDone);
 
     // 绑定函数类
     vm->fnClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Fn"));
@@ -1534,8 +1832,8 @@ void buildCore(VM* vm) {
 
     vm->numberClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Num"));
     // 类方法
-    PRIM_METHOD_BIND(vm->numberClass, "fromString(_)", primNumFromString);
-    PRIM_METHOD_BIND(vm->numberClass, "pi", primNumPi);
+    PRIM_METHOD_BIND(vm->numberClass->objHeader.class, "fromString(_)", primNumFromString);
+    PRIM_METHOD_BIND(vm->numberClass->objHeader.class, "pi", primNumPi);
     // 实例方法
     PRIM_METHOD_BIND(vm->numberClass, "+(_)", primNumPlus);
     PRIM_METHOD_BIND(vm->numberClass, "-(_)", primNumMinus);
@@ -1584,6 +1882,7 @@ void buildCore(VM* vm) {
     PRIM_METHOD_BIND(vm->stringClass->objHeader.class, "fromCodePoint(_)", primStringFromCodePoint);
     // 实例方法
     PRIM_METHOD_BIND(vm->stringClass, "+(_)", primStringPlus);
+    PRIM_METHOD_BIND(vm->stringClass, "*(_)", primStringMultiply);
     PRIM_METHOD_BIND(vm->stringClass, "[_]", primStringSubscript);
     PRIM_METHOD_BIND(vm->stringClass, "byteAt_(_)", primStringByteAt);
     PRIM_METHOD_BIND(vm->stringClass, "byteCount_", primStringByteCount);
@@ -1594,6 +1893,7 @@ void buildCore(VM* vm) {
     PRIM_METHOD_BIND(vm->stringClass, "iterate(_)", primStringIterate);
     PRIM_METHOD_BIND(vm->stringClass, "iterateByte_(_)", primStringIterateByte);
     PRIM_METHOD_BIND(vm->stringClass, "iterateValue_(_)", primStringIteratorValue);
+    PRIM_METHOD_BIND(vm->stringClass, "split(_)", primStringSplit);
     PRIM_METHOD_BIND(vm->stringClass, "startsWith(_)", primStringStartsWith);
     PRIM_METHOD_BIND(vm->stringClass, "toString", primStringToString);
     PRIM_METHOD_BIND(vm->stringClass, "count", primStringByteCount);
@@ -1606,6 +1906,7 @@ void buildCore(VM* vm) {
     PRIM_METHOD_BIND(vm->listClass, "add(_)", primListAdd);
     PRIM_METHOD_BIND(vm->listClass, "addCore_(_)", primListAddCore);
     PRIM_METHOD_BIND(vm->listClass, "clear()", primListClear);
+    PRIM_METHOD_BIND(vm->listClass, "joinStrings_(_)", primListJoinStrings);
     PRIM_METHOD_BIND(vm->listClass, "count()", primListCount);
     PRIM_METHOD_BIND(vm->listClass, "insert(_,_)", primListInsert);
     PRIM_METHOD_BIND(vm->listClass, "iterate(_)", primListIterate);
@@ -1639,23 +1940,23 @@ void buildCore(VM* vm) {
     Class* systemClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "System"));
     PRIM_METHOD_BIND(systemClass->objHeader.class, "clock", primSystemClock);
     PRIM_METHOD_BIND(systemClass->objHeader.class, "gc()", primSystemGC);
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "inlineCacheStats", primSystemInlineCacheStats);
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "slabStats", primSystemSlabStats);
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "memoryStats", primSystemMemoryStats);
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "gcMarkThreads", primSystemGCMarkThreads);
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "gcMarkThreads=(_)", primSystemSetGCMarkThreads);
     PRIM_METHOD_BIND(systemClass->objHeader.class, "importModule(_)", primSystemImportModule);
     PRIM_METHOD_BIND(systemClass->objHeader.class, "getModuleVariable(_,_)", primSystemGetModuleVariable);
     PRIM_METHOD_BIND(systemClass->objHeader.class, "writeString_(_)", primSystemWriteString);
 
     // 核心自举过程中穿件了很多ObjString对象,创建过程中调用initObjHeader初始化对象头
     // 使其class指向vm->stringClass,但那时vm->stringClass未初始化,现在更正
-    ObjHeader* objHeader = vm->allObjects;
-    while (objHeader != NULL) {
-        if (objHeader->type == OT_STRING) {
-            objHeader->class = vm->stringClass;
-        }
-        objHeader = objHeader->next;
-    }
+    // 所有字符串都登记在驻留表中,只需遍历驻留表而不必遍历整个堆
+    stringTableSetClass(&vm->stringTable, vm->stringClass);
 }
 
-// 执行模块
-VMResult executeModule(VM* vm, Value moduleName, const char* moduleCode) {
-    ObjThread* objThread = loadModule(vm, moduleName, moduleCode);
+// 执行模块, modulePath是源码文件的路径,没有源码文件时为NULL
+VMResult executeModule(VM* vm, Value moduleName, const char* moduleCode, const char* modulePath) {
+    ObjThread* objThread = loadModule(vm, moduleName, moduleCode, modulePath);
     return executeInstruction(vm, objThread);
 }
\ No newline at end of file
@@ -0,0 +1,1021 @@
+#include "jit.h"
+#if JIT
+#if !defined(__x86_64__) || !defined(__linux__)
+    #error "JIT only supports x86-64 Linux"
+#endif
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "compiler.h"
+#include "peephole.h"
+#include "gc.h"
+#include "obj_range.h"
+
+// x86-64寄存器编号
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+#define XMM0 0
+#define XMM1 1
+
+// 机器码中各callee-saved寄存器的固定用途,调用c函数后不必恢复
+#define REG_ESP RBX // 运行时栈顶,调用c函数前写回thread->esp
+#define REG_STACK_START R12 // frame->stackStart
+#define REG_THREAD R13
+#define REG_VM R14
+#define REG_FRAME R15
+#define REG_QNAN RBP // NaN-boxing模式下存放QNAN,用于判断值的类型
+
+// 条件码,用于jcc和setcc
+#define CC_ALWAYS (-1)
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_GE 0xd
+#define CC_P 0xa
+#define CC_NP 0xb
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#if NAN_BOXING
+    #define PAYLOAD 0 // 数字和对象指针在值中的偏移
+#else
+    #define PAYLOAD ((int32_t)offsetof(Value, num))
+#endif
+
+// 对象头中回收标志和对象类型所在的字节
+#if COMPACT_OBJ_HEADER
+    #define OBJ_FLAGS_OFFSET ((int32_t)offsetof(ObjHeader, meta) + OBJ_FLAG_SHIFT / 8)
+    #define OBJ_TYPE_OFFSET ((int32_t)offsetof(ObjHeader, meta) + OBJ_TYPE_SHIFT / 8)
+#else
+    #define OBJ_FLAGS_OFFSET ((int32_t)offsetof(ObjHeader, flags))
+    #define OBJ_TYPE_OFFSET ((int32_t)offsetof(ObjHeader, type))
+#endif
+
+typedef struct {
+    uint32_t pos; // 机器码中rel32的位置
+    uint32_t target; // 跳转目标指令在instrStream中的偏移
+} JitFixup;
+
+// 一条指令中跳到同一处的多个向前跳转
+typedef struct {
+    uint32_t pos[8];
+    uint32_t num;
+} JumpList;
+
+typedef struct {
+    ObjFn* fn;
+    uint8_t* code;
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t* entries;
+    JitFixup* fixups; // 跳到其它指令的跳转,所有指令翻译完后回填
+    uint32_t fixupNum;
+    uint32_t fixupCapacity;
+    uint32_t exitLabel; // 保存ip和栈顶后退回到解释器
+    uint32_t leaveLabel; // 以eax为结果返回到jitExecute
+    uint32_t dispatchLabel; // 调用或返回后转到新的当前frame的机器码
+} JitBuilder;
+
+static void emitByte(JitBuilder* b, uint8_t byte) {
+    if (b->length == b->capacity) {
+        b->capacity = b->capacity == 0 ? 1024 : b->capacity * 2;
+        b->code = (uint8_t*)realloc(b->code, b->capacity);
+        if (b->code == NULL) {
+            MEM_ERROR("allocate jit buffer failed!");
+        }
+    }
+    b->code[b->length++] = byte;
+}
+
+static void emitInt32(JitBuilder* b, int32_t value) {
+    uint32_t bits = (uint32_t)value;
+    emitByte(b, bits & 0xff);
+    emitByte(b, (bits >> 8) & 0xff);
+    emitByte(b, (bits >> 16) & 0xff);
+    emitByte(b, bits >> 24);
+}
+
+static void emitInt64(JitBuilder* b, uint64_t value) {
+    emitInt32(b, (int32_t)(uint32_t)value);
+    emitInt32(b, (int32_t)(uint32_t)(value >> 32));
+}
+
+static void patchInt32(JitBuilder* b, uint32_t pos, int32_t value) {
+    memcpy(b->code + pos, &value, sizeof(int32_t));
+}
+
+// REX前缀,w表示64位操作数,不需要时省略
+static void emitRex(JitBuilder* b, bool w, int reg, int base) {
+    uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40) {
+        emitByte(b, rex);
+    }
+}
+
+// [base+disp]形式的内存操作数,reg是ModRM的reg字段
+static void emitModRM(JitBuilder* b, int reg, int base, int32_t disp) {
+    int mod = 2;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    }
+    emitByte(b, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emitByte(b, 0x24);
+    }
+    if (mod == 1) {
+        emitByte(b, (uint8_t)disp);
+    } else if (mod == 2) {
+        emitInt32(b, disp);
+    }
+}
+
+// 以[base+disp]为操作数的指令,prefix是0xf2等强制前缀,为0时没有,
+// opcode大于0xff时是0x0f开头的两字节操作码
+static void emitMemOp(JitBuilder* b, uint8_t prefix, bool w, uint32_t opcode, int reg, int base, int32_t disp) {
+    if (prefix != 0) {
+        emitByte(b, prefix);
+    }
+    emitRex(b, w, reg, base);
+    if (opcode > 0xff) {
+        emitByte(b, opcode >> 8);
+    }
+    emitByte(b, opcode & 0xff);
+    emitModRM(b, reg, base, disp);
+}
+
+// 两个操作数都是寄存器的指令
+static void emitRegOp(JitBuilder* b, bool w, uint8_t opcode, int reg, int rm) {
+    emitRex(b, w, reg, rm);
+    emitByte(b, opcode);
+    emitByte(b, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// 寄存器与8位立即数运算,ext是ModRM的reg字段: 0 add, 4 and, 5 sub, 7 cmp
+static void emitRegImm8(JitBuilder* b, bool w, int ext, int reg, int8_t imm) {
+    emitRex(b, w, 0, reg);
+    emitByte(b, 0x83);
+    emitByte(b, 0xc0 | (ext << 3) | (reg & 7));
+    emitByte(b, (uint8_t)imm);
+}
+
+static void emitLoad(JitBuilder* b, int reg, int base, int32_t disp) {
+    emitMemOp(b, 0, true, 0x8b, reg, base, disp);
+}
+
+static void emitStore(JitBuilder* b, int base, int32_t disp, int reg) {
+    emitMemOp(b, 0, true, 0x89, reg, base, disp);
+}
+
+static void emitMovImm64(JitBuilder* b, int reg, uint64_t imm) {
+    emitRex(b, true, 0, reg);
+    emitByte(b, 0xb8 + (reg & 7));
+    emitInt64(b, imm);
+}
+
+static void emitAddEsp(JitBuilder* b, int32_t slots) {
+    emitRegImm8(b, true, 0, REG_ESP, (int8_t)(slots * VALUE_SIZE));
+}
+
+static void emitCallC(JitBuilder* b, void* fnPtr) {
+    emitMovImm64(b, RAX, (uint64_t)(uintptr_t)fnPtr);
+    emitByte(b, 0xff);
+    emitByte(b, 0xd0);
+}
+
+// 跳到机器码中已生成的位置
+static void emitJumpTo(JitBuilder* b, int cc, uint32_t label) {
+    if (cc == CC_ALWAYS) {
+        emitByte(b, 0xe9);
+    } else {
+        emitByte(b, 0x0f);
+        emitByte(b, 0x80 | cc);
+    }
+    emitInt32(b, (int32_t)(label - (b->length + 4)));
+}
+
+// 向前跳转,返回rel32的位置,由patchJump回填为当前位置
+static uint32_t emitForwardJump(JitBuilder* b, int cc) {
+    emitJumpTo(b, cc, b->length);
+    return b->length - 4;
+}
+
+static void patchJump(JitBuilder* b, uint32_t pos) {
+    patchInt32(b, pos, (int32_t)(b->length - (pos + 4)));
+}
+
+static void addJump(JumpList* list, uint32_t pos) {
+    ASSERT(list->num < 8, "too many jumps!");
+    list->pos[list->num++] = pos;
+}
+
+static void patchJumps(JitBuilder* b, JumpList* list) {
+    uint32_t idx = 0;
+    while (idx < list->num) {
+        patchJump(b, list->pos[idx++]);
+    }
+}
+
+// 跳到instrStream中偏移为target的指令
+static void emitJumpToInstr(JitBuilder* b, int cc, uint32_t target) {
+    if (b->fixupNum == b->fixupCapacity) {
+        b->fixupCapacity = b->fixupCapacity == 0 ? 64 : b->fixupCapacity * 2;
+        b->fixups = (JitFixup*)realloc(b->fixups, b->fixupCapacity * sizeof(JitFixup));
+        if (b->fixups == NULL) {
+            MEM_ERROR("allocate jit fixups failed!");
+        }
+    }
+    emitJumpTo(b, cc, b->length);
+    b->fixups[b->fixupNum].pos = b->length - 4;
+    b->fixups[b->fixupNum].target = target;
+    b->fixupNum++;
+}
+
+// 把[src+srcDisp]处的值复制到[dst+dstDisp]
+static void emitCopyValue(JitBuilder* b, int dst, int32_t dstDisp, int src, int32_t srcDisp) {
+#if NAN_BOXING
+    emitLoad(b, RAX, src, srcDisp);
+    emitStore(b, dst, dstDisp, RAX);
+#else
+    // 值总是按两个8字节读写,与c代码复制值的方式一致.
+    // 读取的范围跨过多次写入时无法从store buffer直接取得,须等待写入完成
+    emitLoad(b, RAX, src, srcDisp);
+    emitLoad(b, RDX, src, srcDisp + PAYLOAD);
+    emitStore(b, dst, dstDisp, RAX);
+    emitStore(b, dst, dstDisp + PAYLOAD, RDX);
+#endif
+}
+
+static void emitPushValue(JitBuilder* b, int src, int32_t disp) {
+    emitCopyValue(b, REG_ESP, 0, src, disp);
+    emitAddEsp(b, 1);
+}
+
+static void emitPushSingleton(JitBuilder* b, ValueType type) {
+#if NAN_BOXING
+    emitMovImm64(b, RAX, QNAN | type);
+    emitStore(b, REG_ESP, 0, RAX);
+#else
+    emitMemOp(b, 0, true, 0xc7, 0, REG_ESP, 0);
+    emitInt32(b, type);
+    emitMemOp(b, 0, true, 0xc7, 0, REG_ESP, PAYLOAD);
+    emitInt32(b, 0);
+#endif
+    emitAddEsp(b, 1);
+}
+
+// 取出[base+disp]处的值所指的对象
+static void emitLoadObj(JitBuilder* b, int reg, int base, int32_t disp) {
+#if NAN_BOXING
+    // 清除高14位的QNAN和符号位
+    emitLoad(b, reg, base, disp);
+    emitRex(b, true, 0, reg);
+    emitByte(b, 0xc1);
+    emitByte(b, 0xe0 | (reg & 7));
+    emitByte(b, 14);
+    emitRex(b, true, 0, reg);
+    emitByte(b, 0xc1);
+    emitByte(b, 0xe8 | (reg & 7));
+    emitByte(b, 14);
+#else
+    emitLoad(b, reg, base, disp + PAYLOAD);
+#endif
+}
+
+// [base+disp]处的值不是数字时跳转
+static uint32_t emitJumpIfNotNum(JitBuilder* b, int base, int32_t disp) {
+#if NAN_BOXING
+    emitLoad(b, RAX, base, disp);
+    emitRegOp(b, true, 0x21, REG_QNAN, RAX); // and rax, rbp
+    emitRegOp(b, true, 0x39, REG_QNAN, RAX); // cmp rax, rbp
+    return emitForwardJump(b, CC_E);
+#else
+    emitMemOp(b, 0, false, 0x83, 7, base, disp);
+    emitByte(b, VT_NUM);
+    return emitForwardJump(b, CC_NE);
+#endif
+}
+
+// [base+disp]处的值不是对象时跳转
+static uint32_t emitJumpIfNotObj(JitBuilder* b, int base, int32_t disp) {
+#if NAN_BOXING
+    emitLoad(b, RAX, base, disp);
+    emitMovImm64(b, RCX, QNAN | SIGN_BIT);
+    emitRegOp(b, true, 0x21, RCX, RAX); // and rax, rcx
+    emitRegOp(b, true, 0x39, RCX, RAX); // cmp rax, rcx
+#else
+    emitMemOp(b, 0, false, 0x83, 7, base, disp);
+    emitByte(b, VT_OBJ);
+#endif
+    return emitForwardJump(b, CC_NE);
+}
+
+// 比较[base+disp]处的值,之后以CC_BE跳转即是值为null或false时跳转
+static void emitTestFalsy(JitBuilder* b, int base, int32_t disp) {
+#if NAN_BOXING
+    emitLoad(b, RAX, base, disp);
+    emitRegOp(b, true, 0x29, REG_QNAN, RAX); // sub rax, rbp
+    emitRegImm8(b, true, 5, RAX, VT_NULL);
+    emitRegImm8(b, true, 7, RAX, VT_FALSE - VT_NULL);
+#else
+    emitMemOp(b, 0, false, 0x8b, RAX, base, disp);
+    emitRegImm8(b, false, 5, RAX, VT_NULL);
+    emitRegImm8(b, false, 7, RAX, VT_FALSE - VT_NULL);
+#endif
+}
+
+// 按al的值把true或false存入[base+disp]
+static void emitStoreBool(JitBuilder* b, int base, int32_t disp) {
+    // movzx eax, al
+    emitByte(b, 0x0f);
+    emitByte(b, 0xb6);
+    emitByte(b, 0xc0);
+#if NAN_BOXING
+    // lea rax, [rbp+rax+VT_FALSE]
+    emitByte(b, 0x48);
+    emitByte(b, 0x8d);
+    emitByte(b, 0x44);
+    emitByte(b, 0x05);
+    emitByte(b, VT_FALSE);
+    emitStore(b, base, disp, RAX);
+#else
+    emitRegImm8(b, false, 0, RAX, VT_FALSE);
+    emitStore(b, base, disp, RAX);
+    emitMemOp(b, 0, true, 0xc7, 0, base, disp + PAYLOAD);
+    emitInt32(b, 0);
+#endif
+}
+
+static void emitSetcc(JitBuilder* b, int cc, int reg) {
+    emitByte(b, 0x0f);
+    emitByte(b, 0x90 | cc);
+    emitByte(b, 0xc0 | reg);
+}
+
+// 比较栈顶两个数字,结果存入al
+static void emitCompare(JitBuilder* b, OpCode opCode) {
+    int32_t left = -2 * VALUE_SIZE + PAYLOAD;
+    int32_t right = -VALUE_SIZE + PAYLOAD;
+    // 小于和小于等于交换操作数,与大于和大于等于一样都用CF和ZF判断,操作数含NaN时结果为false
+    if (opCode == OPCODE_LESS || opCode == OPCODE_LESS_EQUAL) {
+        int32_t tmp = left;
+        left = right;
+        right = tmp;
+    }
+    emitMemOp(b, 0xf2, false, 0x0f10, XMM0, REG_ESP, left); // movsd
+    emitMemOp(b, 0x66, false, 0x0f2e, XMM0, REG_ESP, right); // ucomisd
+    switch (opCode) {
+        case OPCODE_GREATER:
+        case OPCODE_LESS:
+            emitSetcc(b, CC_A, RAX);
+            break;
+        case OPCODE_GREATER_EQUAL:
+        case OPCODE_LESS_EQUAL:
+            emitSetcc(b, CC_AE, RAX);
+            break;
+        case OPCODE_EQUAL:
+            // 相等且不是无序
+            emitSetcc(b, CC_E, RAX);
+            emitSetcc(b, CC_NP, RCX);
+            emitRegOp(b, false, 0x20, RCX, RAX); // and al, cl
+            break;
+        case OPCODE_NOT_EQUAL:
+            emitSetcc(b, CC_NE, RAX);
+            emitSetcc(b, CC_P, RCX);
+            emitRegOp(b, false, 0x08, RCX, RAX); // or al, cl
+            break;
+        default:
+            NOT_REACHED();
+    }
+}
+
+// 栈顶两个数字的算术运算,结果存入次栈顶
+static void emitArith(JitBuilder* b, OpCode opCode) {
+    int32_t left = -2 * VALUE_SIZE + PAYLOAD;
+    int32_t right = -VALUE_SIZE + PAYLOAD;
+    emitMemOp(b, 0xf2, false, 0x0f10, XMM0, REG_ESP, left);
+    switch (opCode) {
+        case OPCODE_ADD:
+            emitMemOp(b, 0xf2, false, 0x0f58, XMM0, REG_ESP, right);
+            break;
+        case OPCODE_SUB:
+            emitMemOp(b, 0xf2, false, 0x0f5c, XMM0, REG_ESP, right);
+            break;
+        case OPCODE_MUL:
+            emitMemOp(b, 0xf2, false, 0x0f59, XMM0, REG_ESP, right);
+            break;
+        case OPCODE_DIV:
+            emitMemOp(b, 0xf2, false, 0x0f5e, XMM0, REG_ESP, right);
+            break;
+        case OPCODE_MOD:
+            emitMemOp(b, 0xf2, false, 0x0f10, XMM1, REG_ESP, right);
+            emitCallC(b, (void*)fmod);
+            break;
+        default:
+            NOT_REACHED();
+    }
+    emitMemOp(b, 0xf2, false, 0x0f11, XMM0, REG_ESP, left);
+}
+
+// 写屏障不能省略时跳到slow: 正在标记,或分代回收模式下对象已在老年代
+static void emitBarrierCheck(JitBuilder* b, UNUSED int objReg, JumpList* slow) {
+    emitMemOp(b, 0, false, 0x83, 7, REG_VM, (int32_t)offsetof(VM, gcPhase));
+    emitByte(b, GC_PHASE_MARK);
+    addJump(slow, emitForwardJump(b, CC_E));
+#if GC_GENERATIONAL
+    emitMemOp(b, 0, false, 0xf6, 0, objReg, OBJ_FLAGS_OFFSET); // test byte
+    emitByte(b, OBJ_FLAG_OLD);
+    addJump(slow, emitForwardJump(b, CC_NE));
+#endif
+}
+
+// 调用nativeSlowPath执行偏移为offset的指令,调用前后同步栈顶,结果在eax中
+static void emitSlowPath(JitBuilder* b, uint32_t offset) {
+    emitStore(b, REG_THREAD, (int32_t)offsetof(ObjThread, esp), REG_ESP);
+    emitRegOp(b, true, 0x89, REG_VM, RDI);
+    emitRegOp(b, true, 0x89, REG_THREAD, RSI);
+    emitRegOp(b, true, 0x89, REG_FRAME, RDX);
+    emitMovImm64(b, RCX, (uint64_t)(uintptr_t)(b->fn->instrStream.datas + offset));
+    emitCallC(b, (void*)nativeSlowPath);
+    emitLoad(b, REG_ESP, REG_THREAD, (int32_t)offsetof(ObjThread, esp));
+}
+
+// 结果不是NATIVE_CONTINUE时转到dispatchLabel
+static void emitDispatchUnlessContinue(JitBuilder* b) {
+    emitRegOp(b, false, 0x85, RAX, RAX); // test eax, eax
+    emitJumpTo(b, CC_NE, b->dispatchLabel);
+}
+
+// 从偏移为offset的指令起退回到解释器
+static void emitExit(JitBuilder* b, uint32_t offset) {
+    emitMovImm64(b, RAX, (uint64_t)(uintptr_t)(b->fn->instrStream.datas + offset));
+    emitJumpTo(b, CC_ALWAYS, b->exitLabel);
+}
+
+// 机器码的开头: 入口由jitExecute以第4个参数传入
+// 函数原型为int code(VM* vm, ObjThread* thread, Frame* frame, uint8_t* entry)
+static void emitPrologue(JitBuilder* b) {
+    emitByte(b, 0x55); // push rbp
+    emitByte(b, 0x53); // push rbx
+    emitByte(b, 0x41); emitByte(b, 0x54); // push r12
+    emitByte(b, 0x41); emitByte(b, 0x55); // push r13
+    emitByte(b, 0x41); emitByte(b, 0x56); // push r14
+    emitByte(b, 0x41); emitByte(b, 0x57); // push r15
+    // 使调用c函数时栈按16字节对齐
+    emitRegImm8(b, true, 5, RSP, 8);
+    emitRegOp(b, true, 0x89, RDI, REG_VM);
+    emitRegOp(b, true, 0x89, RSI, REG_THREAD);
+    emitRegOp(b, true, 0x89, RDX, REG_FRAME);
+    emitLoad(b, REG_ESP, REG_THREAD, (int32_t)offsetof(ObjThread, esp));
+    emitLoad(b, REG_STACK_START, REG_FRAME, (int32_t)offsetof(Frame, stackStart));
+#if NAN_BOXING
+    emitMovImm64(b, REG_QNAN, QNAN);
+#endif
+    emitByte(b, 0xff); // jmp rcx
+    emitByte(b, 0xe1);
+
+    // 退回到解释器: rax是继续执行的ip
+    b->exitLabel = b->length;
+    emitStore(b, REG_FRAME, (int32_t)offsetof(Frame, ip), RAX);
+    emitStore(b, REG_THREAD, (int32_t)offsetof(ObjThread, esp), REG_ESP);
+    emitByte(b, 0xb8); // mov eax, NATIVE_EXIT
+    emitInt32(b, NATIVE_EXIT);
+
+    b->leaveLabel = b->length;
+    emitRegImm8(b, true, 0, RSP, 8);
+    emitByte(b, 0x41); emitByte(b, 0x5f); // pop r15
+    emitByte(b, 0x41); emitByte(b, 0x5e); // pop r14
+    emitByte(b, 0x41); emitByte(b, 0x5d); // pop r13
+    emitByte(b, 0x41); emitByte(b, 0x5c); // pop r12
+    emitByte(b, 0x5b); // pop rbx
+    emitByte(b, 0x5d); // pop rbp
+    emitByte(b, 0xc3); // ret
+
+    // 调用或返回后当前frame已改变,其函数已编译时直接跳到frame->ip处的机器码,
+    // 不必返回jitExecute,否则以eax为结果返回.
+    // 所有函数的机器码寄存器用法相同,因此可以直接跳入
+    b->dispatchLabel = b->length;
+    emitRegImm8(b, false, 7, RAX, NATIVE_PRIMITIVE_FAILED);
+    emitJumpTo(b, CC_AE, b->leaveLabel);
+    emitRegOp(b, false, 0x89, RAX, RDI); // mov edi, eax
+    // r15 = &thread->frames[thread->usedFrameNum - 1]
+    emitMemOp(b, 0, false, 0x8b, RAX, REG_THREAD, (int32_t)offsetof(ObjThread, usedFrameNum));
+    emitRegImm8(b, false, 5, RAX, 1);
+    emitByte(b, 0x48); // imul rax, rax, sizeof(Frame)
+    emitByte(b, 0x6b);
+    emitByte(b, 0xc0);
+    emitByte(b, sizeof(Frame));
+    emitMemOp(b, 0, true, 0x03, RAX, REG_THREAD, (int32_t)offsetof(ObjThread, frames));
+    emitRegOp(b, true, 0x89, RAX, REG_FRAME);
+    emitLoad(b, RCX, REG_FRAME, (int32_t)offsetof(Frame, closure));
+    emitLoad(b, RCX, RCX, (int32_t)offsetof(ObjClosure, fn));
+    emitLoad(b, RDX, RCX, (int32_t)offsetof(ObjFn, jitCode));
+    emitRegOp(b, true, 0x85, RDX, RDX); // test rdx, rdx
+    uint32_t notCompiled = emitForwardJump(b, CC_E);
+    // rdx += fn->jitEntries[frame->ip - fn->instrStream.datas]
+    emitLoad(b, RAX, REG_FRAME, (int32_t)offsetof(Frame, ip));
+    emitMemOp(b, 0, true, 0x2b, RAX, RCX, (int32_t)offsetof(ObjFn, instrStream.datas));
+    emitLoad(b, RSI, RCX, (int32_t)offsetof(ObjFn, jitEntries));
+    emitByte(b, 0x8b); // mov eax, [rsi+rax*4]
+    emitByte(b, 0x04);
+    emitByte(b, 0x86);
+    emitRegOp(b, true, 0x01, RAX, RDX);
+    emitLoad(b, REG_ESP, REG_THREAD, (int32_t)offsetof(ObjThread, esp));
+    emitLoad(b, REG_STACK_START, REG_FRAME, (int32_t)offsetof(Frame, stackStart));
+    emitByte(b, 0xff); // jmp rdx
+    emitByte(b, 0xe2);
+    patchJump(b, notCompiled);
+    emitRegOp(b, false, 0x89, RDI, RAX); // mov eax, edi
+    emitJumpTo(b, CC_ALWAYS, b->leaveLabel);
+}
+
+// 调用指令: 内联缓存的第一项命中且是已编译的脚本方法时,
+// 直接创建frame并跳入被调方法的机器码,其余情况由nativeSlowPath完成
+static void emitCall(JitBuilder* b, uint32_t offset, OpCode opCode) {
+    uint8_t* code = b->fn->instrStream.datas;
+    bool isSuper = opCode >= OPCODE_SUPER0;
+    int32_t argNum = opCode - (isSuper ? OPCODE_SUPER0 : OPCODE_CALL0) + 1;
+    uint32_t cacheIdxPos = offset + (isSuper ? 5 : 3);
+    uint16_t cacheIdx = (uint16_t)(code[cacheIdxPos] << 8 | code[cacheIdxPos + 1]);
+    InlineCache* cache = &b->fn->inlineCaches[cacheIdx];
+    InlineCacheEntry* entry = &cache->entries[0];
+    JumpList slow = {{0}, 0};
+
+    // rcx = 接收者的类
+    if (isSuper) {
+        uint16_t classIdx = (uint16_t)(code[offset + 3] << 8 | code[offset + 4]);
+        emitMovImm64(b, RCX, (uint64_t)(uintptr_t)&b->fn->constants.datas[classIdx]);
+        emitLoadObj(b, RCX, RCX, 0);
+    } else {
+        addJump(&slow, emitJumpIfNotObj(b, REG_ESP, -argNum * VALUE_SIZE));
+        emitLoadObj(b, RCX, REG_ESP, -argNum * VALUE_SIZE);
+        emitLoad(b, RCX, RCX, (int32_t)offsetof(ObjHeader, class));
+    }
+
+    // 缓存有效且第一项是该类的脚本方法
+    emitMovImm64(b, RDX, (uint64_t)(uintptr_t)cache);
+    emitMemOp(b, 0, false, 0x8b, RAX, RDX, (int32_t)offsetof(InlineCache, epoch));
+    emitMemOp(b, 0, false, 0x3b, RAX, REG_VM, (int32_t)offsetof(VM, methodEpoch));
+    addJump(&slow, emitForwardJump(b, CC_NE));
+    emitMemOp(b, 0, false, 0x83, 7, RDX, (int32_t)offsetof(InlineCache, count));
+    emitByte(b, 0);
+    addJump(&slow, emitForwardJump(b, CC_E));
+    emitMemOp(b, 0, true, 0x3b, RCX, RDX, (int32_t)((uint8_t*)&entry->class - (uint8_t*)cache));
+    addJump(&slow, emitForwardJump(b, CC_NE));
+    emitMemOp(b, 0, false, 0x83, 7, RDX, (int32_t)((uint8_t*)&entry->method.type - (uint8_t*)cache));
+    emitByte(b, MT_SCRIPT);
+    addJump(&slow, emitForwardJump(b, CC_NE));
+    // rsi = 闭包, rdi = 被调方法, 须已编译
+    emitLoad(b, RSI, RDX, (int32_t)((uint8_t*)&entry->method.obj - (uint8_t*)cache));
+    emitLoad(b, RDI, RSI, (int32_t)offsetof(ObjClosure, fn));
+    emitMemOp(b, 0, true, 0x83, 7, RDI, (int32_t)offsetof(ObjFn, jitCode));
+    emitByte(b, 0);
+    addJump(&slow, emitForwardJump(b, CC_E));
+    // frame和运行时栈的容量足够,否则由createFrame扩容
+    emitMemOp(b, 0, false, 0x8b, RAX, REG_THREAD, (int32_t)offsetof(ObjThread, usedFrameNum));
+    emitMemOp(b, 0, false, 0x3b, RAX, REG_THREAD, (int32_t)offsetof(ObjThread, frameCapacity));
+    addJump(&slow, emitForwardJump(b, CC_AE));
+    emitRegOp(b, true, 0x89, REG_ESP, RDX); // mov rdx, rbx
+    emitMemOp(b, 0, true, 0x2b, RDX, REG_THREAD, (int32_t)offsetof(ObjThread, stack));
+    emitRex(b, true, 0, RDX); // shr rdx, log2(sizeof(Value))
+    emitByte(b, 0xc1);
+    emitByte(b, 0xea);
+    emitByte(b, VALUE_SIZE == 16 ? 4 : 3);
+    emitMemOp(b, 0, false, 0x03, RDX, RDI, (int32_t)offsetof(ObjFn, maxStackSlotUsedNum));
+    emitMemOp(b, 0, false, 0x3b, RDX, REG_THREAD, (int32_t)offsetof(ObjThread, stackCapacity));
+    addJump(&slow, emitForwardJump(b, CC_A));
+
+    emitMemOp(b, 0, true, 0xff, 0, REG_VM, (int32_t)offsetof(VM, inlineCacheHits)); // inc
+    // 返回后从调用指令之后继续执行
+    emitMovImm64(b, RDX, (uint64_t)(uintptr_t)(code + offset + 1 + getBytesOfOperands(code, b->fn->constants.datas, offset)));
+    emitStore(b, REG_FRAME, (int32_t)offsetof(Frame, ip), RDX);
+    // 与prepareFrame相同: r15 = &thread->frames[thread->usedFrameNum++]
+    emitByte(b, 0x48); // imul rax, rax, sizeof(Frame)
+    emitByte(b, 0x6b);
+    emitByte(b, 0xc0);
+    emitByte(b, sizeof(Frame));
+    emitMemOp(b, 0, true, 0x03, RAX, REG_THREAD, (int32_t)offsetof(ObjThread, frames));
+    emitRegOp(b, true, 0x89, RAX, REG_FRAME);
+    emitMemOp(b, 0, false, 0xff, 0, REG_THREAD, (int32_t)offsetof(ObjThread, usedFrameNum)); // inc
+    emitMemOp(b, 0, true, 0x8d, REG_STACK_START, REG_ESP, -argNum * VALUE_SIZE); // lea
+    emitStore(b, REG_FRAME, (int32_t)offsetof(Frame, stackStart), REG_STACK_START);
+    emitStore(b, REG_FRAME, (int32_t)offsetof(Frame, closure), RSI);
+    emitLoad(b, RAX, RDI, (int32_t)offsetof(ObjFn, instrStream.datas));
+    emitStore(b, REG_FRAME, (int32_t)offsetof(Frame, ip), RAX);
+    // 跳到被调方法第一条指令的机器码
+    emitLoad(b, RDX, RDI, (int32_t)offsetof(ObjFn, jitEntries));
+    emitMemOp(b, 0, false, 0x8b, RAX, RDX, 0);
+    emitMemOp(b, 0, true, 0x03, RAX, RDI, (int32_t)offsetof(ObjFn, jitCode));
+    emitByte(b, 0xff); // jmp rax
+    emitByte(b, 0xe0);
+
+    patchJumps(b, &slow);
+    emitSlowPath(b, offset);
+    emitDispatchUnlessContinue(b);
+    // 原生方法不会搬移当前线程的运行时栈,这里只是保险
+    emitLoad(b, REG_STACK_START, REG_FRAME, (int32_t)offsetof(Frame, stackStart));
+}
+
+// 返回指令: 不是线程的最后一个frame且没有要关闭的upvalue时直接弹出frame,
+// 否则由nativeSlowPath完成,之后都转到dispatchLabel继续执行主调方
+static void emitReturn(JitBuilder* b, uint32_t offset) {
+    JumpList slow = {{0}, 0};
+    emitMemOp(b, 0, false, 0x83, 7, REG_THREAD, (int32_t)offsetof(ObjThread, usedFrameNum));
+    emitByte(b, 1);
+    addJump(&slow, emitForwardJump(b, CC_BE));
+    // openUpvalues按localVarPtr从高到低排列,只需检查第一个
+    emitLoad(b, RAX, REG_THREAD, (int32_t)offsetof(ObjThread, openUpvalues));
+    emitRegOp(b, true, 0x85, RAX, RAX); // test rax, rax
+    uint32_t noUpvalue = emitForwardJump(b, CC_E);
+    emitMemOp(b, 0, true, 0x39, REG_STACK_START, RAX, (int32_t)offsetof(ObjUpvalue, localVarPtr));
+    addJump(&slow, emitForwardJump(b, CC_AE));
+    patchJump(b, noUpvalue);
+
+    // 返回值存入stackStart[0],由主调方接收
+    emitCopyValue(b, REG_STACK_START, 0, REG_ESP, -VALUE_SIZE);
+    emitMemOp(b, 0, true, 0x8d, REG_ESP, REG_STACK_START, VALUE_SIZE); // lea
+    emitStore(b, REG_THREAD, (int32_t)offsetof(ObjThread, esp), REG_ESP);
+    emitMemOp(b, 0, false, 0xff, 1, REG_THREAD, (int32_t)offsetof(ObjThread, usedFrameNum)); // dec
+    emitByte(b, 0xb8); // mov eax, NATIVE_RETURN
+    emitInt32(b, NATIVE_RETURN);
+    emitJumpTo(b, CC_ALWAYS, b->dispatchLabel);
+
+    patchJumps(b, &slow);
+    emitSlowPath(b, offset);
+    emitJumpTo(b, CC_ALWAYS, b->dispatchLabel);
+}
+
+// 翻译偏移为offset的指令,超级指令按其第一条指令翻译,第二条指令随后单独翻译,
+// 只有比较运算与JUMP_IF_FALSE合并成的超级指令直接翻译成比较和跳转
+static void compileInstruction(JitBuilder* b, uint32_t offset) {
+    uint8_t* code = b->fn->instrStream.datas;
+    OpCode opCode = (OpCode)code[offset];
+    uint8_t byteOperand = 0;
+    uint16_t shortOperand = 0;
+    // 最后一条指令END没有操作数,不能越过指令流的末尾读取
+    if (offset + 2 < b->fn->instrStream.count) {
+        byteOperand = code[offset + 1];
+        shortOperand = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+    }
+    JumpList slow = {{0}, 0};
+    uint32_t done;
+
+    switch (opCode) {
+        case OPCODE_GREATER_JUMP_IF_FALSE:
+        case OPCODE_GREATER_EQUAL_JUMP_IF_FALSE:
+        case OPCODE_LESS_JUMP_IF_FALSE:
+        case OPCODE_LESS_EQUAL_JUMP_IF_FALSE:
+        case OPCODE_EQUAL_JUMP_IF_FALSE:
+        case OPCODE_NOT_EQUAL_JUMP_IF_FALSE: {
+            // 指令流: 比较运算的4字节操作数, JUMP_IF_FALSE, 2字节的跳转偏移量
+            int16_t jumpOffset = (int16_t)(code[offset + 6] << 8 | code[offset + 7]);
+            addJump(&slow, emitJumpIfNotNum(b, REG_ESP, -2 * VALUE_SIZE));
+            addJump(&slow, emitJumpIfNotNum(b, REG_ESP, -VALUE_SIZE));
+            emitCompare(b, unfuseOpCode(opCode));
+            emitAddEsp(b, -2);
+            emitRegOp(b, false, 0x84, RAX, RAX); // test al, al
+            emitJumpToInstr(b, CC_E, offset + 8 + jumpOffset);
+            emitJumpToInstr(b, CC_ALWAYS, offset + 8);
+            // 不都是数字时调用比较方法,结果由其后的JUMP_IF_FALSE判断
+            patchJumps(b, &slow);
+            emitSlowPath(b, offset);
+            emitDispatchUnlessContinue(b);
+            emitLoad(b, REG_STACK_START, REG_FRAME, (int32_t)offsetof(Frame, stackStart));
+            emitJumpToInstr(b, CC_ALWAYS, offset + 5);
+            return;
+        }
+        default:
+            break;
+    }
+
+    opCode = unfuseOpCode(opCode);
+    switch (opCode) {
+        case OPCODE_LOAD_CONSTANT:
+            emitMovImm64(b, RCX, (uint64_t)(uintptr_t)&b->fn->constants.datas[shortOperand]);
+            emitPushValue(b, RCX, 0);
+            break;
+        case OPCODE_PUSH_NULL:
+            emitPushSingleton(b, VT_NULL);
+            break;
+        case OPCODE_PUSH_FALSE:
+            emitPushSingleton(b, VT_FALSE);
+            break;
+        case OPCODE_PUSH_TRUE:
+            emitPushSingleton(b, VT_TRUE);
+            break;
+        case OPCODE_LOAD_LOCAL_VAR:
+            emitPushValue(b, REG_STACK_START, byteOperand * VALUE_SIZE);
+            break;
+        case OPCODE_STORE_LOCAL_VAR:
+            emitCopyValue(b, REG_STACK_START, byteOperand * VALUE_SIZE, REG_ESP, -VALUE_SIZE);
+            break;
+        case OPCODE_POP:
+            emitAddEsp(b, -1);
+            break;
+        case OPCODE_LOAD_UPVALUE:
+            emitLoad(b, RCX, REG_FRAME, (int32_t)offsetof(Frame, closure));
+            emitLoad(b, RCX, RCX, (int32_t)(offsetof(ObjClosure, upvalues) + byteOperand * sizeof(ObjUpvalue*)));
+            emitLoad(b, RCX, RCX, (int32_t)offsetof(ObjUpvalue, localVarPtr));
+            emitPushValue(b, RCX, 0);
+            break;
+        case OPCODE_LOAD_MODULE_VAR:
+            // 模块变量表可能随模块中定义的变量增多而搬移,每次都从模块中读取
+            emitMovImm64(b, RCX, (uint64_t)(uintptr_t)&b->fn->module->moduleVarValue.datas);
+            emitLoad(b, RCX, RCX, 0);
+            emitPushValue(b, RCX, shortOperand * VALUE_SIZE);
+            break;
+        case OPCODE_LOAD_THIS_FIELD:
+            emitLoadObj(b, RCX, REG_STACK_START, 0);
+            emitPushValue(b, RCX, (int32_t)offsetof(ObjInstance, fields) + byteOperand * VALUE_SIZE);
+            break;
+        case OPCODE_LOAD_FIELD:
+            emitLoadObj(b, RCX, REG_ESP, -VALUE_SIZE);
+            emitCopyValue(b, REG_ESP, -VALUE_SIZE, RCX, (int32_t)offsetof(ObjInstance, fields) + byteOperand * VALUE_SIZE);
+            break;
+
+        // 存入对象的指令在写屏障可以省略时直接存入,否则由nativeSlowPath完成
+        case OPCODE_STORE_UPVALUE:
+            emitLoad(b, RCX, REG_FRAME, (int32_t)offsetof(Frame, closure));
+            emitLoad(b, RCX, RCX, (int32_t)(offsetof(ObjClosure, upvalues) + byteOperand * sizeof(ObjUpvalue*)));
+            emitBarrierCheck(b, RCX, &slow);
+            emitLoad(b, RCX, RCX, (int32_t)offsetof(ObjUpvalue, localVarPtr));
+            emitCopyValue(b, RCX, 0, REG_ESP, -VALUE_SIZE);
+            goto storeSlowPath;
+        case OPCODE_STORE_MODULE_VAR:
+            emitMovImm64(b, RCX, (uint64_t)(uintptr_t)b->fn->module);
+            emitBarrierCheck(b, RCX, &slow);
+            emitLoad(b, RCX, RCX, (int32_t)offsetof(ObjModule, moduleVarValue.datas));
+            emitCopyValue(b, RCX, shortOperand * VALUE_SIZE, REG_ESP, -VALUE_SIZE);
+            goto storeSlowPath;
+        case OPCODE_STORE_THIS_FIELD:
+            emitLoadObj(b, RCX, REG_STACK_START, 0);
+            emitBarrierCheck(b, RCX, &slow);
+            emitCopyValue(b, RCX, (int32_t)offsetof(ObjInstance, fields) + byteOperand * VALUE_SIZE, REG_ESP, -VALUE_SIZE);
+            goto storeSlowPath;
+        case OPCODE_STORE_FIELD:
+            // 栈顶: 实例对象, 次栈顶: field值
+            emitLoadObj(b, RCX, REG_ESP, -VALUE_SIZE);
+            emitBarrierCheck(b, RCX, &slow);
+            emitAddEsp(b, -1);
+            emitCopyValue(b, RCX, (int32_t)offsetof(ObjInstance, fields) + byteOperand * VALUE_SIZE, REG_ESP, -VALUE_SIZE);
+        storeSlowPath:
+            done = emitForwardJump(b, CC_ALWAYS);
+            patchJumps(b, &slow);
+            emitSlowPath(b, offset);
+            patchJump(b, done);
+            break;
+
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_GREATER:
+        case OPCODE_GREATER_EQUAL:
+        case OPCODE_LESS:
+        case OPCODE_LESS_EQUAL:
+        case OPCODE_EQUAL:
+        case OPCODE_NOT_EQUAL:
+            addJump(&slow, emitJumpIfNotNum(b, REG_ESP, -2 * VALUE_SIZE));
+            addJump(&slow, emitJumpIfNotNum(b, REG_ESP, -VALUE_SIZE));
+            if (opCode <= OPCODE_MOD) {
+                emitArith(b, opCode);
+            } else {
+                emitCompare(b, opCode);
+                emitStoreBool(b, REG_ESP, -2 * VALUE_SIZE);
+            }
+            emitAddEsp(b, -1);
+            done = emitForwardJump(b, CC_ALWAYS);
+            // 不都是数字时按方法调用
+            patchJumps(b, &slow);
+            emitSlowPath(b, offset);
+            emitDispatchUnlessContinue(b);
+            emitLoad(b, REG_STACK_START, REG_FRAME, (int32_t)offsetof(Frame, stackStart));
+            patchJump(b, done);
+            break;
+
+        case OPCODE_JUMP:
+            emitJumpToInstr(b, CC_ALWAYS, offset + 3 + (int16_t)shortOperand);
+            break;
+        case OPCODE_LOOP:
+            emitJumpToInstr(b, CC_ALWAYS, offset + 3 - (int16_t)shortOperand);
+            break;
+        case OPCODE_JUMP_IF_FALSE:
+            // add会改变标志位,因此先弹出,再比较刚弹出的值
+            emitAddEsp(b, -1);
+            emitTestFalsy(b, REG_ESP, 0);
+            emitJumpToInstr(b, CC_BE, offset + 3 + (int16_t)shortOperand);
+            break;
+        case OPCODE_AND:
+            // 条件为假时保留在栈顶并跳过右操作数,否则弹出
+            emitTestFalsy(b, REG_ESP, -VALUE_SIZE);
+            emitJumpToInstr(b, CC_BE, offset + 3 + shortOperand);
+            emitAddEsp(b, -1);
+            break;
+        case OPCODE_OR:
+            emitTestFalsy(b, REG_ESP, -VALUE_SIZE);
+            emitJumpToInstr(b, CC_A, offset + 3 + shortOperand);
+            emitAddEsp(b, -1);
+            break;
+        case OPCODE_FOR_RANGE: {
+            // 指令流: 1字节的seq槽位, 2字节到循环条件的偏移量, 2字节到循环体的偏移量
+            uint16_t condOffset = (uint16_t)(code[offset + 2] << 8 | code[offset + 3]);
+            uint16_t bodyOffset = (uint16_t)(code[offset + 4] << 8 | code[offset + 5]);
+            int32_t seq = byteOperand * VALUE_SIZE;
+            // 递增的range且已取得过循环变量时直接计算下一个值,与stepRange的语义一致
+            addJump(&slow, emitJumpIfNotNum(b, REG_STACK_START, seq + VALUE_SIZE));
+            addJump(&slow, emitJumpIfNotObj(b, REG_STACK_START, seq));
+            emitLoadObj(b, RCX, REG_STACK_START, seq);
+            emitMemOp(b, 0, false, 0x80, 7, RCX, OBJ_TYPE_OFFSET); // cmp byte
+            emitByte(b, OT_RANGE);
+            addJump(&slow, emitForwardJump(b, CC_NE));
+            emitMemOp(b, 0, false, 0x8b, RAX, RCX, (int32_t)offsetof(ObjRange, from));
+            emitMemOp(b, 0, false, 0x3b, RAX, RCX, (int32_t)offsetof(ObjRange, to));
+            addJump(&slow, emitForwardJump(b, CC_GE));
+            emitMemOp(b, 0xf2, false, 0x0f2a, XMM1, RCX, (int32_t)offsetof(ObjRange, to)); // cvtsi2sd
+            emitMovImm64(b, RAX, 0x3ff0000000000000ULL); // 1.0
+            emitByte(b, 0x66); // movq xmm0, rax
+            emitByte(b, 0x48);
+            emitByte(b, 0x0f);
+            emitByte(b, 0x6e);
+            emitByte(b, 0xc0);
+            emitMemOp(b, 0xf2, false, 0x0f58, XMM0, REG_STACK_START, seq + VALUE_SIZE + PAYLOAD); // addsd
+            emitByte(b, 0x66); // ucomisd xmm0, xmm1
+            emitByte(b, 0x0f);
+            emitByte(b, 0x2e);
+            emitByte(b, 0xc1);
+            uint32_t finished = emitForwardJump(b, CC_A);
+            emitMemOp(b, 0xf2, false, 0x0f11, XMM0, REG_STACK_START, seq + VALUE_SIZE + PAYLOAD); // movsd
+            emitPushValue(b, REG_STACK_START, seq + VALUE_SIZE);
+            emitJumpToInstr(b, CC_ALWAYS, offset + 6 + bodyOffset);
+            patchJump(b, finished);
+            emitPushSingleton(b, VT_FALSE);
+            emitJumpToInstr(b, CC_ALWAYS, offset + 6 + condOffset);
+
+            patchJumps(b, &slow);
+            emitSlowPath(b, offset);
+            emitRegImm8(b, false, 7, RAX, NATIVE_RANGE_FINISHED);
+            emitJumpToInstr(b, CC_E, offset + 6 + condOffset);
+            emitRegImm8(b, false, 7, RAX, NATIVE_RANGE_NEXT);
+            emitJumpToInstr(b, CC_E, offset + 6 + bodyOffset);
+            break;
+        }
+
+        case OPCODE_CALL0:
+        case OPCODE_CALL1:
+        case OPCODE_CALL2:
+        case OPCODE_CALL3:
+        case OPCODE_CALL4:
+        case OPCODE_CALL5:
+        case OPCODE_CALL6:
+        case OPCODE_CALL7:
+        case OPCODE_CALL8:
+        case OPCODE_CALL9:
+        case OPCODE_CALL10:
+        case OPCODE_CALL11:
+        case OPCODE_CALL12:
+        case OPCODE_CALL13:
+        case OPCODE_CALL14:
+        case OPCODE_CALL15:
+        case OPCODE_CALL16:
+        case OPCODE_SUPER0:
+        case OPCODE_SUPER1:
+        case OPCODE_SUPER2:
+        case OPCODE_SUPER3:
+        case OPCODE_SUPER4:
+        case OPCODE_SUPER5:
+        case OPCODE_SUPER6:
+        case OPCODE_SUPER7:
+        case OPCODE_SUPER8:
+        case OPCODE_SUPER9:
+        case OPCODE_SUPER10:
+        case OPCODE_SUPER11:
+        case OPCODE_SUPER12:
+        case OPCODE_SUPER13:
+        case OPCODE_SUPER14:
+        case OPCODE_SUPER15:
+        case OPCODE_SUPER16:
+            emitCall(b, offset, opCode);
+            break;
+        case OPCODE_RETURN:
+            emitReturn(b, offset);
+            break;
+
+        // 以下指令由nativeSlowPath执行
+        case OPCODE_CLOSE_UPVALUE:
+        case OPCODE_CONSTRUCT:
+        case OPCODE_INTERPOLATE:
+            emitSlowPath(b, offset);
+            break;
+
+        // 其余的指令很少在热点中执行,退回到解释器
+        default:
+            emitExit(b, offset);
+            break;
+    }
+}
+
+// 把length字节的机器码写入代码区的dest处,dest之后的size字节须未被使用.
+// 代码区的页任何时候都不同时可写和可执行: 写入时所在的页改为可读写,写完改回可读可执行.
+// 与之前的函数共用的页在写入期间不可执行,因为只有当前线程会执行机器码,此时不会用到它们
+static bool writeJitCode(uint8_t* dest, const uint8_t* code, uint32_t length, uint32_t size) {
+    uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uint8_t* pageStart = (uint8_t*)((uintptr_t)dest & ~(pageSize - 1));
+    size_t protLength = dest + size - pageStart;
+    if (mprotect(pageStart, protLength, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    memcpy(dest, code, length);
+    return mprotect(pageStart, protLength, PROT_READ | PROT_EXEC) == 0;
+}
+
+// 编译fn,成功时设置fn->jitCode和fn->jitEntries
+void jitCompile(VM* vm, ObjFn* fn) {
+    JitBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.fn = fn;
+    b.entries = (uint32_t*)malloc(fn->instrStream.count * sizeof(uint32_t));
+    if (b.entries == NULL) {
+        MEM_ERROR("allocate jit entries failed!");
+    }
+    memset(b.entries, 0xff, fn->instrStream.count * sizeof(uint32_t));
+
+    emitPrologue(&b);
+    uint8_t* code = fn->instrStream.datas;
+    uint32_t offset = 0;
+    while (true) {
+        b.entries[offset] = b.length;
+        compileInstruction(&b, offset);
+        if (code[offset] == OPCODE_END) {
+            break;
+        }
+        offset += 1 + getBytesOfOperands(code, fn->constants.datas, offset);
+    }
+
+    uint32_t idx = 0;
+    while (idx < b.fixupNum) {
+        uint32_t target = b.entries[b.fixups[idx].target];
+        ASSERT(target != UINT32_MAX, "jump target is not an instruction!");
+        patchInt32(&b, b.fixups[idx].pos, (int32_t)(target - (b.fixups[idx].pos + 4)));
+        idx++;
+    }
+
+    // 代码区按需映射,只预留地址空间,写入机器码时再开放所在的页
+    if (vm->jitCodeArea == NULL) {
+        void* area = mmap(NULL, JIT_CODE_AREA_SIZE, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (area != MAP_FAILED) {
+            vm->jitCodeArea = (uint8_t*)area;
+        }
+    }
+    // 按16字节对齐
+    uint32_t size = (b.length + 15) & ~15u;
+    if (vm->jitCodeArea != NULL && JIT_CODE_AREA_SIZE - vm->jitCodeUsed >= size &&
+        writeJitCode(vm->jitCodeArea + vm->jitCodeUsed, b.code, b.length, size)) {
+        fn->jitCode = vm->jitCodeArea + vm->jitCodeUsed;
+        vm->jitCodeUsed += size;
+        fn->jitEntries = b.entries;
+    } else {
+        free(b.entries);
+        fn->jitHotness = UINT32_MAX;
+    }
+    free(b.code);
+    free(b.fixups);
+}
+
+typedef int (*JitCode)(VM* vm, ObjThread* thread, Frame* frame, uint8_t* entry);
+
+// 从thread当前frame的ip处执行机器码,当前frame的函数须已编译.
+// 机器码遇到不能执行的指令或转到没有编译的函数时返回,
+// 返回true表示原生方法返回了false,解释器须处理出错或线程切换
+bool jitExecute(VM* vm, ObjThread* thread) {
+    Frame* frame = &thread->frames[thread->usedFrameNum - 1];
+    ObjFn* fn = frame->closure->fn;
+    uint32_t entry = fn->jitEntries[frame->ip - fn->instrStream.datas];
+    ASSERT(entry != UINT32_MAX, "frame->ip is not at an instruction!");
+    return ((JitCode)fn->jitCode)(vm, thread, frame, (uint8_t*)fn->jitCode + entry) == NATIVE_PRIMITIVE_FAILED;
+}
+
+void jitFreeCode(VM* vm) {
+    if (vm->jitCodeArea != NULL) {
+        munmap(vm->jitCodeArea, JIT_CODE_AREA_SIZE);
+        vm->jitCodeArea = NULL;
+    }
+    vm->jitCodeUsed = 0;
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef _VM_JIT_H
+#define _VM_JIT_H
+#include "vm.h"
+
+// 基线模板jit: 按指令流的顺序把每条指令翻译成一段固定的机器码,
+// 数字运算、比较、跳转、变量存取、range遍历以及已编译方法之间的调用和返回
+// 直接在机器码中完成,其余情况调用nativeSlowPath按解释器的语义执行.
+// 机器码与解释器共用Frame和运行时栈,每条指令都有入口,
+// 因此可以在任意指令处退回到解释器,也可以在任意指令处从解释器进入机器码
+
+// --jit未指定阈值时函数被编译前的执行次数
+#define JIT_HOT_THRESHOLD 1000
+// 代码区的大小,用完后不再编译新的函数
+#define JIT_CODE_AREA_SIZE (64 * 1024 * 1024)
+
+#if JIT
+// 在函数入口和循环回边处累计执行次数,达到阈值时编译函数.
+// 编译失败时执行次数被置为UINT32_MAX,不再尝试
+#define JIT_COUNT_HOTNESS(vmPtr, fnPtr)\
+    do {\
+        if ((fnPtr)->jitHotness < (vmPtr)->config.jitThreshold &&\
+            ++(fnPtr)->jitHotness == (vmPtr)->config.jitThreshold) {\
+            jitCompile(vmPtr, fnPtr);\
+        }\
+    } while (0)
+
+void jitCompile(VM* vm, ObjFn* fn);
+bool jitExecute(VM* vm, ObjThread* thread);
+void jitFreeCode(VM* vm);
+#endif
+#endif
@@ -1,25 +1,51 @@
 #include "vm.h"
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
 #include "utils.h"
 #include "core.h"
 #include "compiler.h"
 #include "gc.h"
+#include "obj_range.h"
+#include "jit.h"
+#include "aot.h"
+#include "peephole.h"
 #ifdef DEBUG
     #include "debug.h"
 #endif
 
 
+// 把obj压入临时根
+// 此处直接使用realloc而不是memManager,否则扩容时触发的回收会漏掉尚未压入的obj
 void pushTmpRoot(VM* vm, ObjHeader* obj) {
     ASSERT(obj!= NULL, "root obj is null");
-    ASSERT(vm->tmpRootNum < MAX_TEMP_ROOTS_NUM, "temporary roots too much!");
+    if (vm->tmpRootNum >= vm->tmpRootCapacity) {
+        vm->tmpRootCapacity = vm->tmpRootCapacity == 0 ? 16 : vm->tmpRootCapacity * 2;
+        vm->tmpRoots = (ObjHeader**)realloc(vm->tmpRoots, vm->tmpRootCapacity * sizeof(ObjHeader*));
+        if (vm->tmpRoots == NULL) {
+            MEM_ERROR("allocate temporary roots failed!");
+        }
+    }
     vm->tmpRoots[vm->tmpRootNum++] = obj;
 }
 
 void popTmpRoot(VM* vm) {
-    ASSERT(vm->tmpRootNum < MAX_TEMP_ROOTS_NUM, "temporary roots too much!");
+    ASSERT(vm->tmpRootNum > 0, "no temporary root to pop!");
     vm->tmpRootNum--;
 }
 
+// 打开句柄作用域
+HandleScope openHandleScope(VM* vm) {
+    return vm->tmpRootNum;
+}
+
+// 关闭句柄作用域,弹出scope打开之后压入的临时根
+void closeHandleScope(VM* vm, HandleScope scope) {
+    ASSERT(scope <= vm->tmpRootNum, "handle scope closed twice or out of order!");
+    vm->tmpRootNum = scope;
+}
+
 // 确保stack有效
 void ensureStack(VM* vm, ObjThread* objThread, uint32_t neededSots) {
     if (objThread->stackCapacity >= neededSots) {
@@ -72,10 +98,11 @@ inline static void createFrame(VM* vm, ObjThread* objThread, ObjClosure* ObjClos
 
 // 关闭在栈中slot为lastSlot及之上的upvalue
 // 关闭即upvalue.localVarPtr修改指针地址由运行时栈,改为自身upvalue.closedUpvalue
-static void closedUpvalue(ObjThread* objThread, Value* lastSlot) {
+static void closedUpvalue(VM* vm, ObjThread* objThread, Value* lastSlot) {
     ObjUpvalue* upvalue = objThread->openUpvalues;
     while (upvalue != NULL && upvalue->localVarPtr >= lastSlot) {
         upvalue->closedUpvalue = *(upvalue->localVarPtr);
+        GC_WRITE_BARRIER(vm, upvalue, upvalue->closedUpvalue);
         // 关闭后把指向运行时栈的指针改为指向自身的closedUpvalue
         upvalue->localVarPtr = &(upvalue->closedUpvalue);
         upvalue = upvalue->next;
@@ -137,7 +164,7 @@ static void validateSuperClass(VM* vm, Value classNameValue, uint32_t fieldNum,
 }
 
 // 修正操作数
-static void patchOperand(Class* class, ObjFn* fn) {
+static void patchOperand(VM* vm, Class* class, ObjFn* fn) {
     int ip = 0;
     OpCode opCode;
     while (true) {
@@ -147,6 +174,7 @@ static void patchOperand(Class* class, ObjFn* fn) {
             case OPCODE_STORE_FIELD:
             case OPCODE_LOAD_THIS_FIELD:
             case OPCODE_STORE_THIS_FIELD:
+            case OPCODE_STORE_THIS_FIELD_POP:
                 // 修正子类的field数目,参数是1字节
                 fn->instrStream.datas[ip++] += class->superClass->fieldNum;
                 break;
@@ -169,11 +197,13 @@ static void patchOperand(Class* class, ObjFn* fn) {
             case OPCODE_SUPER16:{
                 // 指令1: 2字节的method索引
                 // 指令2: 2字节的基类常量索引
+                // 指令3: 2字节的内联缓存索引
                 ip += 2; // 跳过两字节的method索引
                 uint32_t superClassIdx = (fn->instrStream.datas[ip] << 8) | fn->instrStream.datas[ip+1];
                 // 回填在函数emitCallBySignature中的占位VT_TO_VALUE(VT_NULL)
                 fn->constants.datas[superClassIdx] = OBJ_TO_VALUE(class->superClass);
-                ip +=2 ;// 跳过基类索引
+                GC_WRITE_BARRIER(vm, fn, fn->constants.datas[superClassIdx]);
+                ip += 4; // 跳过基类索引和内联缓存索引
                 break;
             }
             case OPCODE_CREATE_CLOSURE:{
@@ -181,7 +211,7 @@ static void patchOperand(Class* class, ObjFn* fn) {
                 // 函数是存储到常量表中,获取待创建闭包的函数在常量表中的索引
                 uint32_t fnIdx = (fn->instrStream.datas[ip]<<8) | fn->instrStream.datas[ip+1];
                 // 递归进入该函数的指令流,继续为其中的super和field修正操作数
-                patchOperand(class, VALUE_TO_OBJFN(fn->constants.datas[fnIdx]));
+                patchOperand(vm, class, VALUE_TO_OBJFN(fn->constants.datas[fnIdx]));
                 // ip-1 返回OPCODE_CREATE_CLOSURE指令
                 ip += getBytesOfOperands(fn->instrStream.datas, fn->constants.datas, ip-1);
                 break;
@@ -203,9 +233,94 @@ static void bindMethodAndPatch(VM* vm, OpCode opCode, uint32_t methodIndex, Clas
     Method method;
     method.type = MT_SCRIPT;
     method.obj = VALUE_TO_OBJCLOSURE(methodValue);
-    patchOperand(class, method.obj->fn);
+    patchOperand(vm, class, method.obj->fn);
     bindMethod(vm, class, methodIndex, method);
 }
+
+// 在调用点的内联缓存中按接收者的类查找方法,
+// 命中则省去在class->methods中的哈希查找,未命中时查找后记入缓存
+Method* lookupMethod(VM* vm, InlineCache* cache, Class* class, int index) {
+    if (cache->epoch == vm->methodEpoch) {
+        InlineCacheEntry* entry = cache->entries;
+        InlineCacheEntry* end = entry + cache->count;
+        while (entry < end) {
+            if (entry->class == class) {
+                vm->inlineCacheHits++;
+                return &entry->method;
+            }
+            entry++;
+        }
+    } else {
+        cache->epoch = vm->methodEpoch;
+        cache->count = 0;
+    }
+    vm->inlineCacheMisses++;
+    Method* method = findMethod(class, (uint32_t)index);
+    if (method == NULL) {
+        RUN_ERROR("%d | method '%s' not found!",index, vm->allMethodNames.datas[index].str);
+    }
+    // 缓存已满时不再记录新的类,剩余的类每次都要查找
+    if (cache->count < INLINE_CACHE_SIZE) {
+        cache->entries[cache->count].class = class;
+        cache->entries[cache->count].method = *method;
+        cache->count++;
+    }
+    return method;
+}
+
+// FOR_RANGE的seq是range时在此完成iterate和iteratorValue的工作,
+// 与primRangeIterate的语义一致,seq[1]是iter,也就是循环变量的值
+RangeStep stepRange(Value* seq) {
+    if (!VALUE_IS_OBJRANGE(seq[0])) {
+        return RANGE_NOT_RANGE;
+    }
+    ObjRange* objRange = VALUE_TO_OBJRANGE(seq[0]);
+    Value iter = seq[1];
+    double value;
+    bool finished = false;
+    if (VALUE_IS_NULL(iter)) {
+        value = objRange->from;
+    } else if (objRange->from < objRange->to) {
+        value = VALUE_TO_NUM(iter) + 1;
+        finished = value > objRange->to;
+    } else {
+        value = VALUE_TO_NUM(iter) - 1;
+        finished = value < objRange->to;
+    }
+    if (finished) {
+        return RANGE_FINISHED;
+    }
+    seq[1] = NUM_TO_VALUE(value);
+    return RANGE_NEXT;
+}
+
+// 把栈顶的partNum个字符串片段拼接成一个字符串,替换掉这些片段
+static void interpolate(VM* vm, ObjThread* objThread, uint8_t partNum) {
+    Value* parts = objThread->esp - partNum;
+    uint32_t length = 0;
+    uint32_t idx = 0;
+    while (idx < partNum) {
+        if (!VALUE_IS_OBJSTR(parts[idx])) {
+            RUN_ERROR("toString must return a string in interpolation!");
+        }
+        length += VALUE_TO_OBJSTR(parts[idx])->value.length;
+        idx++;
+    }
+    // 总长度已知,只需分配一次,各片段各复制一次
+    // 片段仍在栈上,拼接过程中触发的回收不会释放它们
+    StringBuilder builder;
+    stringBuilderInit(vm, &builder, length);
+    idx = 0;
+    while (idx < partNum) {
+        ObjString* part = VALUE_TO_OBJSTR(parts[idx]);
+        stringBuilderAppend(vm, &builder, part->value.start, part->value.length);
+        idx++;
+    }
+    ObjString* result = stringBuilderFinish(vm, &builder);
+    objThread->esp = parts;
+    *objThread->esp++ = OBJ_TO_VALUE(result);
+}
+
 // 执行指令
 VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
     vm->curThread = curThread;
@@ -235,11 +350,62 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
         ip = curFrame->ip;\
         fn = curFrame->closure->fn;
     
+#if COMPUTED_GOTO
+    // 直接线索化分派: 标签地址表由opcode.inc生成,下标即操作码
+    // 每条指令执行完后直接跳到下一条指令的处理代码,
+    // 避免所有指令共用switch的那一处间接跳转,提高分支预测命中率
+    static void* opcodeJumpTable[] = {
+        #define OPCODE_SLOTS(opcode, effect) &&OPCODE_LABEL_##opcode,
+        #include "opcode.inc"
+        #undef OPCODE_SLOTS
+    };
+
+    #define DECODE LOOP();
+    #define CASE(shortOpCode) OPCODE_LABEL_##shortOpCode
+    #define LOOP() goto *opcodeJumpTable[opCode = READ_BYTE()]
+#else
     #define DECODE loopStart:\
         opCode = READ_BYTE();\
         switch (opCode)
     #define CASE(shortOpCode) case OPCODE_##shortOpCode
     #define LOOP() goto loopStart
+#endif
+
+#if JIT
+    // 当前函数已编译成机器码时转去执行机器码,
+    // 机器码退回到解释器后重新加载frame,从其中保存的ip继续解释执行
+    #define JIT_ENTER()\
+        if (fn->jitCode != NULL) {\
+            STORE_CUR_FRAME();\
+            if (jitExecute(vm, curThread)) {\
+                LOAD_CUR_FRAME();\
+                goto primitiveFailed;\
+            }\
+            LOAD_CUR_FRAME();\
+        }
+    // 函数入口和循环回边处累计执行次数
+    #define JIT_HOT_SPOT()\
+        JIT_COUNT_HOTNESS(vm, fn);\
+        JIT_ENTER()
+#else
+    #define JIT_ENTER()
+    #define JIT_HOT_SPOT()
+#endif
+
+#if AOT
+    // 当前函数有aot生成的代码时转去执行,返回后同JIT_ENTER
+    #define AOT_ENTER()\
+        if (fn->aotCode != NULL) {\
+            STORE_CUR_FRAME();\
+            if (aotExecute(vm, curThread)) {\
+                LOAD_CUR_FRAME();\
+                goto primitiveFailed;\
+            }\
+            LOAD_CUR_FRAME();\
+        }
+#else
+    #define AOT_ENTER()
+#endif
 
     LOAD_CUR_FRAME();
     #ifdef DEBUG
@@ -249,6 +415,8 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
         printf("\ninstructions:\n");
         dumpInstructions(vm, fn);
     #endif
+    AOT_ENTER();
+    JIT_ENTER();
     DECODE {
         CASE(LOAD_LOCAL_VAR):
             PUSH(stackStart[READ_BYTE()]);
@@ -306,14 +474,15 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
             CASE(CALL14):
             CASE(CALL15):
             CASE(CALL16):
-                // 指令流: 2字节的method索引
+                // 指令流1: 2字节的method索引
+                // 指令流2: 2字节的内联缓存索引
                 // 因为还有隐式的receiver(就是下面的args[0]),所以参数个数+1
                 argNum = opCode-OPCODE_CALL0+1;
                 index = READ_SHORT(); // 方法名索引
                 args = curThread->esp - argNum;
                 // 获得方法所在的类
                 class = getClassOfObj(vm, args[0]);
-                goto invokeMethod;
+                goto lookupCache;
             CASE(SUPER0):
             CASE(SUPER1):
             CASE(SUPER2):
@@ -333,15 +502,90 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
             CASE(SUPER16):
                 // 指令流1: 2字节的method索引
                 // 指令流2：2字节的基类常量索引
+                // 指令流3: 2字节的内联缓存索引
                 // 因为还有隐式的receiver(就是下面的args[0]),所以参数个数+1
+                // 基类在patchOperand时就已确定,因此该调用点总是单态的
                 argNum = opCode - OPCODE_SUPER0 + 1;
                 index = READ_SHORT();
                 args = curThread->esp-argNum;
                 class = VALUE_TO_CLASS(fn->constants.datas[READ_SHORT()]);
-            invokeMethod:
-                if ((uint32_t)index > class->methods.count || (method = &class->methods.datas[index])->type == MT_NONE) {
-                    RUN_ERROR("%d | method '%s' not found!",index, vm->allMethodNames.datas[index].str);
-                }
+                goto lookupCache;
+
+            // 算术和比较运算:两个操作数都是数字时直接计算,
+            // 否则按指令流中2字节的method索引和内联缓存索引退回到CALL1的方法调用
+            #define NUM_INFIX_OP(valueMacro, expr)\
+                if (VALUE_IS_NUM(PEEK2()) && VALUE_IS_NUM(PEEK())) {\
+                    double b = VALUE_TO_NUM(POP());\
+                    double a = VALUE_TO_NUM(PEEK());\
+                    PEEK() = valueMacro(expr);\
+                    ip += 4;\
+                    LOOP();\
+                }\
+                goto callOperator;
+
+            CASE(ADD):
+                NUM_INFIX_OP(NUM_TO_VALUE, a + b);
+            CASE(SUB):
+                NUM_INFIX_OP(NUM_TO_VALUE, a - b);
+            CASE(MUL):
+                NUM_INFIX_OP(NUM_TO_VALUE, a * b);
+            CASE(DIV):
+                NUM_INFIX_OP(NUM_TO_VALUE, a / b);
+            CASE(MOD):
+                NUM_INFIX_OP(NUM_TO_VALUE, fmod(a, b));
+            CASE(GREATER):
+                NUM_INFIX_OP(BOOL_TO_VALUE, a > b);
+            CASE(GREATER_EQUAL):
+                NUM_INFIX_OP(BOOL_TO_VALUE, a >= b);
+            CASE(LESS):
+                NUM_INFIX_OP(BOOL_TO_VALUE, a < b);
+            CASE(LESS_EQUAL):
+                NUM_INFIX_OP(BOOL_TO_VALUE, a <= b);
+            CASE(EQUAL):
+                NUM_INFIX_OP(BOOL_TO_VALUE, a == b);
+            CASE(NOT_EQUAL):
+                NUM_INFIX_OP(BOOL_TO_VALUE, a != b);
+            #undef NUM_INFIX_OP
+
+            // 比较运算与其后的JUMP_IF_FALSE合并成的超级指令
+            // 指令流: 比较运算的4字节操作数, JUMP_IF_FALSE, 2字节的跳转偏移量
+            // 两个操作数都是数字时比较后直接跳转,否则退回到比较运算的方法调用,
+            // 返回后照常执行其后的JUMP_IF_FALSE
+            #define NUM_COMPARE_JUMP(expr)\
+                if (VALUE_IS_NUM(PEEK2()) && VALUE_IS_NUM(PEEK())) {\
+                    double b = VALUE_TO_NUM(POP());\
+                    double a = VALUE_TO_NUM(POP());\
+                    ip += 5;\
+                    int16_t offset = READ_SHORT();\
+                    if (!(expr)) {\
+                        ip += offset;\
+                    }\
+                    LOOP();\
+                }\
+                goto callOperator;
+
+            CASE(GREATER_JUMP_IF_FALSE):
+                NUM_COMPARE_JUMP(a > b);
+            CASE(GREATER_EQUAL_JUMP_IF_FALSE):
+                NUM_COMPARE_JUMP(a >= b);
+            CASE(LESS_JUMP_IF_FALSE):
+                NUM_COMPARE_JUMP(a < b);
+            CASE(LESS_EQUAL_JUMP_IF_FALSE):
+                NUM_COMPARE_JUMP(a <= b);
+            CASE(EQUAL_JUMP_IF_FALSE):
+                NUM_COMPARE_JUMP(a == b);
+            CASE(NOT_EQUAL_JUMP_IF_FALSE):
+                NUM_COMPARE_JUMP(a != b);
+            #undef NUM_COMPARE_JUMP
+
+            callOperator:
+                argNum = 2;
+                index = READ_SHORT();
+                args = curThread->esp - argNum;
+                class = getClassOfObj(vm, args[0]);
+
+            lookupCache:
+                method = lookupMethod(vm, &fn->inlineCaches[READ_SHORT()], class, index);
                 switch (method->type) {
                     case MT_PRIMITIVE:
                         if (method->primFn(vm, args)) { // 如果返回值为true，则进行空间回收
@@ -351,6 +595,9 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
                             // 有两种情况
                             // 1. 出错
                             // 2. 切换了线程(vm->curThread)
+                        #if JIT || AOT
+                        primitiveFailed:
+                        #endif
                             STORE_CUR_FRAME();
                             if (vm->curThread == NULL) {
                                 return VM_RESULT_SUCCESS;
@@ -377,6 +624,8 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
                         STORE_CUR_FRAME();
                         createFrame(vm, curThread, (ObjClosure*)method->obj, argNum);
                         LOAD_CUR_FRAME();
+                        AOT_ENTER();
+                        JIT_HOT_SPOT();
                         break;
                     case MT_FN_CALL:
                         ASSERT(VALUE_IS_OBJCLOSURE(args[0]), "instance must be a closure!");
@@ -388,6 +637,8 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
                         STORE_CUR_FRAME();
                         createFrame(vm, curThread, VALUE_TO_OBJCLOSURE(args[0]), argNum);
                         LOAD_CUR_FRAME();
+                        AOT_ENTER();
+                        JIT_HOT_SPOT();
                         break;
                     
                     default:
@@ -398,17 +649,60 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
         CASE(LOAD_UPVALUE):
             PUSH(*((curFrame->closure->upvalues[READ_BYTE()])->localVarPtr));
             LOOP();
-        CASE(STORE_UPVALUE):
+        // 以下是fuseSuperInstructions合并成的超级指令,第二条指令仍留在指令流中,
+        // 这里一并完成它的工作并跳过其操作码
+        CASE(LOAD_LOCAL_VAR_LOCAL_VAR):
+            // 指令流: 1字节局部变量索引, LOAD_LOCAL_VAR, 1字节局部变量索引
+            PUSH(stackStart[ip[0]]);
+            PUSH(stackStart[ip[2]]);
+            ip += 3;
+            LOOP();
+        CASE(LOAD_LOCAL_VAR_CONSTANT):
+            // 指令流: 1字节局部变量索引, LOAD_CONSTANT, 2字节的常量索引
+            PUSH(stackStart[ip[0]]);
+            PUSH(fn->constants.datas[(ip[2] << 8) | ip[3]]);
+            ip += 4;
+            LOOP();
+        CASE(STORE_LOCAL_VAR_POP):
+            // 指令流: 1字节局部变量索引, POP
+            stackStart[ip[0]] = POP();
+            ip += 2;
+            LOOP();
+        CASE(STORE_THIS_FIELD_POP): {
+            // 指令流: 1字节的field索引, POP
+            uint8_t fieldIdx = ip[0];
+            ip += 2;
+            ASSERT(VALUE_IS_OBJINSTANCE(stackStart[0]), "receiver should be instance!");
+            ObjInstance* objInstance = VALUE_TO_OBJINSTANCE(stackStart[0]);
+            ASSERT(fieldIdx < objInstance->objHeader.class->fieldNum, "out of bounds field!");
+            objInstance->fields[fieldIdx] = POP();
+            GC_WRITE_BARRIER(vm, objInstance, objInstance->fields[fieldIdx]);
+            LOOP();
+        }
+        CASE(POP_LOOP): {
+            // 指令流: LOOP, 2字节的跳转正偏移量
+            DROP();
+            ip++;
+            int16_t offset = READ_SHORT();
+            ip -= offset;
+            JIT_HOT_SPOT();
+            LOOP();
+        }
+        CASE(STORE_UPVALUE): {
             // 栈顶：upvalue值
             // 指令流： 1字节的upvalue索引
-            *(curFrame->closure->upvalues[READ_BYTE()]->localVarPtr) = PEEK();
+            ObjUpvalue* upvalue = curFrame->closure->upvalues[READ_BYTE()];
+            *(upvalue->localVarPtr) = PEEK();
+            GC_WRITE_BARRIER(vm, upvalue, PEEK());
             LOOP();
+        }
         CASE(LOAD_MODULE_VAR):
             // 指令流：两字节的模块变量索引
             PUSH(fn->module->moduleVarValue.datas[READ_SHORT()]);
             LOOP();
         CASE(STORE_MODULE_VAR):
             fn->module->moduleVarValue.datas[READ_SHORT()] = PEEK();
+            GC_WRITE_BARRIER(vm, fn->module, PEEK());
             LOOP();
         CASE(STORE_THIS_FIELD):{
             // 栈顶： field值
@@ -418,6 +712,7 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
             ObjInstance* objInstance = VALUE_TO_OBJINSTANCE(stackStart[0]);
             ASSERT(fieldIdx < objInstance->objHeader.class->fieldNum, "out of bounds field!");
             objInstance->fields[fieldIdx] = PEEK();
+            GC_WRITE_BARRIER(vm, objInstance, PEEK());
             LOOP();
         }
         CASE(LOAD_FIELD):{
@@ -440,6 +735,7 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
             ObjInstance* objInstance = VALUE_TO_OBJINSTANCE(receiver);
             ASSERT(fieldIdx < objInstance->objHeader.class->fieldNum, "out of bounds field!");
             objInstance->fields[fieldIdx] = PEEK();
+            GC_WRITE_BARRIER(vm, objInstance, PEEK());
             LOOP();
         }
         CASE(JUMP): {
@@ -454,6 +750,32 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
             int16_t offset = READ_SHORT();
             ASSERT(offset>0, "OPCODE_LOOP's operand must be positive!");
             ip -= offset;
+            JIT_HOT_SPOT();
+            LOOP();
+        }
+        CASE(FOR_RANGE): {
+            // 指令流: 1字节的seq槽位(iter在其后一个槽位),
+            //     2字节到循环条件JUMP_IF_FALSE的偏移量, 2字节到循环体的偏移量
+            // seq是range时在此完成iterate和iteratorValue的工作,
+            // 与primRangeIterate的语义一致,iter就是循环变量的值
+            uint8_t seqSlot = READ_BYTE();
+            uint16_t condOffset = READ_SHORT();
+            uint16_t bodyOffset = READ_SHORT();
+            switch (stepRange(&stackStart[seqSlot])) {
+                case RANGE_NOT_RANGE:
+                    // 其它序列由后面的指令调用iterate和iteratorValue
+                    break;
+                case RANGE_FINISHED:
+                    // 压入false跳到JUMP_IF_FALSE,由它跳出循环
+                    PUSH(VT_TO_VALUE(VT_FALSE));
+                    ip += condOffset;
+                    break;
+                case RANGE_NEXT:
+                    // 压入的值即是循环变量
+                    PUSH(stackStart[seqSlot + 1]);
+                    ip += bodyOffset;
+                    break;
+            }
             LOOP();
         }
         CASE(JUMP_IF_FALSE): {
@@ -500,7 +822,7 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
         CASE(CLOSE_UPVALUE):
             // 栈顶：相当于局部变量
             // 把地址大于栈顶局部变量的upvalue关闭
-            closedUpvalue(curThread, curThread->esp - 1);
+            closedUpvalue(vm, curThread, curThread->esp - 1);
             DROP(); // 弹出栈顶局部变量
             LOOP();
         CASE(RETURN): {
@@ -509,7 +831,7 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
             // 回收堆栈框架
             curThread->usedFrameNum--;
             // 关闭此作用域内所有upvalue
-            closedUpvalue(curThread, stackStart);
+            closedUpvalue(vm, curThread, stackStart);
             if (curThread->usedFrameNum == 0) {
                 // 如果不是被另一个线程调用的，直接结束
                 if (curThread->caller == 0) {
@@ -531,6 +853,8 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
                 curThread->esp = stackStart+1;
             }
             LOAD_CUR_FRAME();
+            AOT_ENTER();
+            JIT_ENTER();
             LOOP();
         }
         CASE(CONSTRUCT):{
@@ -562,6 +886,8 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
                     // 当前编译的是下一层的闭包
                     objClosure->upvalues[idx] = curFrame->closure->upvalues[index];
                 }
+                // 创建upvalue时可能已经执行过回收片段,objClosure可能已被标黑
+                GC_WRITE_BARRIER(vm, objClosure, OBJ_TO_VALUE(objClosure->upvalues[idx]));
                 idx++;
             }
             LOOP();
@@ -593,10 +919,18 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
             DROP();
             LOOP();
         }
+        CASE(INTERPOLATE): {
+            // 指令流: 1字节的片段数
+            // 栈顶: 各片段,内嵌表达式已由toString转为字符串
+            interpolate(vm, curThread, READ_BYTE());
+            LOOP();
+        }
         CASE(END):
             NOT_REACHED();
+#if !COMPUTED_GOTO
         default:
             printf("%d", opCode);
+#endif
     }
     NOT_REACHED();
     
@@ -609,36 +943,341 @@ VMResult executeInstruction(VM* vm, register ObjThread* curThread) {
     #undef STORE_CUR_FRAME
     #undef READ_BYTE
     #undef READ_SHORT
+    #undef DECODE
+    #undef CASE
+    #undef LOOP
+    #undef JIT_ENTER
+    #undef JIT_HOT_SPOT
+    #undef AOT_ENTER
+}
+
+#if JIT || AOT
+// 调用脚本方法或函数对象的call,为被调方压入新的frame并返回NATIVE_CALL.
+// 调用前须已把栈顶写回thread->esp,并把frame->ip设为调用指令之后的位置
+int nativeCall(VM* vm, ObjThread* thread, Method* method, int argNum) {
+    ObjClosure* objClosure;
+    if (method->type == MT_SCRIPT) {
+        objClosure = (ObjClosure*)method->obj;
+    } else {
+        ASSERT(method->type == MT_FN_CALL, "method should be script or fn call!");
+        Value* args = thread->esp - argNum;
+        ASSERT(VALUE_IS_OBJCLOSURE(args[0]), "instance must be a closure!");
+        // createFrame可能搬移运行时栈,args随之失效
+        objClosure = VALUE_TO_OBJCLOSURE(args[0]);
+        if (argNum - 1 < objClosure->fn->argNum) {
+            RUN_ERROR("arguments less");
+        }
+    }
+    createFrame(vm, thread, objClosure, argNum);
+#if JIT
+    JIT_COUNT_HOTNESS(vm, objClosure->fn);
+#endif
+    return NATIVE_CALL;
+}
+
+// 由jit生成的机器码和aot生成的c代码调用,按解释器的语义执行ip处的指令,超级指令只执行其第一条指令.
+// 调用前已把栈顶写回thread->esp,返回值见NativeResult
+int nativeSlowPath(VM* vm, ObjThread* thread, Frame* frame, uint8_t* ip) {
+    ObjFn* fn = frame->closure->fn;
+    Value* stackStart = frame->stackStart;
+    OpCode opCode = (OpCode)*ip++;
+    int argNum, index;
+    Value* args;
+    Class* class;
+    Method* method;
+
+    #define PEEK() (*(thread->esp-1))
+    #define READ_BYTE() (*ip++)
+    #define READ_SHORT() (ip+=2,(uint16_t)((ip[-2])<<8 | ip[-1]))
+
+    if (opCode >= OPCODE_CALL0 && opCode <= OPCODE_CALL16) {
+        argNum = opCode - OPCODE_CALL0 + 1;
+        index = READ_SHORT();
+        args = thread->esp - argNum;
+        class = getClassOfObj(vm, args[0]);
+    } else if (opCode >= OPCODE_SUPER0 && opCode <= OPCODE_SUPER16) {
+        argNum = opCode - OPCODE_SUPER0 + 1;
+        index = READ_SHORT();
+        args = thread->esp - argNum;
+        class = VALUE_TO_CLASS(fn->constants.datas[READ_SHORT()]);
+    } else if ((opCode >= OPCODE_ADD && opCode <= OPCODE_NOT_EQUAL) ||
+        (opCode >= OPCODE_GREATER_JUMP_IF_FALSE && opCode <= OPCODE_NOT_EQUAL_JUMP_IF_FALSE)) {
+        // 操作数不都是数字的算术和比较运算
+        argNum = 2;
+        index = READ_SHORT();
+        args = thread->esp - argNum;
+        class = getClassOfObj(vm, args[0]);
+    } else {
+        switch (unfuseOpCode(opCode)) {
+            case OPCODE_STORE_UPVALUE: {
+                ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+                *(upvalue->localVarPtr) = PEEK();
+                GC_WRITE_BARRIER(vm, upvalue, PEEK());
+                return NATIVE_CONTINUE;
+            }
+            case OPCODE_STORE_MODULE_VAR:
+                fn->module->moduleVarValue.datas[READ_SHORT()] = PEEK();
+                GC_WRITE_BARRIER(vm, fn->module, PEEK());
+                return NATIVE_CONTINUE;
+            case OPCODE_STORE_THIS_FIELD: {
+                ObjInstance* objInstance = VALUE_TO_OBJINSTANCE(stackStart[0]);
+                objInstance->fields[READ_BYTE()] = PEEK();
+                GC_WRITE_BARRIER(vm, objInstance, PEEK());
+                return NATIVE_CONTINUE;
+            }
+            case OPCODE_STORE_FIELD: {
+                Value receiver = *(--thread->esp);
+                ObjInstance* objInstance = VALUE_TO_OBJINSTANCE(receiver);
+                objInstance->fields[READ_BYTE()] = PEEK();
+                GC_WRITE_BARRIER(vm, objInstance, PEEK());
+                return NATIVE_CONTINUE;
+            }
+            case OPCODE_FOR_RANGE: {
+                uint8_t seqSlot = READ_BYTE();
+                switch (stepRange(&stackStart[seqSlot])) {
+                    case RANGE_FINISHED:
+                        *thread->esp++ = VT_TO_VALUE(VT_FALSE);
+                        return NATIVE_RANGE_FINISHED;
+                    case RANGE_NEXT:
+                        *thread->esp++ = stackStart[seqSlot + 1];
+                        return NATIVE_RANGE_NEXT;
+                    default:
+                        return NATIVE_CONTINUE;
+                }
+            }
+            case OPCODE_CLOSE_UPVALUE:
+                closedUpvalue(vm, thread, thread->esp - 1);
+                thread->esp--;
+                return NATIVE_CONTINUE;
+            case OPCODE_CONSTRUCT:
+                stackStart[0] = OBJ_TO_VALUE(newObjInstance(vm, VALUE_TO_CLASS(stackStart[0])));
+                return NATIVE_CONTINUE;
+            case OPCODE_INTERPOLATE:
+                interpolate(vm, thread, READ_BYTE());
+                return NATIVE_CONTINUE;
+            case OPCODE_CREATE_CLOSURE: {
+                ObjFn* objFn = VALUE_TO_OBJFN(fn->constants.datas[READ_SHORT()]);
+                ObjClosure* objClosure = newObjClosure(vm, objFn);
+                *thread->esp++ = OBJ_TO_VALUE(objClosure);
+                uint32_t idx = 0;
+                while (idx < objFn->upvalueNum) {
+                    uint8_t isEnclosingLocalVar = READ_BYTE();
+                    uint8_t index = READ_BYTE();
+                    if (isEnclosingLocalVar) {
+                        objClosure->upvalues[idx] = createOpenUpvalue(vm, thread, stackStart + index);
+                    } else {
+                        objClosure->upvalues[idx] = frame->closure->upvalues[index];
+                    }
+                    GC_WRITE_BARRIER(vm, objClosure, OBJ_TO_VALUE(objClosure->upvalues[idx]));
+                    idx++;
+                }
+                return NATIVE_CONTINUE;
+            }
+            case OPCODE_CREATE_CLASS: {
+                uint32_t fieldNum = READ_BYTE();
+                Value superClass = *(--thread->esp);
+                Value className = PEEK();
+                validateSuperClass(vm, className, fieldNum, superClass);
+                Class* class = newClass(vm, VALUE_TO_OBJSTR(className), fieldNum, VALUE_TO_CLASS(superClass));
+                stackStart[0] = OBJ_TO_VALUE(class);
+                return NATIVE_CONTINUE;
+            }
+            case OPCODE_INSTANCE_METHOD:
+            case OPCODE_STATIC_METHOD: {
+                uint32_t methodNameIdx = READ_SHORT();
+                bindMethodAndPatch(vm, opCode, methodNameIdx, VALUE_TO_CLASS(PEEK()), thread->esp[-2]);
+                thread->esp -= 2;
+                return NATIVE_CONTINUE;
+            }
+            case OPCODE_RETURN: {
+                // 线程的最后一个frame返回时要结束线程或切换回主调线程,交给解释器
+                if (thread->usedFrameNum == 1) {
+                    frame->ip = ip - 1;
+                    return NATIVE_EXIT;
+                }
+                Value retVal = *(--thread->esp);
+                thread->usedFrameNum--;
+                closedUpvalue(vm, thread, stackStart);
+                stackStart[0] = retVal;
+                thread->esp = stackStart + 1;
+                return NATIVE_RETURN;
+            }
+            default:
+                NOT_REACHED();
+        }
+    }
+
+    method = lookupMethod(vm, &fn->inlineCaches[READ_SHORT()], class, index);
+    // 返回后从调用指令之后继续执行
+    frame->ip = ip;
+    if (method->type == MT_PRIMITIVE) {
+        if (method->primFn(vm, args)) {
+            thread->esp -= argNum - 1;
+            return NATIVE_CONTINUE;
+        }
+        return NATIVE_PRIMITIVE_FAILED;
+    }
+    return nativeCall(vm, thread, method, argNum);
+
+    #undef PEEK
+    #undef READ_BYTE
+    #undef READ_SHORT
+}
+#endif
+
+// 由字符串设置堆生长因子,须是大于1且不超过MAX_HEAP_GROWTH_FACTOR的数,否则返回false
+bool configSetHeapGrowthFactor(Configuration* config, const char* str) {
+    char* end;
+    double factor = strtod(str, &end);
+    // 写成取反的形式使nan也被拒绝,inf则超出上限
+    if (end == str || *end != '\0' || !(factor > 1 && factor <= MAX_HEAP_GROWTH_FACTOR)) {
+        return false;
+    }
+    config->heapGrowthFactor = factor;
+    return true;
+}
+
+// 由字符串设置最小堆大小,单位是字节,可带K,M,G后缀,须大于0且不超出uint64_t,否则返回false
+bool configSetMinHeapSize(Configuration* config, const char* str) {
+    char* end;
+    if (*str < '0' || *str > '9') {
+        return false;
+    }
+    errno = 0;
+    uint64_t size = strtoull(str, &end, 10);
+    if (errno == ERANGE) {
+        return false;
+    }
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || size == 0 || size > (UINT64_MAX >> shift)) {
+        return false;
+    }
+    size <<= shift;
+    config->minHeapSize = size;
+    // 首轮回收前堆也不应小于最小堆大小
+    if (config->nextGC < size) {
+        config->nextGC = size;
+    }
+    return true;
+}
+
+// 由字符串设置jit的编译阈值,须是非负整数,0表示不开启jit,否则返回false
+bool configSetJitThreshold(Configuration* config, const char* str) {
+    char* end;
+    if (*str < '0' || *str > '9') {
+        return false;
+    }
+    unsigned long threshold = strtoul(str, &end, 10);
+    if (*end != '\0' || threshold >= UINT32_MAX) {
+        return false;
+    }
+    config->jitThreshold = (uint32_t)threshold;
+    return true;
+}
+
+// 由环境变量CCC_HEAP_GROWTH_FACTOR,CCC_MIN_HEAP_SIZE和CCC_JIT_THRESHOLD覆盖默认参数
+static void loadConfigFromEnv(Configuration* config) {
+    const char* value = getenv("CCC_HEAP_GROWTH_FACTOR");
+    if (value != NULL && !configSetHeapGrowthFactor(config, value)) {
+        fprintf(stderr, "ignore invalid CCC_HEAP_GROWTH_FACTOR: %s\n", value);
+    }
+    value = getenv("CCC_MIN_HEAP_SIZE");
+    if (value != NULL && !configSetMinHeapSize(config, value)) {
+        fprintf(stderr, "ignore invalid CCC_MIN_HEAP_SIZE: %s\n", value);
+    }
+    value = getenv("CCC_JIT_THRESHOLD");
+    if (value != NULL && !configSetJitThreshold(config, value)) {
+        fprintf(stderr, "ignore invalid CCC_JIT_THRESHOLD: %s\n", value);
+    }
 }
 
 // 初始化虚拟机
 void initVM(VM* vm) {
     vm->allocatedBytes = 0;
+    vm->markedBytes = 0;
+    slabInit(&vm->slab);
     vm->allObjects = NULL;
+    vm->tmpRoots = NULL;
+    vm->tmpRootNum = 0;
+    vm->tmpRootCapacity = 0;
+    vm->methodEpoch = 0;
+    vm->inlineCacheHits = vm->inlineCacheMisses = 0;
     vm->curParser = NULL;
-    StringBufferInit(&vm->allMethodNames);
-    vm->allModules = newObjMap(vm);
-    vm->curParser = NULL;
+    vm->curThread = NULL;
+    vm->allModules = NULL;
+    // 核心类在buildCore中创建,之前须为NULL,否则同一进程中先后创建的vm可能读到上一个vm残留的指针
+    vm->classOfClass = vm->objectClass = vm->stringClass = vm->mapClass = NULL;
+    vm->rangeClass = vm->listClass = vm->nullClass = vm->boolClass = NULL;
+    vm->numberClass = vm->fnClass = vm->threadClass = NULL;
+    symbolTableInit(&vm->allMethodNames);
+    stringTableInit(&vm->stringTable);
     vm->config.heapGrowthFactor = 1.5;
 
     vm->config.minHeapSize = 1024*1024;
     vm->config.initialHeapSize = 1024*1024*10;
     vm->config.nextGC = vm->config.initialHeapSize;
+    vm->config.markThreads = GC_MARK_THREADS;
+    vm->config.jitThreshold = 0;
+#if JIT
+    vm->jitCodeArea = NULL;
+    vm->jitCodeUsed = 0;
+#endif
+    loadConfigFromEnv(&vm->config);
+    memset(&vm->memStats, 0, sizeof(vm->memStats));
     vm->grays.count = 0;
     vm->grays.capacity = 32;
 
     vm->grays.grayObjects = (ObjHeader**)malloc(vm->grays.capacity*sizeof(ObjHeader*));
+    vm->grayAgainThreads.count = vm->grayAgainThreads.capacity = 0;
+    vm->grayAgainThreads.grayObjects = NULL;
+    vm->gcPhase = GC_PHASE_IDLE;
+    vm->sweepList = NULL;
+    vm->sweptObjects = vm->sweptTail = NULL;
+    vm->gcStepDebt = 0;
+    vm->youngObjects = NULL;
+    vm->rememberedSet.count = vm->rememberedSet.capacity = 0;
+    vm->rememberedSet.grayObjects = NULL;
+    vm->oldThreads.count = vm->oldThreads.capacity = 0;
+    vm->oldThreads.grayObjects = NULL;
+    vm->youngBytes = 0;
+    vm->isMinorGC = false;
+
+    // 以上字段初始化完成后才能申请对象,申请对象时可能触发gc
+    vm->allModules = newObjMap(vm);
 }
 void freeVM(VM* vm) {
     ASSERT(vm->allMethodNames.count > 0, "VM have alrady been freed!");
-    ObjHeader* objHeader = vm->allObjects;
-    while (objHeader != NULL) {
-        ObjHeader* next = objHeader->next;
-        freeObject(vm, objHeader);
-        objHeader = next;
-    }
-    vm->grays.grayObjects = DEALLOCATE(vm, vm->grays.grayObjects);
-    StringBufferClear(vm, &vm->allMethodNames);
+    // 先释放驻留表,之后回收字符串时无需再从表中删除
+    stringTableClear(vm, &vm->stringTable);
+    // 清扫阶段已清扫的存活对象从sweptObjects开始,与其后尚未清扫的sweepList相连,
+    // 分代回收模式下新生代对象在youngObjects中
+    ObjHeader* sweepList = vm->sweptObjects != NULL ? vm->sweptObjects : vm->sweepList;
+    ObjHeader* objLists[] = {vm->allObjects, sweepList, vm->youngObjects};
+    uint32_t idx = 0;
+    while (idx < 3) {
+        ObjHeader* objHeader = objLists[idx++];
+        while (objHeader != NULL) {
+            ObjHeader* next = OBJ_NEXT(objHeader);
+            freeObject(vm, objHeader);
+            objHeader = next;
+        }
+    }
+    free(vm->grays.grayObjects);
+    free(vm->grayAgainThreads.grayObjects);
+    free(vm->rememberedSet.grayObjects);
+    free(vm->oldThreads.grayObjects);
+    free(vm->tmpRoots);
+    symbolTableClear(vm, &vm->allMethodNames);
+    slabClear(&vm->slab);
+#if JIT
+    jitFreeCode(vm);
+#endif
     DEALLOCATE(vm, vm);
 }
 
@@ -5,9 +5,17 @@
 #include "obj_map.h"
 #include "obj_thread.h"
 #include "parser.h"
+#include "slab.h"
 
-
-#define MAX_TEMP_ROOTS_NUM 8
+// 支持"标签作为值"的编译器(gcc/clang)默认使用直接线索化分派,
+// 编译时指定-DCOMPUTED_GOTO=0可退回到可移植的switch分派
+#ifndef COMPUTED_GOTO
+    #if defined(__GNUC__)
+        #define COMPUTED_GOTO 1
+    #else
+        #define COMPUTED_GOTO 0
+    #endif
+#endif
 #define OPCODE_SLOTS(opcode, effect) OPCODE_##opcode,
 typedef enum {
     #include "opcode.inc"
@@ -25,17 +33,50 @@ typedef struct {
     uint32_t count;
 } Gray;
 
+// 句柄作用域,即打开时临时根的数量
+// 原生方法和嵌入方在一段代码开始时打开,其间申请的对象用pushTmpRoot保护,
+// 结束时(包括出错返回前)关闭,一次弹出作用域内压入的所有临时根
+typedef uint32_t HandleScope;
+
+typedef enum {
+    GC_PHASE_IDLE, // 未在回收
+    GC_PHASE_MARK, // 增量标记
+    GC_PHASE_SWEEP // 增量清扫
+} GCPhase; // 垃圾回收所处的阶段
+
+// 堆生长因子的上限,再大时下一轮回收的触发点已没有意义
+#define MAX_HEAP_GROWTH_FACTOR 100
+
 typedef struct {
-    // 堆生长因子
-    int heapGrowthFactor;
+    // 堆生长因子,大于1且不超过MAX_HEAP_GROWTH_FACTOR
+    double heapGrowthFactor;
     // 初始堆栈大小默认10M
-    uint32_t initialHeapSize;
+    uint64_t initialHeapSize;
     // 最小堆大小,默认1M
-    uint32_t minHeapSize;
+    uint64_t minHeapSize;
     // 第一次触发gc的堆大小,默认为initialHeapSize
-    uint32_t nextGC;
+    uint64_t nextGC;
+    // startGC中参与标记的线程数,含当前线程,不超过GC_MARK_THREADS
+    uint32_t markThreads;
+    // 函数的执行次数达到此值时编译成机器码,0表示不开启jit
+    uint32_t jitThreshold;
 } Configuration;
 
+// 内存统计,由gcMemoryStats填充
+typedef struct {
+    uint64_t heapBytes; // 当前计入的堆大小
+    uint64_t nextGC; // 堆大小超过此值时开始下一轮完整回收
+    uint64_t liveBytes; // 上一轮完整回收标记的存活对象大小
+    // 以下按对象类型统计,存活的部分都来自上一轮完整回收的标记
+    uint64_t liveBytesByType[OBJ_TYPE_NUM];
+    uint64_t liveObjectsByType[OBJ_TYPE_NUM];
+    uint64_t objectsByType[OBJ_TYPE_NUM]; // 当前已分配的对象数,含尚未清扫的垃圾对象
+    uint32_t gcCount; // 已完成的完整回收次数
+    uint32_t minorGCCount; // 分代回收模式下的新生代回收次数
+    uint64_t totalPauseNs; // 程序因回收而暂停的总时间
+    uint64_t maxPauseNs; // 单次暂停的最长时间
+} MemoryStats;
+
 struct vm {
     Class* classOfClass;
     Class* objectClass;
@@ -48,14 +89,15 @@ struct vm {
     Class* numberClass;
     Class* fnClass;
     Class* threadClass;
-    uint32_t allocatedBytes; // 累计已分配的内存量
+    uint64_t allocatedBytes; // 累计已分配的内存量
     Parser* curParser; // 当前词法分析器
-    ObjHeader* allObjects; // 所有已分配的对象链表
+    ObjHeader* allObjects; // 所有已分配的对象链表,分代回收模式下只含老年代对象
+    ObjHeader* youngObjects; // 分代回收模式下新生代对象链表
     // 符号表中的存放的是所有类的所有方法
     // 查找流程为
     // 1. 生成类的方法的签名
     // 2. 根据签名从allMethodNames中查找其索引index(数组下标/指针偏移)
-    // 3. 根据index从当前类中(class.methods)索引方法
+    // 3. 以index为键在当前类的方法表(class.methods)中查找方法
     // class.methods中记录的方法
     // typedef struct method {
     //     MethodType type; // union 中的值由type的值决定
@@ -68,20 +110,89 @@ struct vm {
     // } Method;
     SymbolTable allMethodNames; 
     ObjMap* allModules;   // 记录源码中所有的模块
+    StringTable stringTable; // 字符串驻留表
     ObjThread* curThread; // 当前正在执行的线程
 
+    // 方法绑定或类被回收时递增,使所有调用点的内联缓存失效
+    uint32_t methodEpoch;
+    // 内联缓存的命中和未命中次数,可通过System.inlineCacheStats查看
+    uint64_t inlineCacheHits;
+    uint64_t inlineCacheMisses;
+
     // 临时的根对象集合,存储被gc保留的对象,避免回收
-    ObjHeader* tmpRoots[MAX_TEMP_ROOTS_NUM];
+    // 按栈的方式压入弹出,容量不足时自动扩容
+    ObjHeader** tmpRoots;
     uint32_t tmpRootNum;
+    uint32_t tmpRootCapacity;
     Gray grays;
+    // 标记阶段已扫描过的线程,线程的运行时栈没有写屏障,标记结束时需重新扫描
+    Gray grayAgainThreads;
+    GCPhase gcPhase;
+    // 清扫阶段尚未清扫的对象链表,清扫期间新分配的对象仍链入allObjects
+    ObjHeader* sweepList;
+    // 本轮清扫中已确认存活的对象,仍原地链在一起,sweptTail的next指向sweepList
+    ObjHeader* sweptObjects;
+    ObjHeader* sweptTail;
+    // 上次执行回收片段之后新分配的字节数
+    uint32_t gcStepDebt;
+    // 以下用于分代回收模式
+    // 引用了新生代对象的老年代对象
+    Gray rememberedSet;
+    // 老年代线程,线程的运行时栈没有写屏障,新生代回收时需全部扫描
+    Gray oldThreads;
+    // 上次新生代回收之后新分配的字节数
+    uint64_t youngBytes;
+    // 是否正在进行新生代回收
+    bool isMinorGC;
+    MemoryStats memStats;
+    // 标黑对象时累计的大小,标记结束时即存活对象的大小,以此代替allocatedBytes
+    uint64_t markedBytes;
+    // 本轮完整回收标记过程中按类型累计的存活对象大小和数量,标记结束时存入memStats
+    uint64_t markedBytesByType[OBJ_TYPE_NUM];
+    uint64_t markedObjectsByType[OBJ_TYPE_NUM];
     Configuration config;
+    SlabAllocator slab; // 小对象的分配器
+#if JIT
+    // jit生成的机器码所在的代码区,首次编译时映射,按顺序切分
+    uint8_t* jitCodeArea;
+    uint32_t jitCodeUsed;
+#endif
 };
 
+typedef enum {
+    RANGE_NOT_RANGE, // seq不是range,由其后的指令调用iterate和iteratorValue
+    RANGE_FINISHED, // range已遍历完
+    RANGE_NEXT // 已取得循环变量
+} RangeStep; // FOR_RANGE遍历range的结果
+
+#if JIT || AOT
+// jit生成的机器码和aot生成的c代码执行指令的结果
+typedef enum {
+    NATIVE_CONTINUE, // 继续执行下一条指令
+    NATIVE_RANGE_FINISHED, // FOR_RANGE遍历完range,跳到循环条件
+    NATIVE_RANGE_NEXT, // FOR_RANGE取得了循环变量,跳到循环体
+    NATIVE_CALL, // 调用脚本方法压入了新的frame
+    NATIVE_RETURN, // 方法返回,弹出了当前frame
+    NATIVE_PRIMITIVE_FAILED, // 原生方法返回false,由解释器处理出错或线程切换
+    NATIVE_EXIT // 退回到解释器,从frame->ip处的指令继续执行
+} NativeResult;
+
+int nativeSlowPath(VM* vm, ObjThread* thread, Frame* frame, uint8_t* ip);
+int nativeCall(VM* vm, ObjThread* thread, Method* method, int argNum);
+#endif
+
+bool configSetHeapGrowthFactor(Configuration* config, const char* str);
+bool configSetMinHeapSize(Configuration* config, const char* str);
+bool configSetJitThreshold(Configuration* config, const char* str);
 void initVM(VM* vm);
 VMResult executeInstruction(VM* vm, register ObjThread* curThread);
+Method* lookupMethod(VM* vm, InlineCache* cache, Class* class, int index);
+RangeStep stepRange(Value* seq);
 void ensureStack(VM* vm, ObjThread* objThread, uint32_t neededSots);
 void pushTmpRoot(VM* vm, ObjHeader* obj);
 void popTmpRoot(VM* vm);
+HandleScope openHandleScope(VM* vm);
+void closeHandleScope(VM* vm, HandleScope scope);
 void freeVM(VM* vm);
 VM* newVM(void);
 #endif